@@ -30,6 +30,7 @@
 #include "libavutil/avassert.h"
 #include "libavutil/base64.h"
 #include "libavutil/common.h"
+#include "libavutil/foveation.h"
 #include "libavutil/mathematics.h"
 #include "libavutil/opt.h"
 #include "libavutil/pixdesc.h"
@@ -92,6 +93,10 @@ typedef struct AOMEncoderContext {
     int enable_cdef;
     int enable_global_motion;
     int enable_intrabc;
+    AVFoveationMap *fov_map;
+    float *fov_offsets;   ///< map currently set in the encoder
+    int fov_unsupported;  ///< AOME_SET_ROI_MAP failed, foveation is ignored
+    int fov_model;        ///< AVFoveationModel of the map
 } AOMContext;
 
 static const char *const ctlidstr[] = {
@@ -263,6 +268,8 @@ static av_cold int aom_free(AVCodecContext *avctx)
     av_freep(&avctx->stats_out);
     free_frame_list(ctx->coded_frame_list);
     av_bsf_free(&ctx->bsf);
+    av_foveation_map_unref(ctx->fov_offsets);
+    av_foveation_map_free(&ctx->fov_map);
     return 0;
 }
 
@@ -960,11 +967,116 @@ static int queue_frames(AVCodecContext *avctx, AVPacket *pkt_out)
     return size;
 }
 
+#if HAVE_AOM_ROI_MAP_T_REF_FRAME
+// range of aom_roi_map_t.delta_q, quantizer units that libaom scales to qindex
+#define MAX_DELTA_Q 63
+
+/**
+ * Map a foveation descriptor onto AV1 segmentation.
+ *
+ * Segment 0 is the fovea, the remaining segments cover rings of increasing
+ * eccentricity with delta_q evenly spaced up to the descriptor's delta.
+ * The map is given in 4x4 mode info units, which libaom copies, so an
+ * unchanged map is not set again.
+ * Failing to set the map is not fatal, the frame is encoded without it.
+ */
+static int set_foveation_map(AVCodecContext *avctx, const AVFrameSideData *sd)
+{
+    AOMContext *ctx = avctx->priv_data;
+    const AVFoveationDescriptor *fd = (const AVFoveationDescriptor *)sd->data;
+    aom_roi_map_t roi_map;
+    float *qoffsets;
+    int delta_q[AOM_MAX_SEGMENTS];
+    int ret;
+
+    if (ctx->fov_unsupported)
+        return 0;
+
+    if (sd->size < sizeof(*fd)) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid foveation descriptor size.\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (ctx->aq_mode > 0) {
+        av_log(avctx, AV_LOG_WARNING, "Foveation is only enabled when aq-mode is 0, "
+                                      "so skipping foveation.\n");
+        ctx->fov_unsupported = 1;
+        return 0;
+    }
+
+    if (!ctx->fov_map) {
+        // mode info is 4x4, counted on the frame size aligned to 8
+        ctx->fov_map = av_foveation_map_alloc(FFALIGN(avctx->width, 8),
+                                              FFALIGN(avctx->height, 8), 4);
+        if (!ctx->fov_map)
+            return AVERROR(ENOMEM);
+    }
+
+    ret = av_foveation_map_set_model(ctx->fov_map, ctx->fov_model);
+    if (ret < 0)
+        return ret;
+
+    ret = av_foveation_map_get(ctx->fov_map, fd, &qoffsets);
+    if (ret < 0)
+        return ret;
+
+    /* cached maps are shared, so an equal pointer means an equal map */
+    if (qoffsets == ctx->fov_offsets) {
+        av_foveation_map_unref(qoffsets);
+        return 0;
+    }
+
+    memset(&roi_map, 0, sizeof(roi_map));
+    roi_map.enabled = 1;
+    roi_map.rows = ctx->fov_map->mb_rows;
+    roi_map.cols = ctx->fov_map->mb_cols;
+    roi_map.roi_map = av_malloc(roi_map.rows * roi_map.cols);
+    if (!roi_map.roi_map) {
+        av_foveation_map_unref(qoffsets);
+        return AVERROR(ENOMEM);
+    }
+
+    av_foveation_map_segment(ctx->fov_map, qoffsets, fd->delta, AOM_MAX_SEGMENTS,
+                             roi_map.roi_map, delta_q);
+    for (int i = 0; i < AOM_MAX_SEGMENTS; i++) {
+        roi_map.delta_q[i] = av_clip(delta_q[i], -MAX_DELTA_Q, MAX_DELTA_Q);
+        /* 0 is a valid reference frame, -1 leaves the choice to the encoder */
+        roi_map.ref_frame[i] = -1;
+        roi_map.skip[i] = 0;
+    }
+
+    ret = aom_codec_control(&ctx->encoder, AOME_SET_ROI_MAP, &roi_map);
+    av_freep(&roi_map.roi_map);
+    if (ret != AOM_CODEC_OK) {
+        av_log(avctx, AV_LOG_WARNING, "Failed to set AOME_SET_ROI_MAP codec control: %s, "
+               "skipping foveation.\n", aom_codec_error(&ctx->encoder));
+        ctx->fov_unsupported = 1;
+        av_foveation_map_unref(qoffsets);
+        return 0;
+    }
+
+    av_foveation_map_unref(ctx->fov_offsets);
+    ctx->fov_offsets = qoffsets;
+    return 0;
+}
+#else
+/**
+ * Older libaom has no ROI map support, its aom_roi_map_t lacks per-segment
+ * reference frames and AOME_SET_ROI_MAP always fails.
+ */
+static int set_foveation_map(AVCodecContext *avctx, const AVFrameSideData *sd)
+{
+    av_log(avctx, AV_LOG_ERROR, "Foveation needs a libaom with ROI map support.\n");
+    return AVERROR(ENOSYS);
+}
+#endif
+
 static int aom_encode(AVCodecContext *avctx, AVPacket *pkt,
                       const AVFrame *frame, int *got_packet)
 {
     AOMContext *ctx = avctx->priv_data;
     struct aom_image *rawimg = NULL;
+    const AVFrameSideData *sd;
     int64_t timestamp = 0;
     int res, coded_size;
     aom_enc_frame_flags_t flags = 0;
@@ -989,6 +1101,13 @@ static int aom_encode(AVCodecContext *avctx, AVPacket *pkt,
 
         if (frame->pict_type == AV_PICTURE_TYPE_I)
             flags |= AOM_EFLAG_FORCE_KF;
+
+        sd = av_frame_get_side_data(frame, AV_FRAME_DATA_FOVEATION_DESCRIPTOR);
+        if (sd) {
+            res = set_foveation_map(avctx, sd);
+            if (res < 0)
+                return res;
+        }
     }
 
     res = aom_codec_encode(&ctx->encoder, rawimg, timestamp,
@@ -1084,6 +1203,7 @@ static const AVOption options[] = {
     { "enable-cdef",      "Enable CDEF filtering",                 OFFSET(enable_cdef),    AV_OPT_TYPE_BOOL, {.i64 = -1}, -1, 1, VE},
     { "enable-global-motion",  "Enable global motion",             OFFSET(enable_global_motion), AV_OPT_TYPE_BOOL, {.i64 = -1}, -1, 1, VE},
     { "enable-intrabc",  "Enable intra block copy prediction mode", OFFSET(enable_intrabc), AV_OPT_TYPE_BOOL, {.i64 = -1}, -1, 1, VE},
+    AV_FOVEATION_MODEL_OPTIONS(OFFSET(fov_model), VE)
     { NULL },
 };
 
@@ -48,6 +48,8 @@ typedef struct librav1eContext {
     int tiles;
     int tile_rows;
     int tile_cols;
+
+    int fov_warned;
 } librav1eContext;
 
 static inline RaPixelRange range_map(enum AVPixelFormat pix_fmt, enum AVColorRange range)
@@ -408,6 +410,14 @@ static int librav1e_send_frame(AVCodecContext *avctx, const AVFrame *frame)
     if (frame) {
         const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
 
+        /* The rav1e C API has no per-block quantizer or segmentation control. */
+        if (!ctx->fov_warned &&
+            av_frame_get_side_data(frame, AV_FRAME_DATA_FOVEATION_DESCRIPTOR)) {
+            av_log(avctx, AV_LOG_WARNING, "Foveation is not supported by rav1e, "
+                                          "encoding at uniform quality.\n");
+            ctx->fov_warned = 1;
+        }
+
         rframe = rav1e_frame_new(ctx->ctx);
         if (!rframe) {
             av_log(avctx, AV_LOG_ERROR, "Could not allocate new rav1e frame.\n");
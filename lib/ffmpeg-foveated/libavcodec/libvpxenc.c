@@ -36,6 +36,7 @@
 #include "libavutil/avstring.h"
 #include "libavutil/base64.h"
 #include "libavutil/common.h"
+#include "libavutil/foveation.h"
 #include "libavutil/internal.h"
 #include "libavutil/intreadwrite.h"
 #include "libavutil/mathematics.h"
@@ -121,6 +122,11 @@ typedef struct VPxEncoderContext {
      * encounter a frame with ROI side data.
      */
     int roi_warned;
+
+    AVFoveationMap *fov_map;
+    /* map the active segmentation was derived from, libvpx keeps it across frames */
+    float *fov_offsets;
+    int fov_model;
 } VPxContext;
 
 /** String mappings for enum vp8e_enc_control_id */
@@ -355,6 +361,8 @@ static av_cold int vpx_free(AVCodecContext *avctx)
     av_freep(&ctx->twopass_stats.buf);
     av_freep(&avctx->stats_out);
     free_frame_list(ctx->coded_frame_list);
+    av_foveation_map_unref(ctx->fov_offsets);
+    av_foveation_map_free(&ctx->fov_map);
     return 0;
 }
 
@@ -1212,6 +1220,89 @@ static int set_roi_map(AVCodecContext *avctx, const AVFrameSideData *sd, int fra
     return 0;
 }
 
+/**
+ * Quantize a foveation map into eccentricity rings, one per segment.
+ *
+ * Segment 0 is the fovea, the remaining segments cover rings of increasing
+ * eccentricity with delta_q evenly spaced up to the descriptor's delta.
+ * @param new_offsets set to the map roi_map was built from, to be passed to
+ *                    commit_foveation_map once libvpx has taken roi_map
+ * @return 0 if roi_map was set, 1 if the map is unchanged since the last
+ *         call and libvpx still uses it, a negative AVERROR code on failure
+ */
+static int set_foveation_map(AVCodecContext *avctx, const AVFrameSideData *sd, int frame_width, int frame_height,
+                             vpx_roi_map_t *roi_map, int block_size, int segment_cnt,
+                             float **new_offsets)
+{
+    VPxContext *ctx = avctx->priv_data;
+    const AVFoveationDescriptor *fd = (const AVFoveationDescriptor *)sd->data;
+    float *qoffsets;
+    int nb_blocks;
+    int ret;
+
+    if (sd->size < sizeof(*fd)) {
+        av_log(avctx, AV_LOG_ERROR, "Invalid foveation descriptor size.\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (!ctx->fov_map) {
+        ctx->fov_map = av_foveation_map_alloc(frame_width, frame_height, block_size);
+        if (!ctx->fov_map)
+            return AVERROR(ENOMEM);
+    }
+
+    ret = av_foveation_map_set_model(ctx->fov_map, ctx->fov_model);
+    if (ret < 0)
+        return ret;
+
+    ret = av_foveation_map_get(ctx->fov_map, fd, &qoffsets);
+    if (ret < 0)
+        return ret;
+
+    /* cached maps are shared, so an equal pointer means an equal map */
+    if (qoffsets == ctx->fov_offsets) {
+        av_foveation_map_unref(qoffsets);
+        return 1;
+    }
+
+    memset(roi_map, 0, sizeof(*roi_map));
+    roi_map->rows = ctx->fov_map->mb_rows;
+    roi_map->cols = ctx->fov_map->mb_cols;
+    nb_blocks = roi_map->rows * roi_map->cols;
+    roi_map->roi_map = av_malloc(nb_blocks);
+    if (!roi_map->roi_map) {
+        av_log(avctx, AV_LOG_ERROR, "roi_map alloc failed.\n");
+        av_foveation_map_unref(qoffsets);
+        return AVERROR(ENOMEM);
+    }
+
+    av_foveation_map_segment(ctx->fov_map, qoffsets, fd->delta, segment_cnt,
+                             roi_map->roi_map, roi_map->delta_q);
+    for (int i = 0; i < segment_cnt; i++)
+        roi_map->delta_q[i] = av_clip(roi_map->delta_q[i], -MAX_DELTA_Q, MAX_DELTA_Q);
+
+    *new_offsets = qoffsets;
+    return 0;
+}
+
+/**
+ * Remember the map libvpx now uses, so an equal map is not set again.
+ * Until then the previous map stays cached, as libvpx keeps using it if
+ * setting the new one failed. A map built from ROI side data replaces the
+ * foveation map in libvpx, so the cached one is dropped.
+ * @param qoffsets map returned by set_foveation_map, NULL for ROI side data
+ * @param ret result of setting roi_map
+ */
+static void commit_foveation_map(VPxContext *ctx, float *qoffsets, int ret)
+{
+    if (ret < 0) {
+        av_foveation_map_unref(qoffsets);
+        return;
+    }
+    av_foveation_map_unref(ctx->fov_offsets);
+    ctx->fov_offsets = qoffsets;
+}
+
 static int vp9_encode_set_roi(AVCodecContext *avctx, int frame_width, int frame_height, const AVFrameSideData *sd)
 {
     VPxContext *ctx = avctx->priv_data;
@@ -1224,6 +1315,7 @@ static int vp9_encode_set_roi(AVCodecContext *avctx, int frame_width, int frame_
 
     if (major > 1 || (major == 1 && minor > 8) || (major == 1 && minor == 8 && patch >= 1)) {
         vpx_roi_map_t roi_map;
+        float *fov_offsets = NULL;
         const int segment_cnt = 8;
         const int block_size = 8;
         int ret;
@@ -1237,11 +1329,17 @@ static int vp9_encode_set_roi(AVCodecContext *avctx, int frame_width, int frame_
             }
         }
 
-        ret = set_roi_map(avctx, sd, frame_width, frame_height, &roi_map, block_size, segment_cnt);
-        if (ret) {
+        if (sd->type == AV_FRAME_DATA_FOVEATION_DESCRIPTOR)
+            ret = set_foveation_map(avctx, sd, frame_width, frame_height, &roi_map, block_size, segment_cnt,
+                                    &fov_offsets);
+        else
+            ret = set_roi_map(avctx, sd, frame_width, frame_height, &roi_map, block_size, segment_cnt);
+        if (ret < 0) {
             log_encoder_error(avctx, "Failed to set_roi_map.\n");
             return ret;
         }
+        if (ret > 0)
+            return 0;
 
         memset(roi_map.ref_frame, -1, sizeof(roi_map.ref_frame));
 
@@ -1249,6 +1347,7 @@ static int vp9_encode_set_roi(AVCodecContext *avctx, int frame_width, int frame_
             log_encoder_error(avctx, "Failed to set VP9E_SET_ROI_MAP codec control.\n");
             ret = AVERROR_INVALIDDATA;
         }
+        commit_foveation_map(ctx, fov_offsets, ret);
         av_freep(&roi_map.roi_map);
         return ret;
     }
@@ -1265,20 +1364,30 @@ static int vp9_encode_set_roi(AVCodecContext *avctx, int frame_width, int frame_
 static int vp8_encode_set_roi(AVCodecContext *avctx, int frame_width, int frame_height, const AVFrameSideData *sd)
 {
     vpx_roi_map_t roi_map;
+    float *fov_offsets = NULL;
     const int segment_cnt = 4;
     const int block_size = 16;
     VPxContext *ctx = avctx->priv_data;
 
-    int ret = set_roi_map(avctx, sd, frame_width, frame_height, &roi_map, block_size, segment_cnt);
-    if (ret) {
+    int ret;
+
+    if (sd->type == AV_FRAME_DATA_FOVEATION_DESCRIPTOR)
+        ret = set_foveation_map(avctx, sd, frame_width, frame_height, &roi_map, block_size, segment_cnt,
+                                &fov_offsets);
+    else
+        ret = set_roi_map(avctx, sd, frame_width, frame_height, &roi_map, block_size, segment_cnt);
+    if (ret < 0) {
         log_encoder_error(avctx, "Failed to set_roi_map.\n");
         return ret;
     }
+    if (ret > 0)
+        return 0;
 
     if (vpx_codec_control(&ctx->encoder, VP8E_SET_ROI_MAP, &roi_map)) {
         log_encoder_error(avctx, "Failed to set VP8E_SET_ROI_MAP codec control.\n");
         ret = AVERROR_INVALIDDATA;
     }
+    commit_foveation_map(ctx, fov_offsets, ret);
 
     av_freep(&roi_map.roi_map);
     return ret;
@@ -1324,6 +1433,7 @@ static int vpx_encode(AVCodecContext *avctx, AVPacket *pkt,
 
     if (frame) {
         const AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+        const AVFrameSideData *fov = av_frame_get_side_data(frame, AV_FRAME_DATA_FOVEATION_DESCRIPTOR);
         rawimg                      = &ctx->rawimg;
         rawimg->planes[VPX_PLANE_Y] = frame->data[0];
         rawimg->planes[VPX_PLANE_U] = frame->data[1];
@@ -1359,6 +1469,9 @@ static int vpx_encode(AVCodecContext *avctx, AVPacket *pkt,
             }
         }
 
+        /* foveation takes precedence over ROI, as in libx264/libx265 */
+        if (fov)
+            sd = fov;
         if (sd) {
             if (avctx->codec_id == AV_CODEC_ID_VP8) {
                 vp8_encode_set_roi(avctx, frame->width, frame->height, sd);
@@ -1446,7 +1559,8 @@ static int vpx_encode(AVCodecContext *avctx, AVPacket *pkt,
     {"arnr_strength", "altref noise reduction filter strength", offsetof(VPxContext, arnr_strength), AV_OPT_TYPE_INT, {.i64 = 3}, 0, 6, VE}, \
     {"arnr_type", "altref noise reduction filter type", offsetof(VPxContext, arnr_type), AV_OPT_TYPE_INT, {.i64 = 3}, 1, 3, VE}, \
     {"rc_lookahead", "Number of frames to look ahead for alternate reference frame selection", offsetof(VPxContext, lag_in_frames), AV_OPT_TYPE_INT, {.i64 = 25}, 0, 25, VE}, \
-    {"sharpness", "Increase sharpness at the expense of lower PSNR", offsetof(VPxContext, sharpness), AV_OPT_TYPE_INT, {.i64 = -1}, -1, 7, VE},
+    {"sharpness", "Increase sharpness at the expense of lower PSNR", offsetof(VPxContext, sharpness), AV_OPT_TYPE_INT, {.i64 = -1}, -1, 7, VE}, \
+    AV_FOVEATION_MODEL_OPTIONS(offsetof(VPxContext, fov_model), VE)
 
 #if CONFIG_LIBVPX_VP8_ENCODER
 static const AVOption vp8_options[] = {
@@ -20,6 +20,7 @@
  */
 
 #include "libavutil/eval.h"
+#include "libavutil/foveation.h"
 #include "libavutil/internal.h"
 #include "libavutil/opt.h"
 #include "libavutil/mem.h"
@@ -105,6 +106,9 @@ typedef struct X264Context {
      * encounter a frame with ROI side data.
      */
     int roi_warned;
+
+    AVFoveationMap *fov_map;
+    int fov_model;
 } X264Context;
 
 static void X264_log(void *p, int level, const char *fmt, va_list args)
@@ -283,49 +287,6 @@ static void reconfig_encoder(AVCodecContext *ctx, const AVFrame *frame)
     }
 }
 
-/**
- * Create gaussian-shaped quantization offset map
- *
- * @param x_fix relative fixation point, horizontal. 0 is left, 1 is right.
- * @param y_fix relative fixation point, vertical. 0 is top, 1 is bottom.
- * @param sigma standard deviation of the gaussian. 1 equals the video diagonal.
- * @param delta maximal quality difference between the (mostly) unaffected fixation center and the limit of the gaussian in QP
- * @param i_width image height
- * @param i_height image width
- * @param mb_size macro block size
- *
- * @return float array of quantization offsets for each MB in raster scan order
- */
-static float *foveation_qp_offset_map(float x_fix, float y_fix, float sigma, float delta, int w, int h, int mb_size)
-{
-    float gaussian;
-    int x_blocks = (w + mb_size - 1) / mb_size;
-    int y_blocks = (h + mb_size - 1) / mb_size;
-
-    // block quantization offset map
-    float *qomap = malloc(x_blocks * y_blocks * sizeof(float));
-    if (!qomap) {
-        perror("failed to allocate foveated_quantization_offset_map");
-        exit(EXIT_FAILURE);
-    }
-
-    // transform relative coordinates to block coordinates:
-    x_fix = x_fix * x_blocks;
-    y_fix = y_fix * y_blocks;
-    sigma =  sigma * sqrt(pow(x_blocks, 2) + pow(y_blocks, 2));
-
-    for (int x=0; x<x_blocks; x++) {
-        for (int y=0; y<y_blocks; y++) {
-            gaussian = exp(- (pow(x-x_fix, 2) + pow(y-y_fix, 2)) / pow(sigma, 2));
-
-            // invert, shift and scale the gaussian
-            qomap[x + y * x_blocks] = delta * (1 - gaussian);
-        }
-    }
-
-    return qomap;
-}
-
 static int X264_frame(AVCodecContext *ctx, AVPacket *pkt, const AVFrame *frame,
                       int *got_packet)
 {
@@ -477,16 +438,37 @@ static int X264_frame(AVCodecContext *ctx, AVPacket *pkt, const AVFrame *frame,
                     av_log(ctx, AV_LOG_WARNING, "Adaptive quantization must be enabled to use foveated encoding, skipping foveation.\n");
                 }
             } else {
-                float *d;
+                const AVFoveationDescriptor *fd = (const AVFoveationDescriptor *)sd->data;
+                float *qoffsets;
 
                 av_log(ctx, AV_LOG_DEBUG, "Setting foveated qp offsets.\n");
 
-                d = (float*) sd->data;
-                x4->pic.prop.quant_offsets = foveation_qp_offset_map(d[0], d[1], d[2], d[3],
-                    x4->params.i_width,
-                    x4->params.i_height,
-                    MB_SIZE);
-                x4->pic.prop.quant_offsets_free = free;
+                if (sd->size < sizeof(*fd)) {
+                    av_log(ctx, AV_LOG_ERROR, "Invalid foveation descriptor size.\n");
+                    return AVERROR(EINVAL);
+                }
+                if (!x4->fov_map) {
+                    x4->fov_map = av_foveation_map_alloc(x4->params.i_width,
+                                                         x4->params.i_height,
+                                                         MB_SIZE);
+                    if (!x4->fov_map)
+                        return AVERROR(ENOMEM);
+                }
+
+                ret = av_foveation_map_set_model(x4->fov_map, x4->fov_model);
+                if (ret < 0)
+                    return ret;
+
+                /* cached and shared between frames, x264 releases its reference */
+                ret = av_foveation_map_get(x4->fov_map, fd, &qoffsets);
+                if (ret < 0)
+                    return ret;
+
+                /* foveation takes precedence over a ROI map set above */
+                if (x4->pic.prop.quant_offsets_free)
+                    x4->pic.prop.quant_offsets_free(x4->pic.prop.quant_offsets);
+                x4->pic.prop.quant_offsets = qoffsets;
+                x4->pic.prop.quant_offsets_free = av_foveation_map_unref;
             }
         }
     }
@@ -555,6 +537,7 @@ static av_cold int X264_close(AVCodecContext *avctx)
     av_freep(&avctx->extradata);
     av_freep(&x4->sei);
     av_freep(&x4->reordered_opaque);
+    av_foveation_map_free(&x4->fov_map);
 
     if (x4->enc) {
         x264_encoder_close(x4->enc);
@@ -1175,6 +1158,7 @@ static const AVOption options[] = {
     { "noise_reduction", "Noise reduction",                               OFFSET(noise_reduction), AV_OPT_TYPE_INT, { .i64 = -1 }, INT_MIN, INT_MAX, VE },
 
     { "x264-params",  "Override the x264 configuration using a :-separated list of key=value parameters", OFFSET(x264_params), AV_OPT_TYPE_DICT, { 0 }, 0, 0, VE },
+    AV_FOVEATION_MODEL_OPTIONS(OFFSET(fov_model), VE)
     { NULL },
 };
 
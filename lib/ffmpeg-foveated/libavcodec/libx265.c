@@ -29,6 +29,7 @@
 
 #include "libavutil/internal.h"
 #include "libavutil/common.h"
+#include "libavutil/foveation.h"
 #include "libavutil/opt.h"
 #include "libavutil/pixdesc.h"
 #include "avcodec.h"
@@ -54,6 +55,11 @@ typedef struct libx265Context {
      * encounter a frame with ROI side data.
      */
     int roi_warned;
+
+    AVFoveationMap *fov_map;
+    /* cached map passed with the current picture, x265 copies it on encode */
+    float *fov_offsets;
+    int fov_model;
 } libx265Context;
 
 static int is_keyframe(NalUnitType naltype)
@@ -76,6 +82,7 @@ static av_cold int libx265_encode_close(AVCodecContext *avctx)
     libx265Context *ctx = avctx->priv_data;
 
     ctx->api->param_free(ctx->params);
+    av_foveation_map_free(&ctx->fov_map);
 
     if (ctx->encoder)
         ctx->api->encoder_close(ctx->encoder);
@@ -405,48 +412,6 @@ static av_cold int libx265_encode_init(AVCodecContext *avctx)
     return 0;
 }
 
-/**
- * Create gaussian-shaped quantization offset map
- *
- * @param x_fix relative fixation point, horizontal. 0 is left, 1 is right.
- * @param y_fix relative fixation point, vertical. 0 is top, 1 is bottom.
- * @param sigma standard deviation of the gaussian. 1 equals the video diagonal.
- * @param delta maximal quality difference between the (mostly) unaffected fixation center and the limit of the gaussian in QP
- * @param i_width image height
- * @param i_height image width
- * @param mb_size macro block size
- *
- * @return float array of quantization offsets for each MB in raster scan order
- */
-static float *foveation_qp_offset_map(float x_fix, float y_fix, float sigma, float delta, int w, int h, int mb_size)
-{
-    float gaussian;
-    int x_blocks = (w + mb_size - 1) / mb_size;
-    int y_blocks = (h + mb_size - 1) / mb_size;
-
-    // block quantization offset map
-    float *qomap = malloc(x_blocks * y_blocks * sizeof(float));
-    if (!qomap) {
-        perror("failed to allocate foveated_quantization_offset_map");
-        exit(EXIT_FAILURE);
-    }
-
-    // transform relative coordinates to block coordinates:
-    x_fix = x_fix * x_blocks;
-    y_fix = y_fix * y_blocks;
-    sigma =  sigma * sqrt(pow(x_blocks, 2) + pow(y_blocks, 2));
-
-    for (int x=0; x<x_blocks; x++) {
-        for (int y=0; y<y_blocks; y++) {
-            gaussian = exp(- (pow(x-x_fix, 2) + pow(y-y_fix, 2)) / pow(sigma, 2));
-            // invert, shift and scale the gaussian
-            qomap[x + y * x_blocks] = delta * (1 - gaussian);
-        }
-    }
-
-    return qomap;
-}
-
 static av_cold int libx265_encode_set_roi(libx265Context *ctx, const AVFrame *frame, x265_picture* pic)
 {
     AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
@@ -516,13 +481,37 @@ static av_cold int libx265_encode_set_roi(libx265Context *ctx, const AVFrame *fr
                     av_log(ctx, AV_LOG_WARNING, "Adaptive quantization must be enabled to use foveated encoding, skipping foveation.\n");
                 }
             } else {
-                float *d;
+                const AVFoveationDescriptor *fd = (const AVFoveationDescriptor *)sd->data;
+                /* 8x8 block when qg-size is 8, 16*16 block otherwise. */
+                int mb_size = (ctx->params->rc.qgSize == 8) ? 8 : 16;
+                float *qoffsets;
+                int ret;
+
                 av_log(ctx, AV_LOG_DEBUG, "Setting foveated qp offsets\n");
-                d = (float*) sd->data;
-                pic->quantOffsets = foveation_qp_offset_map(d[0], d[1], d[2], d[3],
-                    ctx->params->sourceWidth,
-                    ctx->params->sourceHeight,
-                    ctx->params->rc.qgSize);
+
+                if (sd->size < sizeof(*fd)) {
+                    av_log(ctx, AV_LOG_ERROR, "Invalid foveation descriptor size.\n");
+                    return AVERROR(EINVAL);
+                }
+                if (!ctx->fov_map) {
+                    ctx->fov_map = av_foveation_map_alloc(frame->width, frame->height,
+                                                          mb_size);
+                    if (!ctx->fov_map)
+                        return AVERROR(ENOMEM);
+                }
+
+                ret = av_foveation_map_set_model(ctx->fov_map, ctx->fov_model);
+                if (ret < 0)
+                    return ret;
+
+                ret = av_foveation_map_get(ctx->fov_map, fd, &qoffsets);
+                if (ret < 0)
+                    return ret;
+
+                /* foveation takes precedence over a ROI map set above */
+                av_freep(&pic->quantOffsets);
+                pic->quantOffsets = qoffsets;
+                ctx->fov_offsets  = qoffsets;
             }
         }
 
@@ -568,7 +557,13 @@ static int libx265_encode_frame(AVCodecContext *avctx, AVPacket *pkt,
     ret = ctx->api->encoder_encode(ctx->encoder, &nal, &nnal,
                                    pic ? &x265pic : NULL, &x265pic_out);
 
-    av_freep(&x265pic.quantOffsets);
+    if (ctx->fov_offsets) {
+        av_foveation_map_unref(ctx->fov_offsets);
+        ctx->fov_offsets = NULL;
+        x265pic.quantOffsets = NULL;
+    } else {
+        av_freep(&x265pic.quantOffsets);
+    }
 
     if (ret < 0)
         return AVERROR_EXTERNAL;
@@ -701,6 +696,7 @@ static const AVOption options[] = {
     { "tune",        "set the x265 tune parameter",                                                 OFFSET(tune),      AV_OPT_TYPE_STRING, { 0 }, 0, 0, VE },
     { "profile",     "set the x265 profile",                                                        OFFSET(profile),   AV_OPT_TYPE_STRING, { 0 }, 0, 0, VE },
     { "x265-params", "set the x265 configuration using a :-separated list of key=value parameters", OFFSET(x265_opts), AV_OPT_TYPE_DICT,   { 0 }, 0, 0, VE },
+    AV_FOVEATION_MODEL_OPTIONS(OFFSET(fov_model), VE)
     { NULL }
 };
 
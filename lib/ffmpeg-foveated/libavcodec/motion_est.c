@@ -882,6 +882,52 @@ static inline int get_penalty_factor(int lambda, int lambda2, int type){
     }
 }
 
+enum FoveationMEBudget {
+    FOV_ME_FULL,    ///< full search and sub-pel refinement
+    FOV_ME_REDUCED, ///< reduced search window, integer-pel only
+    FOV_ME_ZERO,    ///< zero vector only
+};
+
+/**
+ * Select the motion estimation effort of an MB from its eccentricity.
+ */
+static enum FoveationMEBudget foveation_me_budget(MpegEncContext *s,
+                                                  int mb_x, int mb_y)
+{
+    float dx, dy, ecc2;
+
+    if (!s->fov_me)
+        return FOV_ME_FULL;
+
+    // squared eccentricity in units of sigma
+    dx   = mb_x - s->fov_me_x;
+    dy   = mb_y - s->fov_me_y;
+    ecc2 = (dx * dx + dy * dy) * s->fov_me_scale;
+
+    if (s->fov_me_zero_ecc > 0 && ecc2 >= s->fov_me_zero_ecc * s->fov_me_zero_ecc)
+        return FOV_ME_ZERO;
+    if (s->fov_me_ecc > 0 && ecc2 >= s->fov_me_ecc * s->fov_me_ecc)
+        return FOV_ME_REDUCED;
+    return FOV_ME_FULL;
+}
+
+/**
+ * Integer-pel replacement for sub_motion_search(), the score is returned
+ * in mb_cmp like after a sub-pel search.
+ */
+static int full_pel_motion_search(MpegEncContext *s, int *mx_ptr, int *my_ptr,
+                                  int dmin, int src_index, int ref_index,
+                                  int size, int h)
+{
+    const int shift = 1 + s->quarter_sample;
+
+    *mx_ptr <<= shift;
+    *my_ptr <<= shift;
+    if (s->avctx->me_cmp != s->avctx->mb_cmp)
+        dmin = get_mb_score(s, *mx_ptr, *my_ptr, src_index, ref_index, size, h, 1);
+    return dmin;
+}
+
 void ff_estimate_p_frame_motion(MpegEncContext * s,
                                 int mb_x, int mb_y)
 {
@@ -894,6 +940,10 @@ void ff_estimate_p_frame_motion(MpegEncContext * s,
     const int shift= 1+s->quarter_sample;
     int mb_type=0;
     Picture * const pic= &s->current_picture;
+    const enum FoveationMEBudget budget = foveation_me_budget(s, mb_x, mb_y);
+    int (*sub_motion_search)(MpegEncContext *s, int *mx_ptr, int *my_ptr,
+                             int dmin, int src_index, int ref_index,
+                             int size, int h) = c->sub_motion_search;
 
     init_ref(c, s->new_picture.f->data, s->last_picture.f->data, NULL, 16*mb_x, 16*mb_y, 0);
 
@@ -909,6 +959,14 @@ void ff_estimate_p_frame_motion(MpegEncContext * s,
     get_limits(s, 16*mb_x, 16*mb_y);
     c->skip=0;
 
+    if (budget == FOV_ME_REDUCED) {
+        c->xmin = FFMAX(c->xmin, -s->fov_me_range);
+        c->ymin = FFMAX(c->ymin, -s->fov_me_range);
+        c->xmax = FFMIN(c->xmax,  s->fov_me_range);
+        c->ymax = FFMIN(c->ymax,  s->fov_me_range);
+        sub_motion_search = full_pel_motion_search;
+    }
+
     /* intra / predictive decision */
     pix = c->src[0][0];
     sum  = s->mpvencdsp.pix_sum(pix, s->linesize);
@@ -919,7 +977,11 @@ void ff_estimate_p_frame_motion(MpegEncContext * s,
     pic->mb_var [s->mb_stride * mb_y + mb_x] = (varc+128)>>8;
     c->mb_var_sum_temp += (varc+128)>>8;
 
-    if (s->motion_est != FF_ME_ZERO) {
+    if (budget == FOV_ME_ZERO) {
+        /* the early skip path, with a real score for the intra decision */
+        dmin = get_mb_score(s, 0, 0, 0, 0, 0, 16, 0);
+        c->skip = 1;
+    } else if (s->motion_est != FF_ME_ZERO) {
         const int mot_stride = s->b8_stride;
         const int mot_xy = s->block_index[0];
 
@@ -976,7 +1038,7 @@ void ff_estimate_p_frame_motion(MpegEncContext * s,
         if (varc*2 + 200*256 > vard || s->qscale > 24){
 //        if (varc*2 + 200*256 + 50*(s->lambda2>>FF_LAMBDA_SHIFT) > vard){
             mb_type|= CANDIDATE_MB_TYPE_INTER;
-            c->sub_motion_search(s, &mx, &my, dmin, 0, 0, 0, 16);
+            sub_motion_search(s, &mx, &my, dmin, 0, 0, 0, 16);
             if (s->mpv_flags & FF_MPV_FLAG_MV0)
                 if(mx || my)
                     mb_type |= CANDIDATE_MB_TYPE_SKIPPED; //FIXME check difference
@@ -985,7 +1047,7 @@ void ff_estimate_p_frame_motion(MpegEncContext * s,
             my <<=shift;
         }
         if ((s->avctx->flags & AV_CODEC_FLAG_4MV)
-           && !c->skip && varc>50<<8 && vard>10<<8){
+           && !c->skip && budget == FOV_ME_FULL && varc>50<<8 && vard>10<<8){
             if(h263_mv4_search(s, mx, my, shift) < INT_MAX)
                 mb_type|=CANDIDATE_MB_TYPE_INTER4V;
 
@@ -993,7 +1055,7 @@ void ff_estimate_p_frame_motion(MpegEncContext * s,
         }else
             set_p_mv_tables(s, mx, my, 1);
         if ((s->avctx->flags & AV_CODEC_FLAG_INTERLACED_ME)
-           && !c->skip){ //FIXME varc/d checks
+           && !c->skip && budget == FOV_ME_FULL){ //FIXME varc/d checks
             if(interlaced_search(s, 0, s->p_field_mv_table, s->p_field_select_table, mx, my, 0) < INT_MAX)
                 mb_type |= CANDIDATE_MB_TYPE_INTER_I;
         }
@@ -1001,12 +1063,12 @@ void ff_estimate_p_frame_motion(MpegEncContext * s,
         int intra_score, i;
         mb_type= CANDIDATE_MB_TYPE_INTER;
 
-        dmin= c->sub_motion_search(s, &mx, &my, dmin, 0, 0, 0, 16);
+        dmin= sub_motion_search(s, &mx, &my, dmin, 0, 0, 0, 16);
         if(c->avctx->me_sub_cmp != c->avctx->mb_cmp && !c->skip)
             dmin= get_mb_score(s, mx, my, 0, 0, 0, 16, 1);
 
         if ((s->avctx->flags & AV_CODEC_FLAG_4MV)
-           && !c->skip && varc>50<<8 && vard>10<<8){
+           && !c->skip && budget == FOV_ME_FULL && varc>50<<8 && vard>10<<8){
             int dmin4= h263_mv4_search(s, mx, my, shift);
             if(dmin4 < dmin){
                 mb_type= CANDIDATE_MB_TYPE_INTER4V;
@@ -1014,7 +1076,7 @@ void ff_estimate_p_frame_motion(MpegEncContext * s,
             }
         }
         if ((s->avctx->flags & AV_CODEC_FLAG_INTERLACED_ME)
-           && !c->skip){ //FIXME varc/d checks
+           && !c->skip && budget == FOV_ME_FULL){ //FIXME varc/d checks
             int dmin_i= interlaced_search(s, 0, s->p_field_mv_table, s->p_field_select_table, mx, my, 0);
             if(dmin_i < dmin){
                 mb_type = CANDIDATE_MB_TYPE_INTER_I;
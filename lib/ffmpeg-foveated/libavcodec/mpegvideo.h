@@ -56,6 +56,7 @@
 #include "thread.h"
 #include "videodsp.h"
 
+#include "libavutil/foveation.h"
 #include "libavutil/opt.h"
 #include "libavutil/timecode.h"
 
@@ -551,6 +552,16 @@ typedef struct MpegEncContext {
     float rc_initial_cplx;
     float rc_buffer_aggressivity;
     float border_masking;
+    int masking_quant;          ///< adaptive quantization requested by the masking options
+    AVFoveationMap *fov_map;
+    float *fov_offsets;         ///< per-MB QP offsets of the current picture, NULL if not foveated
+    float fov_me_ecc;           ///< eccentricity in foveation sigmas beyond which ME is reduced
+    float fov_me_zero_ecc;      ///< eccentricity beyond which only the zero vector is used
+    int fov_me_range;           ///< search range in pixels of the reduced ME
+    int fov_model;              ///< AVFoveationModel of the QP offsets
+    int fov_me;                 ///< ME budget is active for the current picture
+    float fov_me_x, fov_me_y;   ///< fixation point in MB units
+    float fov_me_scale;         ///< 1 / sigma^2 in MB units
     int lmin, lmax;
     int vbv_ignore_qmax;
 
@@ -641,6 +652,10 @@ FF_MPV_OPT_CMP_FUNC, \
 {"rc_init_cplx", "initial complexity for 1-pass encoding",          FF_MPV_OFFSET(rc_initial_cplx), AV_OPT_TYPE_FLOAT, {.dbl = 0 }, -FLT_MAX, FLT_MAX, FF_MPV_OPT_FLAGS},       \
 {"rc_buf_aggressivity", "currently useless",                        FF_MPV_OFFSET(rc_buffer_aggressivity), AV_OPT_TYPE_FLOAT, {.dbl = 1.0 }, -FLT_MAX, FLT_MAX, FF_MPV_OPT_FLAGS}, \
 {"border_mask", "increase the quantizer for macroblocks close to borders", FF_MPV_OFFSET(border_masking), AV_OPT_TYPE_FLOAT, {.dbl = 0 }, -FLT_MAX, FLT_MAX, FF_MPV_OPT_FLAGS},    \
+{"fov_me_ecc", "reduce motion estimation to integer-pel beyond this eccentricity (in foveation sigmas)", FF_MPV_OFFSET(fov_me_ecc), AV_OPT_TYPE_FLOAT, {.dbl = 0 }, 0, FLT_MAX, FF_MPV_OPT_FLAGS}, \
+{"fov_me_zero_ecc", "use the zero vector only beyond this eccentricity (in foveation sigmas)", FF_MPV_OFFSET(fov_me_zero_ecc), AV_OPT_TYPE_FLOAT, {.dbl = 0 }, 0, FLT_MAX, FF_MPV_OPT_FLAGS}, \
+{"fov_me_range", "search range in pixels of the reduced motion estimation", FF_MPV_OFFSET(fov_me_range), AV_OPT_TYPE_INT, {.i64 = 4 }, 0, INT_MAX, FF_MPV_OPT_FLAGS}, \
+AV_FOVEATION_MODEL_OPTIONS(FF_MPV_OFFSET(fov_model), FF_MPV_OPT_FLAGS) \
 {"lmin", "minimum Lagrange factor (VBR)",                           FF_MPV_OFFSET(lmin), AV_OPT_TYPE_INT, {.i64 =  2*FF_QP2LAMBDA }, 0, INT_MAX, FF_MPV_OPT_FLAGS },            \
 {"lmax", "maximum Lagrange factor (VBR)",                           FF_MPV_OFFSET(lmax), AV_OPT_TYPE_INT, {.i64 = 31*FF_QP2LAMBDA }, 0, INT_MAX, FF_MPV_OPT_FLAGS },            \
 {"ibias", "intra quant bias",                                       FF_MPV_OFFSET(intra_quant_bias), AV_OPT_TYPE_INT, {.i64 = FF_DEFAULT_QUANT_BIAS }, INT_MIN, INT_MAX, FF_MPV_OPT_FLAGS },   \
@@ -418,14 +418,16 @@ FF_ENABLE_DEPRECATION_WARNINGS
     /* Fixed QSCALE */
     s->fixed_qscale = !!(avctx->flags & AV_CODEC_FLAG_QSCALE);
 
-    s->adaptive_quant = (s->avctx->lumi_masking ||
-                         s->avctx->dark_masking ||
-                         s->avctx->temporal_cplx_masking ||
-                         s->avctx->spatial_cplx_masking  ||
-                         s->avctx->p_masking      ||
-                         s->border_masking ||
-                         (s->mpv_flags & FF_MPV_FLAG_QP_RD)) &&
-                        !s->fixed_qscale;
+    s->masking_quant = (s->avctx->lumi_masking ||
+                        s->avctx->dark_masking ||
+                        s->avctx->temporal_cplx_masking ||
+                        s->avctx->spatial_cplx_masking  ||
+                        s->avctx->p_masking      ||
+                        s->border_masking ||
+                        (s->mpv_flags & FF_MPV_FLAG_QP_RD)) &&
+                       !s->fixed_qscale;
+    // foveated pictures enable it per picture in encode_picture()
+    s->adaptive_quant = s->masking_quant;
 
     s->loop_filter = !!(s->avctx->flags & AV_CODEC_FLAG_LOOP_FILTER);
 
@@ -1084,6 +1086,10 @@ av_cold int ff_mpv_encode_end(AVCodecContext *avctx)
     ff_free_picture_tables(&s->new_picture);
     ff_mpeg_unref_picture(s->avctx, &s->new_picture);
 
+    av_foveation_map_unref(s->fov_offsets);
+    s->fov_offsets = NULL;
+    av_foveation_map_free(&s->fov_map);
+
     av_freep(&s->avctx->stats_out);
     av_freep(&s->ac_stats);
 
@@ -3650,6 +3656,76 @@ static void set_frame_distances(MpegEncContext * s){
     }
 }
 
+/**
+ * Look up the QP offset map for the foveation descriptor of the new picture.
+ * Adaptive quantization is enabled for foveated pictures, so the offsets
+ * are folded into the lambda table by the rate control. The fixation is also
+ * kept for the eccentricity-dependent motion estimation budget.
+ */
+static int update_foveation(MpegEncContext *s)
+{
+    const AVFrameSideData *sd;
+    const AVFoveationDescriptor *fd;
+    float sigma;
+    int ret;
+
+    av_foveation_map_unref(s->fov_offsets);
+    s->fov_offsets = NULL;
+    s->adaptive_quant = s->masking_quant;
+    s->fov_me = 0;
+
+    sd = av_frame_get_side_data(s->new_picture.f, AV_FRAME_DATA_FOVEATION_DESCRIPTOR);
+    if (!sd)
+        return 0;
+
+    switch (s->codec_id) {
+    case AV_CODEC_ID_MPEG1VIDEO:
+    case AV_CODEC_ID_MPEG2VIDEO:
+    case AV_CODEC_ID_MPEG4:
+    case AV_CODEC_ID_H263:
+    case AV_CODEC_ID_H263P:
+        break;
+    default:
+        return 0;
+    }
+
+    fd = (const AVFoveationDescriptor *)sd->data;
+    if (sd->size < sizeof(*fd)) {
+        av_log(s->avctx, AV_LOG_ERROR, "Invalid foveation descriptor size.\n");
+        return AVERROR(EINVAL);
+    }
+
+    if ((s->fov_me_ecc > 0 || s->fov_me_zero_ecc > 0) &&
+        isfinite(fd->x) && isfinite(fd->y) && isfinite(fd->sigma)) {
+        // same geometry as the QP offset map
+        sigma = fd->sigma * hypotf(s->mb_width, s->mb_height);
+        s->fov_me       = 1;
+        s->fov_me_x     = fd->x * s->mb_width;
+        s->fov_me_y     = fd->y * s->mb_height;
+        s->fov_me_scale = sigma > 0 ? 1.0f / (sigma * sigma) : FLT_MAX;
+    }
+
+    if (s->fixed_qscale)
+        return 0;
+
+    if (!s->fov_map) {
+        s->fov_map = av_foveation_map_alloc(s->mb_width * 16, s->mb_height * 16, 16);
+        if (!s->fov_map)
+            return AVERROR(ENOMEM);
+    }
+
+    ret = av_foveation_map_set_model(s->fov_map, s->fov_model);
+    if (ret < 0)
+        return ret;
+
+    ret = av_foveation_map_get(s->fov_map, fd, &s->fov_offsets);
+    if (ret < 0)
+        return ret;
+
+    s->adaptive_quant = 1;
+    return 0;
+}
+
 static int encode_picture(MpegEncContext *s, int picture_number)
 {
     int i, ret;
@@ -3658,6 +3734,10 @@ static int encode_picture(MpegEncContext *s, int picture_number)
 
     s->picture_number = picture_number;
 
+    ret = update_foveation(s);
+    if (ret < 0)
+        return ret;
+
     /* Reset the average MB variance */
     s->me.mb_var_sum_temp    =
     s->me.mc_mb_var_sum_temp = 0;
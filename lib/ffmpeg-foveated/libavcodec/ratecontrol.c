@@ -844,6 +844,10 @@ static void adaptive_quantization(MpegEncContext *s, double q)
             newq *= bits_sum / cplx_sum;
         }
 
+        // foveation offsets are in qscale units and not normalized by NAQ
+        if (s->fov_offsets)
+            newq += s->fov_offsets[i] * FF_QP2LAMBDA;
+
         intq = (int)(newq + 0.5);
 
         if (intq > qmax)
@@ -0,0 +1,410 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdatomic.h>
+
+#include "attributes.h"
+#include "buffer.h"
+#include "common.h"
+#include "error.h"
+#include "foveation.h"
+#include "foveation_dsp.h"
+#include "mem.h"
+
+#define CACHE_SIZE 4
+
+// quantization steps per block (position, sigma) and per QP (delta)
+#define QUANT_POS   8
+#define QUANT_DELTA 64
+
+// pool buffers start with a MapHeader, the map itself follows at this offset
+#define MAP_OFFSET  64
+
+// acuity tables: entries per degree of eccentricity, larger ones are clamped
+#define LUT_STEPS   8
+#define LUT_SIZE    (90 * LUT_STEPS + 1)
+
+// QP offset per halving of the resolvable detail
+#define QP_PER_OCTAVE 6.0f
+
+// eccentricity in degrees at which the MAR doubles, Guenter et al. 2012
+#define MAR_E2 0.95f
+
+// Geisler-Perry contrast sensitivity: half-resolution eccentricity,
+// spatial frequency decay constant and minimal contrast threshold
+#define GP_E2    2.3f
+#define GP_ALPHA 0.106f
+#define GP_CT0   (1.0f / 64)
+
+typedef struct MapHeader {
+    AVBufferRef *buf;   ///< pool reference backing this map
+    atomic_uint users;  ///< the cache entry plus every external reference
+} MapHeader;
+
+typedef struct CacheEntry {
+    int key[4];
+    MapHeader *hdr;
+    unsigned last_used;
+} CacheEntry;
+
+typedef struct FoveationMapPriv {
+    AVFoveationMap p;
+
+    float *hprofile; ///< gaussian or squared distance along the columns, 32-byte aligned
+    float *vprofile; ///< gaussian along the rows
+
+    float *lut;      ///< QP offset of the acuity model by eccentricity
+    float *ring;     ///< lut clipped for the descriptor of a map
+
+    FoveationDSPContext dsp;
+
+    AVBufferPool *pool;
+    CacheEntry cache[CACHE_SIZE];
+    unsigned tick;
+} FoveationMapPriv;
+
+static MapHeader *map_header(void *data)
+{
+    return (MapHeader *)((uint8_t *)data - MAP_OFFSET);
+}
+
+static float *map_data(MapHeader *hdr)
+{
+    return (float *)((uint8_t *)hdr + MAP_OFFSET);
+}
+
+static void cache_flush(FoveationMapPriv *m)
+{
+    int i;
+
+    for (i = 0; i < CACHE_SIZE; i++) {
+        if (m->cache[i].hdr)
+            av_foveation_map_unref(map_data(m->cache[i].hdr));
+        memset(&m->cache[i], 0, sizeof(m->cache[i]));
+    }
+}
+
+static void map_row_c(float *dst, const float *src, float mul, float add,
+                      int len)
+{
+    int i;
+    for (i = 0; i < len; i++)
+        dst[i] = add + mul * src[i];
+}
+
+av_cold void ff_foveation_dsp_init(FoveationDSPContext *fdsp)
+{
+    fdsp->map_row = map_row_c;
+
+    if (ARCH_AARCH64)
+        ff_foveation_dsp_init_aarch64(fdsp);
+    if (ARCH_X86)
+        ff_foveation_dsp_init_x86(fdsp);
+}
+
+av_cold AVFoveationMap *av_foveation_map_alloc(int width, int height,
+                                               int mb_size)
+{
+    FoveationMapPriv *m;
+
+    if (width <= 0 || height <= 0 || mb_size <= 0)
+        return NULL;
+
+    m = av_mallocz(sizeof(*m));
+    if (!m)
+        return NULL;
+
+    m->p.mb_size = mb_size;
+    m->p.mb_cols = (width  + mb_size - 1) / mb_size;
+    m->p.mb_rows = (height + mb_size - 1) / mb_size;
+
+    m->hprofile = av_malloc_array(FFALIGN(m->p.mb_cols, 16), sizeof(*m->hprofile));
+    m->vprofile = av_malloc_array(m->p.mb_rows, sizeof(*m->vprofile));
+    m->pool = av_buffer_pool_init(MAP_OFFSET + m->p.mb_cols * m->p.mb_rows *
+                                  sizeof(float), NULL);
+    if (!m->hprofile || !m->vprofile || !m->pool) {
+        AVFoveationMap *map = &m->p;
+        av_foveation_map_free(&map);
+        return NULL;
+    }
+
+    ff_foveation_dsp_init(&m->dsp);
+
+    return &m->p;
+}
+
+av_cold void av_foveation_map_free(AVFoveationMap **map)
+{
+    FoveationMapPriv *m;
+
+    if (!map || !*map)
+        return;
+
+    m = (FoveationMapPriv *)*map;
+    cache_flush(m);
+    // outstanding maps keep the pool alive until they are released
+    av_buffer_pool_uninit(&m->pool);
+    av_freep(&m->hprofile);
+    av_freep(&m->vprofile);
+    av_freep(&m->lut);
+    av_freep(&m->ring);
+    av_freep(map);
+}
+
+/**
+ * Sample exp(-(i - center)^2 * scale) for i = 0..len-1.
+ */
+static void gaussian_profile(float *dst, int len, float center, float scale)
+{
+    int i;
+    for (i = 0; i < len; i++) {
+        float d = i - center;
+        dst[i] = expf(-d * d * scale);
+    }
+}
+
+int av_foveation_map_set_model(AVFoveationMap *map, enum AVFoveationModel model)
+{
+    FoveationMapPriv *m = (FoveationMapPriv *)map;
+    float e2 = model == AV_FOVEATION_MODEL_LINEAR_MAR ? MAR_E2 : GP_E2;
+    int i;
+
+    if (model < 0 || model >= AV_FOVEATION_MODEL_NB)
+        return AVERROR(EINVAL);
+    if (model == map->model)
+        return 0;
+
+    if (model != AV_FOVEATION_MODEL_GAUSSIAN) {
+        if (!m->lut)
+            m->lut = av_malloc_array(LUT_SIZE, sizeof(*m->lut));
+        if (!m->ring)
+            m->ring = av_malloc_array(LUT_SIZE, sizeof(*m->ring));
+        if (!m->lut || !m->ring)
+            return AVERROR(ENOMEM);
+
+        /*
+         * Both the MAR and the inverse of the Geisler-Perry cutoff frequency
+         * grow linearly with eccentricity, they differ in the slope and in
+         * the display limit applied per map.
+         */
+        for (i = 0; i < LUT_SIZE; i++)
+            m->lut[i] = QP_PER_OCTAVE * log2f(1 + (float)i / LUT_STEPS / e2);
+    }
+
+    cache_flush(m);
+    map->model = model;
+    return 0;
+}
+
+/**
+ * Fill a map from the acuity table of the context.
+ * @param sigma sigma in block units
+ */
+static void acuity_map(FoveationMapPriv *m, float *dst,
+                       const AVFoveationDescriptor *fd, float sigma)
+{
+    int cols = m->p.mb_cols;
+    int rows = m->p.mb_rows;
+    float cx = fd->x * cols;
+    float cy = fd->y * rows;
+    float amp = fabsf(fd->delta);
+    float sign = fd->delta < 0 ? -1 : 1;
+    float limit = 0, scale, dy2;
+    int x, y, i, n;
+
+    // table entries per block of distance to the fixation
+    scale = LUT_STEPS * AV_FOVEATION_SIGMA_DEGREES / sigma;
+
+    if (m->p.model == AV_FOVEATION_MODEL_GEISLER_PERRY) {
+        // detail beyond the Nyquist frequency of the display is never shown
+        float nyquist = sigma * m->p.mb_size / AV_FOVEATION_SIGMA_DEGREES / 2;
+        float cutoff  = logf(1 / GP_CT0) / GP_ALPHA; // at the fovea
+
+        if (nyquist < cutoff)
+            limit = QP_PER_OCTAVE * log2f(cutoff / nyquist);
+    }
+
+    // the table clipped to delta, as far as the farthest corner
+    n = FFMIN(hypotf(FFMAX(cx, cols - cx), FFMAX(cy, rows - cy)) * scale + 2,
+              LUT_SIZE);
+    for (i = 0; i < n; i++)
+        m->ring[i] = sign * av_clipf(m->lut[i] - limit, 0, amp);
+
+    // squared distances along the columns in table units
+    for (x = 0; x < cols; x++) {
+        float dx = (x - cx) * scale;
+        m->hprofile[x] = dx * dx;
+    }
+
+    for (y = 0; y < rows; y++) {
+        float *row = dst + y * cols;
+        float dy = (y - cy) * scale;
+
+        dy2 = dy * dy;
+        for (x = 0; x < cols; x++)
+            row[x] = m->ring[(int)FFMIN(sqrtf(m->hprofile[x] + dy2) + 0.5f, n - 1)];
+    }
+}
+
+int av_foveation_map_fill(AVFoveationMap *map, float *dst,
+                          const AVFoveationDescriptor *fd)
+{
+    FoveationMapPriv *m = (FoveationMapPriv *)map;
+    int cols = map->mb_cols;
+    int rows = map->mb_rows;
+    int simd_cols = cols & ~15;
+    float sigma, scale;
+    int x, y;
+
+    if (!isfinite(fd->x) || !isfinite(fd->y) ||
+        !isfinite(fd->sigma) || !isfinite(fd->delta))
+        return AVERROR(EINVAL);
+
+    // sigma is relative to the diagonal, transform to block units
+    sigma = fd->sigma * hypotf(cols, rows);
+
+    if (map->model != AV_FOVEATION_MODEL_GAUSSIAN && sigma > 0) {
+        acuity_map(m, dst, fd, sigma);
+        return 0;
+    }
+
+    // a degenerate gaussian leaves the whole frame at the peripheral offset
+    scale = sigma > 0 ? 1.0f / (sigma * sigma) : INFINITY;
+
+    if (scale == INFINITY) {
+        memset(m->hprofile, 0, cols * sizeof(*m->hprofile));
+        memset(m->vprofile, 0, rows * sizeof(*m->vprofile));
+    } else {
+        gaussian_profile(m->hprofile, cols, fd->x * cols, scale);
+        gaussian_profile(m->vprofile, rows, fd->y * rows, scale);
+    }
+
+    // invert, shift and scale the gaussian: delta * (1 - gx * gy)
+    for (y = 0; y < rows; y++) {
+        float *row = dst + y * cols;
+        float mul  = -fd->delta * m->vprofile[y];
+
+        if (simd_cols)
+            m->dsp.map_row(row, m->hprofile, mul, fd->delta, simd_cols);
+        for (x = simd_cols; x < cols; x++)
+            row[x] = fd->delta + mul * m->hprofile[x];
+    }
+
+    return 0;
+}
+
+void av_foveation_map_unref(void *data)
+{
+    MapHeader *hdr;
+    AVBufferRef *buf;
+
+    if (!data)
+        return;
+
+    hdr = map_header(data);
+    if (atomic_fetch_sub_explicit(&hdr->users, 1, memory_order_acq_rel) == 1) {
+        buf = hdr->buf;
+        av_buffer_unref(&buf);
+    }
+}
+
+int av_foveation_map_get(AVFoveationMap *map, const AVFoveationDescriptor *fd,
+                         float **dst)
+{
+    FoveationMapPriv *m = (FoveationMapPriv *)map;
+    float diag = hypotf(map->mb_cols, map->mb_rows);
+    AVFoveationDescriptor q;
+    CacheEntry *lru;
+    AVBufferRef *buf;
+    MapHeader *hdr;
+    int key[4];
+    int i, ret;
+
+    *dst = NULL;
+    if (!isfinite(fd->x) || !isfinite(fd->y) ||
+        !isfinite(fd->sigma) || !isfinite(fd->delta))
+        return AVERROR(EINVAL);
+
+    // gaze far off the frame or huge sigmas are clipped to keep keys in range
+    key[0] = lrintf(av_clipf(fd->x, -16, 16) * map->mb_cols * QUANT_POS);
+    key[1] = lrintf(av_clipf(fd->y, -16, 16) * map->mb_rows * QUANT_POS);
+    key[2] = lrintf(av_clipf(fd->sigma, 0, 16) * diag * QUANT_POS);
+    key[3] = lrintf(av_clipf(fd->delta, -1024, 1024) * QUANT_DELTA);
+
+    m->tick++;
+    lru = &m->cache[0];
+    for (i = 0; i < CACHE_SIZE; i++) {
+        CacheEntry *e = &m->cache[i];
+
+        if (e->hdr && !memcmp(e->key, key, sizeof(key))) {
+            e->last_used = m->tick;
+            atomic_fetch_add_explicit(&e->hdr->users, 1, memory_order_relaxed);
+            *dst = map_data(e->hdr);
+            return 0;
+        }
+        // unused entries have last_used == 0 and are taken first
+        if (e->last_used < lru->last_used)
+            lru = e;
+    }
+
+    buf = av_buffer_pool_get(m->pool);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    hdr = (MapHeader *)buf->data;
+    hdr->buf = buf;
+    atomic_init(&hdr->users, 2);
+
+    q.x     = (float)key[0] / (map->mb_cols * QUANT_POS);
+    q.y     = (float)key[1] / (map->mb_rows * QUANT_POS);
+    q.sigma = (float)key[2] / (diag * QUANT_POS);
+    q.delta = (float)key[3] / QUANT_DELTA;
+    ret = av_foveation_map_fill(map, map_data(hdr), &q);
+    if (ret < 0) {
+        // never cache a map that was not filled
+        av_buffer_unref(&buf);
+        return ret;
+    }
+
+    if (lru->hdr)
+        av_foveation_map_unref(map_data(lru->hdr));
+    memcpy(lru->key, key, sizeof(key));
+    lru->hdr = hdr;
+    lru->last_used = m->tick;
+
+    *dst = map_data(hdr);
+    return 0;
+}
+
+void av_foveation_map_segment(const AVFoveationMap *map, const float *qoffsets,
+                              float delta, int nb_segments,
+                              uint8_t *segments, int *delta_q)
+{
+    int nb_blocks = map->mb_cols * map->mb_rows;
+    float step = delta ? (nb_segments - 1) / delta : 0;
+    int i;
+
+    for (i = 0; i < nb_segments; i++)
+        delta_q[i] = lrintf(delta * i / (nb_segments - 1));
+
+    for (i = 0; i < nb_blocks; i++)
+        segments[i] = av_clip(lrintf(qoffsets[i] * step), 0, nb_segments - 1);
+}
@@ -0,0 +1,208 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Quantization offset maps for foveated encoding, shaped by a gaussian or an
+ * eccentricity-based acuity model.
+ */
+
+#ifndef AVUTIL_FOVEATION_H
+#define AVUTIL_FOVEATION_H
+
+#include <stdint.h>
+
+/**
+ * Visual angle in degrees spanned by the sigma of a descriptor, which relates
+ * frame positions to eccentricity for the acuity models.
+ */
+#define AV_FOVEATION_SIGMA_DEGREES 5.0f
+
+/**
+ * Falloff of the QP offset with the distance to the fixation point.
+ */
+enum AVFoveationModel {
+    /**
+     * delta * (1 - exp(-r^2 / sigma^2)), with r the distance to the fixation.
+     */
+    AV_FOVEATION_MODEL_GAUSSIAN,
+    /**
+     * The minimum angle of resolution grows linearly with eccentricity,
+     * MAR(E) = MAR(0) * (1 + E / 0.95), after Guenter et al. 2012. Each
+     * doubling of the MAR allows 6 QP more, up to delta.
+     */
+    AV_FOVEATION_MODEL_LINEAR_MAR,
+    /**
+     * The cutoff frequency of the contrast sensitivity function of Geisler
+     * and Perry 1998, f(E) = 2.3 * ln(64) / (0.106 * (E + 2.3)) cycles per
+     * degree, limited by the Nyquist frequency of the display. Each halving of
+     * the cutoff below the display limit allows 6 QP more, up to delta.
+     */
+    AV_FOVEATION_MODEL_GEISLER_PERRY,
+    AV_FOVEATION_MODEL_NB
+};
+
+/**
+ * AVOption entries of the "fov_model" option, which selects the
+ * AVFoveationModel of an encoder taking foveation descriptors.
+ *
+ * @param offset offset of the int holding the model in the private context
+ * @param flags  AVOption flags of the entries
+ */
+#define AV_FOVEATION_MODEL_OPTIONS(offset, flags) \
+    { "fov_model",     "Falloff of the foveation QP offsets", offset, AV_OPT_TYPE_INT, { .i64 = AV_FOVEATION_MODEL_GAUSSIAN }, 0, AV_FOVEATION_MODEL_NB - 1, flags, "fov_model" }, \
+    { "gaussian",      "Gaussian around the fixation",        0, AV_OPT_TYPE_CONST, { .i64 = AV_FOVEATION_MODEL_GAUSSIAN },      0, 0, flags, "fov_model" }, \
+    { "linear_mar",    "Linear minimum angle of resolution",  0, AV_OPT_TYPE_CONST, { .i64 = AV_FOVEATION_MODEL_LINEAR_MAR },    0, 0, flags, "fov_model" }, \
+    { "geisler_perry", "Geisler-Perry contrast sensitivity",  0, AV_OPT_TYPE_CONST, { .i64 = AV_FOVEATION_MODEL_GEISLER_PERRY }, 0, 0, flags, "fov_model" },
+
+/**
+ * Layout of AV_FRAME_DATA_FOVEATION_DESCRIPTOR side data.
+ */
+typedef struct AVFoveationDescriptor {
+    /**
+     * Relative fixation point. 0 is left/top, 1 is right/bottom.
+     */
+    float x;
+    float y;
+    /**
+     * Standard deviation of the gaussian, 1 equals the frame diagonal.
+     * Spans AV_FOVEATION_SIGMA_DEGREES for the acuity models.
+     */
+    float sigma;
+    /**
+     * Maximal QP offset between the fixation center and the periphery.
+     */
+    float delta;
+} AVFoveationDescriptor;
+
+/**
+ * Per-resolution state to evaluate foveation maps.
+ *
+ * The gaussian exp(-(dx^2 + dy^2) / s^2) is separable, so a map is the outer
+ * product of one profile along the macroblock columns and one along the rows.
+ * Only mb_cols + mb_rows exponentials are evaluated per map, the remaining
+ * work is a scaled copy of the column profile into every row.
+ *
+ * The acuity models are evaluated once into a table of QP offsets by
+ * eccentricity when selected, see av_foveation_map_set_model(), and a map
+ * takes a distance and a table lookup per block.
+ *
+ * Maps returned by av_foveation_map_get() are taken from a buffer pool owned
+ * by the context and cached for the most recently used descriptors, so an
+ * unchanged fixation costs a reference count increment per frame.
+ */
+typedef struct AVFoveationMap {
+    int mb_size; ///< side length of a block in pixels
+    int mb_cols; ///< number of blocks per row
+    int mb_rows; ///< number of block rows
+    enum AVFoveationModel model; ///< see av_foveation_map_set_model()
+} AVFoveationMap;
+
+/**
+ * Allocate a foveation map context for a given frame size.
+ *
+ * @param width   frame width in pixels
+ * @param height  frame height in pixels
+ * @param mb_size side length of the square blocks the map is computed for
+ * @return newly allocated context, or NULL on failure.
+ *         Free with av_foveation_map_free().
+ */
+AVFoveationMap *av_foveation_map_alloc(int width, int height, int mb_size);
+
+/**
+ * Free a foveation map context and set the pointer to NULL.
+ */
+void av_foveation_map_free(AVFoveationMap **map);
+
+/**
+ * Select the falloff model of the maps of a context.
+ *
+ * Cached maps of the previous model are dropped. The default model is
+ * AV_FOVEATION_MODEL_GAUSSIAN.
+ *
+ * @param map   context from av_foveation_map_alloc()
+ * @param model falloff model
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+int av_foveation_map_set_model(AVFoveationMap *map, enum AVFoveationModel model);
+
+/**
+ * Compute a quantization offset map with the model of the context.
+ *
+ * @param map context from av_foveation_map_alloc()
+ * @param dst array of map->mb_cols * map->mb_rows floats, receives the
+ *            QP offset of each block in raster scan order
+ * @param fd  foveation descriptor
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+int av_foveation_map_fill(AVFoveationMap *map, float *dst,
+                          const AVFoveationDescriptor *fd);
+
+/**
+ * Get a reference to a cached quantization offset map.
+ *
+ * The descriptor is quantized to 1/8 block in position and scale and to
+ * 1/64 QP in delta. If a map for the quantized descriptor is still cached,
+ * a new reference to it is returned, otherwise the least recently used cache
+ * entry is replaced by a map computed from the quantized descriptor. The
+ * result only depends on the quantized descriptor and the model, not on the
+ * cache history.
+ *
+ * The returned map must not be written to. It stays valid until released
+ * with av_foveation_map_unref(), even after av_foveation_map_free().
+ * This function is not thread-safe with respect to the same context.
+ *
+ * @param map context from av_foveation_map_alloc()
+ * @param fd  foveation descriptor
+ * @param dst set to an array of map->mb_cols * map->mb_rows QP offsets in
+ *            raster scan order, NULL on failure
+ * @return 0 on success, a negative AVERROR code on failure
+ */
+int av_foveation_map_get(AVFoveationMap *map, const AVFoveationDescriptor *fd,
+                         float **dst);
+
+/**
+ * Release a map acquired through av_foveation_map_get().
+ *
+ * Thread-safe. The signature matches free(), so the function can be passed
+ * to libraries taking a deallocation callback for the map.
+ *
+ * @param data map pointer as returned by av_foveation_map_get(), may be NULL
+ */
+void av_foveation_map_unref(void *data);
+
+/**
+ * Quantize a quantization offset map into eccentricity rings.
+ *
+ * For encoders that only support a small number of segments with a fixed QP
+ * offset each, e.g. VP9 and AV1 segmentation. Segment i covers offsets
+ * around delta * i / (nb_segments - 1), so segment 0 is the fixation center
+ * and the last segment the periphery.
+ *
+ * @param map         context the offsets were computed with
+ * @param qoffsets    map->mb_cols * map->mb_rows QP offsets
+ * @param delta       delta of the descriptor the offsets were computed from
+ * @param nb_segments number of segments, at least 2
+ * @param segments    receives the segment index of each block
+ * @param delta_q     receives the QP offset of each of the nb_segments segments
+ */
+void av_foveation_map_segment(const AVFoveationMap *map, const float *qoffsets,
+                              float delta, int nb_segments,
+                              uint8_t *segments, int *delta_q);
+
+#endif /* AVUTIL_FOVEATION_H */
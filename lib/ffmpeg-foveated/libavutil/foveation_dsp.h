@@ -0,0 +1,44 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVUTIL_FOVEATION_DSP_H
+#define AVUTIL_FOVEATION_DSP_H
+
+typedef struct FoveationDSPContext {
+    /**
+     * Compute one row of a foveation map: dst[i] = add + mul * src[i].
+     *
+     * @param dst  output vector
+     *             constraints: none
+     * @param src  input vector
+     *             constraints: 32-byte aligned
+     * @param mul  scalar multiplier
+     * @param add  scalar offset
+     * @param len  length of vectors
+     *             constraints: multiple of 16
+     */
+    void (*map_row)(float *dst, const float *src, float mul, float add,
+                    int len);
+} FoveationDSPContext;
+
+void ff_foveation_dsp_init(FoveationDSPContext *fdsp);
+
+void ff_foveation_dsp_init_aarch64(FoveationDSPContext *fdsp);
+void ff_foveation_dsp_init_x86(FoveationDSPContext *fdsp);
+
+#endif /* AVUTIL_FOVEATION_DSP_H */
@@ -182,7 +182,8 @@ enum AVFrameSideDataType {
 
     /**
      * data points to four floats: (x, y, sigma, delta),
-     * which describe a gaussian-shaped quality map
+     * which describe a gaussian-shaped quality map.
+     * See AVFoveationDescriptor in libavutil/foveation.h.
      */
     AV_FRAME_DATA_FOVEATION_DESCRIPTOR,
 };
@@ -0,0 +1,80 @@
+;*****************************************************************************
+;* x86-optimized foveation map functions
+;*
+;* This file is part of FFmpeg.
+;*
+;* FFmpeg is free software; you can redistribute it and/or
+;* modify it under the terms of the GNU Lesser General Public
+;* License as published by the Free Software Foundation; either
+;* version 2.1 of the License, or (at your option) any later version.
+;*
+;* FFmpeg is distributed in the hope that it will be useful,
+;* but WITHOUT ANY WARRANTY; without even the implied warranty of
+;* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+;* Lesser General Public License for more details.
+;*
+;* You should have received a copy of the GNU Lesser General Public
+;* License along with FFmpeg; if not, write to the Free Software
+;* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+;******************************************************************************
+
+%include "x86util.asm"
+
+SECTION .text
+
+;-----------------------------------------------------------------------------
+; void ff_foveation_map_row(float *dst, const float *src, float mul, float add,
+;                           int len)
+;-----------------------------------------------------------------------------
+%macro FOVEATION_MAP_ROW 0
+%if UNIX64
+cglobal foveation_map_row, 3,3,4, dst, src, len
+%else
+cglobal foveation_map_row, 5,5,4, dst, src, mul, add, len
+%endif
+%if ARCH_X86_32
+    VBROADCASTSS m0, mulm
+    VBROADCASTSS m1, addm
+%else
+%if WIN64
+    SWAP 0, 2
+    SWAP 1, 3
+%endif
+    shufps      xm0, xm0, 0
+    shufps      xm1, xm1, 0
+%if cpuflag(avx)
+    vinsertf128  m0, m0, xm0, 1
+    vinsertf128  m1, m1, xm1, 1
+%endif
+%endif
+    movsxdifnidn lenq, lend
+    lea    lenq, [lenq*4-2*mmsize]
+.loop:
+%if cpuflag(fma3)
+    mova     m2, m1
+    mova     m3, m1
+    fmaddps  m2, m0, [srcq+lenq], m2
+    fmaddps  m3, m0, [srcq+lenq+mmsize], m3
+%else ; cpuflag
+    mulps    m2, m0, [srcq+lenq]
+    mulps    m3, m0, [srcq+lenq+mmsize]
+    addps    m2, m2, m1
+    addps    m3, m3, m1
+%endif ; cpuflag
+    movu     [dstq+lenq], m2
+    movu     [dstq+lenq+mmsize], m3
+    sub    lenq, 2*mmsize
+    jge .loop
+    REP_RET
+%endmacro
+
+INIT_XMM sse
+FOVEATION_MAP_ROW
+%if HAVE_AVX_EXTERNAL
+INIT_YMM avx
+FOVEATION_MAP_ROW
+%endif
+%if HAVE_FMA3_EXTERNAL
+INIT_YMM fma3
+FOVEATION_MAP_ROW
+%endif
@@ -0,0 +1,43 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include "libavutil/attributes.h"
+#include "libavutil/cpu.h"
+#include "libavutil/foveation_dsp.h"
+#include "cpu.h"
+
+void ff_foveation_map_row_sse(float *dst, const float *src, float mul,
+                              float add, int len);
+void ff_foveation_map_row_avx(float *dst, const float *src, float mul,
+                              float add, int len);
+void ff_foveation_map_row_fma3(float *dst, const float *src, float mul,
+                               float add, int len);
+
+av_cold void ff_foveation_dsp_init_x86(FoveationDSPContext *fdsp)
+{
+    int cpu_flags = av_get_cpu_flags();
+
+    if (EXTERNAL_SSE(cpu_flags))
+        fdsp->map_row = ff_foveation_map_row_sse;
+    if (EXTERNAL_AVX_FAST(cpu_flags))
+        fdsp->map_row = ff_foveation_map_row_avx;
+    if (EXTERNAL_FMA3_FAST(cpu_flags))
+        fdsp->map_row = ff_foveation_map_row_fma3;
+}
@@ -187,6 +187,7 @@ static const struct {
 #if CONFIG_AVUTIL
         { "fixed_dsp", checkasm_check_fixed_dsp },
         { "float_dsp", checkasm_check_float_dsp },
+        { "foveation", checkasm_check_foveation },
 #endif
     { NULL }
 };
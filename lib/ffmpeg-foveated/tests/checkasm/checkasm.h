@@ -52,6 +52,7 @@ void checkasm_check_fixed_dsp(void);
 void checkasm_check_flacdsp(void);
 void checkasm_check_float_dsp(void);
 void checkasm_check_fmtconvert(void);
+void checkasm_check_foveation(void);
 void checkasm_check_g722dsp(void);
 void checkasm_check_h264dsp(void);
 void checkasm_check_h264pred(void);
@@ -0,0 +1,70 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with FFmpeg; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <float.h>
+#include <stdint.h>
+
+#include "libavutil/foveation_dsp.h"
+#include "libavutil/internal.h"
+#include "checkasm.h"
+
+#define LEN 256
+
+static void test_map_row(const float *src)
+{
+    /* one extra element so dst can be deliberately misaligned */
+    LOCAL_ALIGNED_32(float, cdst, [LEN + 1]);
+    LOCAL_ALIGNED_32(float, odst, [LEN + 1]);
+    const float delta = 24.0f;
+    float mul = -delta * rnd() / (float)UINT32_MAX;
+    int i;
+
+    declare_func(void, float *dst, const float *src, float mul, float add,
+                 int len);
+
+    call_ref(cdst + 1, src, mul, delta, LEN);
+    call_new(odst + 1, src, mul, delta, LEN);
+    for (i = 1; i <= LEN; i++) {
+        if (!float_near_abs_eps(cdst[i], odst[i], 2 * delta * FLT_EPSILON)) {
+            fprintf(stderr, "%d: %- .12f - %- .12f = % .12g\n",
+                    i, cdst[i], odst[i], cdst[i] - odst[i]);
+            fail();
+            break;
+        }
+    }
+    bench_new(odst + 1, src, mul, delta, LEN);
+}
+
+void checkasm_check_foveation(void)
+{
+    LOCAL_ALIGNED_32(float, src, [LEN]);
+    FoveationDSPContext fdsp;
+    int i;
+
+    /* gaussian profile samples lie in [0, 1] */
+    for (i = 0; i < LEN; i++)
+        src[i] = rnd() / (float)UINT32_MAX;
+
+    ff_foveation_dsp_init(&fdsp);
+
+    if (check_func(fdsp.map_row, "foveation_map_row"))
+        test_map_row(src);
+    report("map_row");
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+#include "pexit.h"
+#include "pipeline.h"
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <libavutil/file.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+void cache_build(char *video, const char *path)
+{
+	rdr_ctx *rc;
+	dec_ctx *dc;
+	Queue *frames;
+	SDL_Thread *reader, *decoder;
+	CacheHeader hdr;
+	AVFrame *f;
+	FILE *out;
+	int64_t *pts = NULL;
+	uint8_t *buf = NULL;
+	size_t nb_pts = 0;
+	int ret;
+
+	rc = reader_init(video, 32, NULL);
+	dc = source_decoder_init(rc, 32);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_VERSION;
+	hdr.time_base_num = dc->avctx->time_base.num;
+	hdr.time_base_den = dc->avctx->time_base.den;
+	if (dc->frame_rate.num <= 0 || dc->frame_rate.den <= 0)
+		pexit("unknown frame rate of the source");
+	hdr.frame_rate_num = dc->frame_rate.num;
+	hdr.frame_rate_den = dc->frame_rate.den;
+	hdr.data_offset = CACHE_PAGE;
+
+	out = fopen(path, "wb");
+	if (!out)
+		pexit("fopen failed");
+	if (fseek(out, hdr.data_offset, SEEK_SET))
+		pexit("fseek failed");
+
+	// the decoder frees its context on exit, its output queue is ours
+	frames = dc->frames;
+	reader = SDL_CreateThread(reader_thread, "reader", rc);
+	decoder = SDL_CreateThread(decoder_thread, "src_decoder", dc);
+	if (!reader || !decoder)
+		pexit(SDL_GetError());
+
+	while ((f = queue_extract(frames))) {
+		if (!hdr.nb_frames) {
+			hdr.width = f->width;
+			hdr.height = f->height;
+			if (!av_get_pix_fmt_name(f->format))
+				pexit("unknown pixel format");
+			strncpy(hdr.pix_fmt, av_get_pix_fmt_name(f->format), sizeof(hdr.pix_fmt) - 1);
+			ret = av_image_get_buffer_size(f->format, f->width, f->height, CACHE_ALIGN);
+			if (ret < 0)
+				pexit("av_image_get_buffer_size failed");
+			hdr.frame_size = FFALIGN(ret, CACHE_PAGE);
+			buf = av_mallocz(hdr.frame_size);
+			if (!buf)
+				pexit("av_mallocz failed");
+		} else if (f->width != hdr.width || f->height != hdr.height ||
+			   strcmp(av_get_pix_fmt_name(f->format), hdr.pix_fmt)) {
+			pexit("the cache does not support changing frame parameters");
+		}
+
+		ret = av_image_copy_to_buffer(buf, hdr.frame_size,
+			(const uint8_t * const *) f->data, f->linesize,
+			f->format, f->width, f->height, CACHE_ALIGN);
+		if (ret < 0)
+			pexit("av_image_copy_to_buffer failed");
+		if (fwrite(buf, hdr.frame_size, 1, out) != 1)
+			pexit("fwrite failed");
+
+		if (hdr.nb_frames == nb_pts) {
+			nb_pts = nb_pts ? 2 * nb_pts : 1024;
+			pts = realloc(pts, nb_pts * sizeof(int64_t));
+			if (!pts)
+				pexit("realloc failed");
+		}
+		pts[hdr.nb_frames++] = f->pts != AV_NOPTS_VALUE ? f->pts : f->best_effort_timestamp;
+		queue_recycle(frames, f);
+	}
+
+	SDL_WaitThread(reader, NULL);
+	SDL_WaitThread(decoder, NULL);
+	queue_free(&frames);
+
+	if (!hdr.nb_frames)
+		pexit("no frames decoded");
+
+	hdr.index_offset = hdr.data_offset + hdr.nb_frames * hdr.frame_size;
+	if (fwrite(pts, sizeof(int64_t), hdr.nb_frames, out) != hdr.nb_frames)
+		pexit("fwrite failed");
+	if (fseek(out, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		pexit("unable to write the cache header");
+	if (fclose(out))
+		pexit("fclose failed");
+
+	av_free(buf);
+	free(pts);
+}
+
+int cache_probe(const char *path)
+{
+	char magic[sizeof(((CacheHeader *) 0)->magic)];
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return 0;
+	ret = fread(magic, sizeof(magic), 1, f) == 1 &&
+	      !memcmp(magic, CACHE_MAGIC, sizeof(magic));
+	fclose(f);
+	return ret;
+}
+
+static void unref_frame(void *item)
+{
+	av_frame_unref(item);
+}
+
+static void free_frame(void *item)
+{
+	AVFrame *frame = item;
+
+	av_frame_free(&frame);
+}
+
+#ifdef _WIN32
+/*
+ * Without mmap the file is read into memory once, frames still reference it.
+ */
+AVBufferRef *cache_map_file(const char *path, size_t *size)
+{
+	AVBufferRef *map;
+	uint8_t *data;
+
+	if (av_file_map(path, &data, size, 0, NULL) < 0)
+		pexit("av_file_map failed");
+	if (*size > INT_MAX)
+		pexit("file too large to read into memory");
+	map = av_buffer_alloc(*size);
+	if (!map)
+		pexit("av_buffer_alloc failed");
+	memcpy(map->data, data, *size);
+	av_file_unmap(data, *size);
+	return map;
+}
+#else
+static void unmap_file(void *opaque, uint8_t *data)
+{
+	munmap(data, (size_t) (uintptr_t) opaque);
+}
+
+AVBufferRef *cache_map_file(const char *path, size_t *size)
+{
+	AVBufferRef *map;
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		pexit("open failed");
+	if (fstat(fd, &st))
+		pexit("fstat failed");
+	if (!st.st_size)
+		pexit("empty file");
+	if ((uint64_t) st.st_size > SIZE_MAX)
+		pexit("file too large to map");
+	*size = st.st_size;
+
+	data = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		pexit("mmap failed");
+	close(fd);
+	// runs read the frames front to back, start paging them in right away
+	madvise(data, *size, MADV_WILLNEED);
+
+	// the int size of the buffer is never used, frames get buffers of their own
+	map = av_buffer_create(data, FFMIN(*size, INT_MAX), unmap_file,
+		(void *) (uintptr_t) *size, AV_BUFFER_FLAG_READONLY);
+	if (!map)
+		pexit("av_buffer_create failed");
+	return map;
+}
+#endif
+
+dec_ctx *cache_source_wrap(cache_ctx *c, AVRational time_base,
+			   AVRational frame_rate, int queue_capacity)
+{
+	AVCodecContext *avctx;
+	dec_ctx *dc;
+
+	atomic_init(&c->abort, 0);
+	pacer_init(&c->pacer, 0, time_base);
+
+	avctx = avcodec_alloc_context3(NULL);
+	if (!avctx)
+		pexit("avcodec_alloc_context3 failed");
+	avctx->width = c->width;
+	avctx->height = c->height;
+	avctx->pix_fmt = c->pix_fmt;
+	avctx->time_base = time_base;
+
+	dc = malloc(sizeof(dec_ctx));
+	if (!dc)
+		pexit("malloc failed");
+
+	dc->packets = NULL;
+	dc->frames = queue_init(queue_capacity);
+	queue_set_recycling(dc->frames, unref_frame, free_frame);
+	dc->avctx = avctx;
+	dc->frame_rate = frame_rate;
+	dc->stage = TRACE_SRC_DECODED;
+	dc->pl = NULL;
+	dc->cache = c;
+
+	return dc;
+}
+
+dec_ctx *cache_source_init(const char *path, int queue_capacity)
+{
+	cache_ctx *c;
+	const CacheHeader *hdr;
+	AVBufferRef *map;
+	size_t size;
+	int frame_size;
+
+	map = cache_map_file(path, &size);
+	hdr = (const CacheHeader *) map->data;
+	if (size < sizeof(CacheHeader) ||
+	    memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != CACHE_VERSION)
+		pexit("not a cache file of this version");
+	if (hdr->frame_rate_num <= 0 || hdr->frame_rate_den <= 0)
+		pexit("no frame rate in cache file, rebuild it with mkcache");
+
+	c = malloc(sizeof(cache_ctx));
+	if (!c)
+		pexit("malloc failed");
+
+	c->pix_fmt = av_get_pix_fmt(hdr->pix_fmt);
+	if (c->pix_fmt == AV_PIX_FMT_NONE)
+		pexit("unknown pixel format in cache file");
+	// frames are mapped as they are, a short frame would be read past its end
+	frame_size = av_image_get_buffer_size(c->pix_fmt, hdr->width, hdr->height, CACHE_ALIGN);
+	if (frame_size < 0 || hdr->frame_size != FFALIGN((uint64_t) frame_size, CACHE_PAGE))
+		pexit("frame size in cache file does not match its format");
+	if (!hdr->nb_frames || hdr->data_offset % CACHE_PAGE ||
+	    hdr->data_offset > size ||
+	    hdr->nb_frames > (size - hdr->data_offset) / hdr->frame_size ||
+	    hdr->index_offset != hdr->data_offset + hdr->nb_frames * hdr->frame_size ||
+	    hdr->nb_frames * sizeof(int64_t) > size - hdr->index_offset)
+		pexit("truncated or corrupt cache file");
+
+	c->map = map;
+	c->size = size;
+	c->frame_size = frame_size;
+	c->nb_frames = hdr->nb_frames;
+	c->width = hdr->width;
+	c->height = hdr->height;
+	c->align = CACHE_ALIGN;
+	c->offsets = malloc(c->nb_frames * sizeof(uint64_t));
+	c->pts = malloc(c->nb_frames * sizeof(int64_t));
+	if (!c->offsets || !c->pts)
+		pexit("malloc failed");
+	for (uint32_t i = 0; i < c->nb_frames; i++)
+		c->offsets[i] = hdr->data_offset + i * hdr->frame_size;
+	// copied, as sources without an index in the file generate their pts
+	memcpy(c->pts, map->data + hdr->index_offset, c->nb_frames * sizeof(int64_t));
+
+	return cache_source_wrap(c, av_make_q(hdr->time_base_num, hdr->time_base_den),
+		av_make_q(hdr->frame_rate_num, hdr->frame_rate_den), queue_capacity);
+}
+
+static void unref_map(void *opaque, uint8_t *data)
+{
+	AVBufferRef *map = opaque;
+
+	(void) data;
+	av_buffer_unref(&map);
+}
+
+/**
+ * Point a frame at the mapped pixels of a cached frame.
+ *
+ * The frame gets a buffer of its own covering just its pixels, which holds a
+ * reference to the whole mapping. Calls pexit in case of a failure.
+ */
+static void cache_frame(cache_ctx *c, AVFrame *frame, uint32_t index)
+{
+	uint8_t *data = c->map->data + c->offsets[index];
+	AVBufferRef *map;
+
+	map = av_buffer_ref(c->map);
+	if (!map)
+		pexit("av_buffer_ref failed");
+	frame->buf[0] = av_buffer_create(data, c->frame_size, unref_map, map,
+		AV_BUFFER_FLAG_READONLY);
+	if (!frame->buf[0])
+		pexit("av_buffer_create failed");
+	if (av_image_fill_arrays(frame->data, frame->linesize, data, c->pix_fmt,
+				 c->width, c->height, c->align) < 0)
+		pexit("av_image_fill_arrays failed");
+	frame->extended_data = frame->data;
+	frame->width = c->width;
+	frame->height = c->height;
+	frame->format = c->pix_fmt;
+	frame->pts = c->pts[index];
+}
+
+int cache_thread(void *ptr)
+{
+	dec_ctx *dc = (dec_ctx *) ptr;
+	cache_ctx *c = dc->cache;
+	AVFrame *frame;
+	uint32_t i;
+
+	for (;;) {
+		pacer_restart(&c->pacer);
+		for (i = 0; i < c->nb_frames && !c->abort; i++) {
+			frame = queue_reuse(dc->frames);
+			if (!frame)
+				frame = av_frame_alloc();
+			if (!frame)
+				pexit("av_frame_alloc failed");
+
+			pacer_wait(&c->pacer, c->pts[i]);
+			trace_record(TRACE_READ, c->pts[i]);
+			cache_frame(c, frame, i);
+			trace_record(dc->stage, frame->pts);
+			queue_append(dc->frames, frame);
+		}
+		queue_append(dc->frames, NULL);
+		if (!dc->pl || pipeline_wait(dc->pl))
+			break;
+	}
+
+	// frames still in use keep the mapping alive
+	av_buffer_unref(&c->map);
+	free(c->offsets);
+	free(c->pts);
+	free(c);
+	avcodec_free_context(&dc->avctx);
+	free(dc);
+	return 0;
+}
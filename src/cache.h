@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "codec.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define CACHE_MAGIC "FOVCACHE"
+#define CACHE_VERSION 1
+#define CACHE_ALIGN 64   // linesize alignment, suits SIMD loads of encoders
+#define CACHE_PAGE 4096  // alignment of the header, every frame and the index
+
+/**
+ * Header at the start of a decoded-source cache file.
+ *
+ * The header is padded to data_offset, followed by nb_frames raw frames of
+ * frame_size bytes each, laid out as by av_image_fill_arrays with CACHE_ALIGN.
+ * The index at index_offset holds the int64_t pts of every frame.
+ */
+typedef struct CacheHeader {
+	char magic[8];       // CACHE_MAGIC without the terminating nullbyte
+	uint32_t version;    // CACHE_VERSION
+	int32_t width;
+	int32_t height;
+	char pix_fmt[32];    // name as returned by av_get_pix_fmt_name
+	int32_t time_base_num;
+	int32_t time_base_den;
+	int32_t frame_rate_num;
+	int32_t frame_rate_den;
+	uint32_t nb_frames;
+	uint64_t frame_size;
+	uint64_t data_offset;
+	uint64_t index_offset;
+} CacheHeader;
+
+/**
+ * State of a source emitting raw frames from a mapped file, referenced by its
+ * dec_ctx. Used for cache files and Y4M files alike, see y4m.h.
+ */
+typedef struct cache_ctx {
+	AVBufferRef *map;  // the whole file, referenced by the buffer of every frame
+	size_t size;       // length of the file, map->size is an int and truncates
+	uint64_t *offsets; // position of every frame in the file
+	int frame_size;    // bytes of a frame as laid out with align
+	int64_t *pts;
+	uint32_t nb_frames;
+	int width;
+	int height;
+	int align;         // linesize alignment the frames are laid out with
+	enum AVPixelFormat pix_fmt;
+	atomic_int abort;  // set by other threads to end the run early
+	src_pacer pacer;   // disabled unless set by the owner before the thread starts
+} cache_ctx;
+
+/**
+ * Decode a video once and store the raw frames in a cache file.
+ *
+ * Uses a reader and a source decoder thread, see reader_thread and
+ * decoder_thread. Calls pexit in case of a failure.
+ * @param video compressed video to decode
+ * @param path cache file to write
+ */
+void cache_build(char *video, const char *path);
+
+/**
+ * Check whether a file is a decoded-source cache.
+ * @param path file to check
+ * @return 1 if path starts with a cache header, 0 otherwise
+ */
+int cache_probe(const char *path);
+
+/**
+ * Map a file into memory.
+ *
+ * The mapping is private and writable, so an encoder writing to its input
+ * only modifies its own copy of a page. The size member of the returned
+ * buffer is an int, it is clipped to INT_MAX and only *size is to be used.
+ * Calls pexit in case of a failure.
+ * @param path file to map
+ * @param size set to the length of the file
+ * @return AVBufferRef* unmapping the file once the last reference is gone.
+ */
+AVBufferRef *cache_map_file(const char *path, size_t *size);
+
+/**
+ * Wrap a mapped source in a decoder context for cache_thread and encoder_init.
+ *
+ * The avctx member is allocated but not opened, it only carries the frame
+ * size, format and time base. Calls pexit in case of a failure.
+ * @param c source with every member but abort set, owned by the context
+ * @param time_base time base of the pts of c
+ * @param frame_rate frame rate of the source
+ * @param queue_capacity output buffer size.
+ * @return dec_ctx to pass to cache_thread and encoder_init.
+ */
+dec_ctx *cache_source_wrap(cache_ctx *c, AVRational time_base,
+			   AVRational frame_rate, int queue_capacity);
+
+/**
+ * Initialize a source that emits the frames of a cache file.
+ *
+ * The file is mapped into memory, frames reference the mapping without
+ * copying and keep it alive, see cache_thread and cache_source_wrap.
+ * Calls pexit in case of a failure.
+ * @param path cache file written by cache_build
+ * @param queue_capacity output buffer size.
+ * @return dec_ctx to pass to cache_thread and encoder_init.
+ */
+dec_ctx *cache_source_init(const char *path, int queue_capacity);
+
+/**
+ * Put the frames of a mapped source in a queue, replacing reader and source
+ * decoder.
+ *
+ * Frames are released at their pts if cache_ctx->pacer is enabled. Adds
+ * NULL to the queue in the end. If the source belongs to a pipeline,
+ * wait for a restart and start over from the first frame.
+ * This function is to be used through SDL_CreateThread.
+ * @param ptr will be cast to (dec_ctx *), see cache_source_wrap
+ * @return int 0 on success.
+ */
+int cache_thread(void *ptr);
@@ -17,11 +17,28 @@
 
 #include "codec.h"
 #include "pexit.h"
+#include "pipeline.h"
 #include <string.h>
 #include <stdio.h>
 
+static const char *foveation_model;
+
+void set_foveation_model(const char *model)
+{
+	if (strcmp(model, "gaussian") && strcmp(model, "linear_mar") &&
+	    strcmp(model, "geisler_perry")) {
+		fprintf(stderr, "foveation model: %s\n", model);
+		pexit("unknown foveation model");
+	}
+	foveation_model = model;
+}
+
 static void set_codec_options(AVDictionary **opt, enc_id id)
 {
+	// an option of every foveated encoder, see AVFoveationModel
+	if (foveation_model)
+		av_dict_set(opt, "fov_model", foveation_model, 0);
+
 	switch (id) {
 	case LIBX264:
 		av_dict_set(opt, "preset", "ultrafast", 0);
@@ -35,6 +52,28 @@ static void set_codec_options(AVDictionary **opt, enc_id id)
 		av_dict_set(opt, "x265-params", "aq-mode=1", 0);
 		av_dict_set(opt, "gop-size", "3", 0);
 		break;
+	case LIBVPX:
+		/* segment (foveation) maps require realtime, cpu-used >= 5 and aq-mode 0 */
+		av_dict_set(opt, "deadline", "realtime", 0);
+		av_dict_set(opt, "cpu-used", "8", 0);
+		av_dict_set(opt, "aq-mode", "0", 0);
+		av_dict_set(opt, "lag-in-frames", "0", 0);
+		av_dict_set(opt, "row-mt", "1", 0);
+		av_dict_set(opt, "threads", "auto", 0);
+		break;
+	case LIBAOM:
+		/* segment (foveation) maps require aq-mode 0 */
+		av_dict_set(opt, "cpu-used", "8", 0);
+		av_dict_set(opt, "aq-mode", "0", 0);
+		av_dict_set(opt, "lag-in-frames", "0", 0);
+		av_dict_set(opt, "row-mt", "1", 0);
+		av_dict_set(opt, "threads", "auto", 0);
+		break;
+	case MPEG4:
+		/* native encoder, foveation goes through its adaptive quantization */
+		av_dict_set(opt, "bf", "0", 0);
+		av_dict_set(opt, "g", "3", 0);
+		break;
 	default:
 		pexit("trying to set options for unsupported codec");
 	}
@@ -60,6 +99,18 @@ rep_enc_ctx *replicate_encoder_init(enc_id id, dec_ctx *dc, char** xcoords, char
 		set_codec_options(&options, LIBX265);
 		codec = avcodec_find_encoder_by_name("libx265");
 		break;
+	case LIBVPX:
+		set_codec_options(&options, LIBVPX);
+		codec = avcodec_find_encoder_by_name("libvpx-vp9");
+		break;
+	case LIBAOM:
+		set_codec_options(&options, LIBAOM);
+		codec = avcodec_find_encoder_by_name("libaom-av1");
+		break;
+	case MPEG4:
+		set_codec_options(&options, MPEG4);
+		codec = avcodec_find_encoder_by_name("mpeg4");
+		break;
 	default:
 		codec = NULL;
 	}
@@ -82,6 +133,10 @@ rep_enc_ctx *replicate_encoder_init(enc_id id, dec_ctx *dc, char** xcoords, char
 	ec->frames = dc->frames;
 	/* output queues have length 1 to enforce RT processing */
 	ec->packets = queue_init(1);
+	queue_set_recycling(ec->packets, unref_packet, free_packet);
+	ec->descr_pool = av_buffer_pool_init(4*sizeof(float), NULL);
+	if (!ec->descr_pool)
+		pexit("av_buffer_pool_init failed");
 
 	ec->avctx = avctx;
 	ec->options = options;
@@ -113,6 +168,18 @@ enc_ctx *encoder_init(enc_id id, dec_ctx *dc, char* path)
 		set_codec_options(&options, LIBX265);
 		codec = avcodec_find_encoder_by_name("libx265");
 		break;
+	case LIBVPX:
+		set_codec_options(&options, LIBVPX);
+		codec = avcodec_find_encoder_by_name("libvpx-vp9");
+		break;
+	case LIBAOM:
+		set_codec_options(&options, LIBAOM);
+		codec = avcodec_find_encoder_by_name("libaom-av1");
+		break;
+	case MPEG4:
+		set_codec_options(&options, MPEG4);
+		codec = avcodec_find_encoder_by_name("mpeg4");
+		break;
 	default:
 		codec = NULL;
 	}
@@ -133,15 +200,27 @@ enc_ctx *encoder_init(enc_id id, dec_ctx *dc, char* path)
 		pexit("avcodec_open2 failed");
 
 	ec->frames = dc->frames;
-	/* output queues have length 1 to enforce RT processing */
+	/*
+	 * output queues have length 1 to enforce RT processing, packets are
+	 * never dropped as later frames reference them
+	 */
 	ec->packets = queue_init(1);
-	ec->timestamps = queue_init(1);
+	queue_set_recycling(ec->packets, unref_packet, free_packet);
+	ec->descr_pool = av_buffer_pool_init(4*sizeof(float), NULL);
+	if (!ec->descr_pool)
+		pexit("av_buffer_pool_init failed");
 
 	ec->avctx = avctx;
 	ec->options = options;
 	ec->id = id;
 
 	ec->path = path;
+	ec->log = NULL;
+	ec->pl = NULL;
+	ec->restart = 1;
+	ec->pts_offset = 0;
+	ec->next_pts = AV_NOPTS_VALUE;
+	ec->rate = rate_init(id, dc->frame_rate);
 
 	#ifdef ET
 	logpath = malloc(512*sizeof(char));
@@ -174,6 +253,8 @@ void encoder_free(enc_ctx **ec)
 	queue_free(&e->frames);
 	avcodec_free_context(&e->avctx);
 	av_dict_free(&e->options);
+	av_buffer_pool_uninit(&e->descr_pool);
+	free(e->rate);
 	free(e);
 	*ec = NULL;
 }
@@ -193,6 +274,39 @@ static void supply_frame(AVCodecContext *avctx, AVFrame *frame)
 		pexit("memory allocation failed");
 }
 
+/**
+ * Take a packet for encoder output, reuse one recycled by the consumer if possible.
+ * Calls pexit in case of a failure.
+ */
+static AVPacket *get_packet(Queue *packets)
+{
+	AVPacket *pkt;
+
+	pkt = queue_reuse(packets);
+	if (!pkt)
+		pkt = av_packet_alloc();
+	if (!pkt)
+		pexit("av_packet_alloc failed");
+	return pkt;
+}
+
+/**
+ * Attach a foveation descriptor taken from a pool to a frame.
+ * Calls pexit in case of a failure.
+ * @return float* 4-tuple to be filled, owned by the frame
+ */
+static float *new_descriptor(AVFrame *frame, AVBufferPool *pool)
+{
+	AVBufferRef *buf;
+
+	buf = av_buffer_pool_get(pool);
+	if (!buf)
+		pexit("av_buffer_pool_get failed");
+	if (!av_frame_new_side_data_from_buf(frame, AV_FRAME_DATA_FOVEATION_DESCRIPTOR, buf))
+		pexit("side data allocation failed");
+	return (float *) buf->data;
+}
+
 void log_message(enc_ctx *ec, char *msg)
 {
 	fprintf(ec->log, msg);
@@ -209,24 +323,18 @@ int replicate_encoder_thread(void *ptr)
 	rep_enc_ctx *ec = (rep_enc_ctx *) ptr;
 	AVFrame *frame;
 	AVPacket *pkt;
-	AVFrameSideData *sd;
 	float *descr;
-	size_t descr_size = 4*sizeof(float);
 	int ret;
-	int64_t *timestamp;
 	int frame_number = 0;
 	float x, y, q, sigma;
 
-	pkt = av_packet_alloc(); //NULL check in loop.
+	pkt = get_packet(ec->packets);
 
 	for (;;) {
-		if (!pkt)
-			pexit("av_packet_alloc failed");
-
 		ret = avcodec_receive_packet(ec->avctx, pkt);
 		if (ret == 0) {
 			queue_append(ec->packets, pkt);
-			pkt = av_packet_alloc();
+			pkt = get_packet(ec->packets);
 			continue;
 		} else if (ret == AVERROR(EAGAIN)) {
 
@@ -243,29 +351,16 @@ int replicate_encoder_thread(void *ptr)
 
 			if (!frame)
 				break;
-			sd = av_frame_new_side_data(frame, AV_FRAME_DATA_FOVEATION_DESCRIPTOR, descr_size);
-			if (!sd)
-				pexit("side data allocation failed");
-
-			descr = malloc(4*sizeof(float));
-			if (!descr)
-				pexit("malloc failed");
+			descr = new_descriptor(frame, ec->descr_pool);
 			descr[0] = x;
 			descr[1] = y;
 			descr[2] = sigma;
 			descr[3] = q;
 
-			sd->data = (uint8_t *) descr;
 			frame_number++;
 			frame->pict_type = 0; //keep undefined to prevent warnings
 			supply_frame(ec->avctx, frame);
-			av_frame_free(&frame);
-
-			timestamp = malloc(sizeof(int64_t));
-			if (!timestamp)
-				perror("malloc failed");
-			*timestamp = av_gettime_relative();
-
+			queue_recycle(ec->frames, frame);
 		} else if (ret == AVERROR_EOF) {
 			break;
 		} else if (ret == AVERROR(EINVAL)) {
@@ -273,6 +368,7 @@ int replicate_encoder_thread(void *ptr)
 		}
 	}
 
+	av_packet_free(&pkt);
 	queue_append(ec->packets, NULL);
 	avcodec_close(ec->avctx);
 	avcodec_free_context(&ec->avctx);
@@ -280,74 +376,116 @@ int replicate_encoder_thread(void *ptr)
 	return 0;
 }
 
+/**
+ * Move a frame to the encoder's timeline and force a keyframe at the start of
+ * a run. The timeline keeps increasing across runs, as e.g. the mpeg4 encoder
+ * rejects pts that are not larger than the previous one.
+ */
+static void map_frame_pts(enc_ctx *ec, AVFrame *frame)
+{
+	if (ec->restart) {
+		ec->pts_offset = ec->next_pts == AV_NOPTS_VALUE ? 0 : ec->next_pts - frame->pts;
+		// the foveated decoder has been flushed and needs a keyframe
+		frame->pict_type = AV_PICTURE_TYPE_I;
+		ec->restart = 0;
+	} else {
+		frame->pict_type = 0; //keep undefined to prevent warnings
+	}
+	frame->pts += ec->pts_offset;
+	if (ec->next_pts == AV_NOPTS_VALUE || frame->pts >= ec->next_pts)
+		ec->next_pts = frame->pts + 1;
+}
+
+/**
+ * Move a packet back from the encoder's timeline to the one of the video.
+ */
+static void unmap_packet_pts(enc_ctx *ec, AVPacket *pkt)
+{
+	if (pkt->pts != AV_NOPTS_VALUE)
+		pkt->pts -= ec->pts_offset;
+	if (pkt->dts != AV_NOPTS_VALUE)
+		pkt->dts -= ec->pts_offset;
+}
+
 int encoder_thread(void *ptr)
 {
 	enc_ctx *ec = (enc_ctx *) ptr;
 	AVFrame *frame;
 	AVPacket *pkt;
-	AVFrameSideData *sd;
 	float *descr;
-	size_t descr_size = 4*sizeof(float);
 	int ret;
-	int64_t *timestamp;
 	int frame_number = 0;
 
-	pkt = av_packet_alloc(); //NULL check in loop.
+	pkt = get_packet(ec->packets);
 
 	for (;;) {
-		if (!pkt)
-			pexit("av_packet_alloc failed");
-
 		ret = avcodec_receive_packet(ec->avctx, pkt);
 		if (ret == 0) {
+			unmap_packet_pts(ec, pkt);
+			trace_record(TRACE_PACKET_OUT, pkt->pts);
+			if (ec->rate)
+				rate_update(ec->rate, pkt->size);
 			queue_append(ec->packets, pkt);
-			pkt = av_packet_alloc();
+			pkt = get_packet(ec->packets);
 			continue;
 		} else if (ret == AVERROR(EAGAIN)) {
 			frame = queue_extract(ec->frames);
 
-			if (!frame)
-				break;
+			if (!frame) {
+				// drain, the frames still held belong to this run
+				supply_frame(ec->avctx, NULL);
+				continue;
+			}
 
-			sd = av_frame_new_side_data(frame, AV_FRAME_DATA_FOVEATION_DESCRIPTOR, descr_size);
-			if (!sd)
-				pexit("side data allocation failed");
-
-			descr = foveation_descriptor(ec->avctx->width, ec->avctx->height);
-			sd->data = (uint8_t *) descr;
+			descr = new_descriptor(frame, ec->descr_pool);
+			foveation_descriptor(descr, ec->avctx->width, ec->avctx->height, frame->pts,
+					     ec->rate);
 			#ifdef ET
 			log_fov_descr(ec->log, descr, frame_number);
 			#endif
 			frame_number++;
 
-			frame->pict_type = 0; //keep undefined to prevent warnings
+			trace_record(TRACE_ENCODE_SUBMIT, frame->pts);
+			map_frame_pts(ec, frame);
 			supply_frame(ec->avctx, frame);
-			av_frame_free(&frame);
-
-			timestamp = malloc(sizeof(int64_t));
-			if (!timestamp)
-				perror("malloc failed");
-			*timestamp = av_gettime_relative();
-
-			queue_append(ec->timestamps, timestamp);
-
+			queue_recycle(ec->frames, frame);
 		} else if (ret == AVERROR_EOF) {
-			break;
+			// end of the run, the encoder stays open for the next one
+			if (ec->rate)
+				rate_report(ec->rate);
+			queue_append(ec->packets, NULL);
+			if (!ec->pl || pipeline_wait(ec->pl))
+				break;
+			// leave draining mode before the keyframe of the next run
+			avcodec_flush_buffers(ec->avctx);
+			ec->restart = 1;
 		} else if (ret == AVERROR(EINVAL)) {
 			pexit("avcodec_receive_packet failed");
 		}
 	}
 
-	queue_append(ec->packets, NULL);
-	queue_append(ec->timestamps, NULL);
+	av_packet_free(&pkt);
 	avcodec_close(ec->avctx);
-	fclose(ec->log);
+	if (ec->log)
+		fclose(ec->log);
 	avcodec_free_context(&ec->avctx);
 	encoder_free(&ec);
 	return 0;
 }
 
 
+static void unref_frame(void *item)
+{
+	av_frame_unref(item);
+}
+
+static void free_frame(void *item)
+{
+	AVFrame *frame = item;
+
+	av_frame_free(&frame);
+}
+
 dec_ctx *source_decoder_init(rdr_ctx *rc, int queue_capacity)
 {
 	AVCodecContext *avctx;
@@ -383,8 +521,15 @@ dec_ctx *source_decoder_init(rdr_ctx *rc, int queue_capacity)
 
 	dc->packets = rc->packets;
 	dc->frames = queue_init(queue_capacity);
+	queue_set_recycling(dc->frames, unref_frame, free_frame);
 	dc->avctx = avctx;
 	dc->frame_rate = stream->r_frame_rate;
+	// some demuxers, e.g. Y4M, only set the average without probing the stream
+	if (dc->frame_rate.num <= 0 || dc->frame_rate.den <= 0)
+		dc->frame_rate = stream->avg_frame_rate;
+	dc->stage = TRACE_SRC_DECODED;
+	dc->pl = NULL;
+	dc->cache = NULL;
 
 	return dc;
 }
@@ -412,26 +557,37 @@ int decoder_thread(void *ptr)
 	AVFrame *frame;
 	AVPacket *packet;
 
-	frame = av_frame_alloc();
+	frame = NULL;
 	for (;;) {
+		// reuse a frame recycled by the consumer if there is one
+		if (!frame)
+			frame = queue_reuse(dc->frames);
+		if (!frame)
+			frame = av_frame_alloc();
 		if (!frame)
 			pexit("av_frame_alloc failed");
 
 		ret = avcodec_receive_frame(avctx, frame);
 		if (ret == 0) {
-			// valid frame - enqueue and allocate new buffer
+			// valid frame - enqueue, take another buffer next iteration
+			trace_record(dc->stage, frame->pts);
 			queue_append(dc->frames, frame);
-			frame = av_frame_alloc();
+			frame = NULL;
 			continue;
 		} else if (ret == AVERROR(EAGAIN)) {
-			//provide another packet to the decoder
+			//provide another packet to the decoder, it keeps its own reference
 			packet = queue_extract(dc->packets);
 			supply_packet(avctx, packet);
-			//FIXME: The next line (if uncommented) causes segfaults on windows!
-			//av_packet_free(&packet);
+			queue_recycle(dc->packets, packet);
 			continue;
 		} else if (ret == AVERROR_EOF) {
-			break;
+			//enqueue flush packet to output
+			queue_append(dc->frames, NULL);
+			if (!dc->pl || pipeline_wait(dc->pl))
+				break;
+			// the decoder stays open, but forgets the previous run
+			avcodec_flush_buffers(avctx);
+			continue;
 		} else if (ret == AVERROR(EINVAL)) {
 			//fatal
 			pexit("avcodec_receive_frame failed");
@@ -439,19 +595,61 @@ int decoder_thread(void *ptr)
 	//note continue/break pattern before adding functionality here
 	}
 
-	//enqueue flush packet to output
-	queue_append(dc->frames, NULL);
+	av_frame_free(&frame);
 	avcodec_close(avctx);
 	decoder_free(&dc);
 	return 0;
 }
 
+static int (*fov_get_buffer)(AVCodecContext *, AVFrame *, int);
+static void *fov_get_buffer_opaque;
+
+void set_fov_get_buffer(int (*get_buffer2)(AVCodecContext *, AVFrame *, int),
+			void *opaque)
+{
+	fov_get_buffer = get_buffer2;
+	fov_get_buffer_opaque = opaque;
+}
+
+/**
+ * Open a foveated decoder for an allocated context, see fov_decoder_init.
+ * Calls pexit in case of a failure.
+ */
+static dec_ctx *fov_decoder_open(AVCodecContext *avctx, Queue *packets)
+{
+	dec_ctx *dc;
+	int ret;
+
+	if (fov_get_buffer) {
+		avctx->get_buffer2 = fov_get_buffer;
+		avctx->opaque = fov_get_buffer_opaque;
+		avctx->thread_safe_callbacks = 1;
+	}
+
+	ret = avcodec_open2(avctx, avctx->codec, NULL);
+	if (ret < 0)
+		pexit("avcodec_open2 failed");
+
+	dc = malloc(sizeof(dec_ctx));
+	if (!dc)
+		pexit("malloc failed");
+
+	dc->packets = packets;
+	/* a slow display drops stale frames instead of stalling the encoder */
+	dc->frames = queue_init_latest(free_frame);
+	queue_set_recycling(dc->frames, unref_frame, free_frame);
+	dc->avctx = avctx;
+	dc->stage = TRACE_FOV_DECODED;
+	dc->pl = NULL;
+	dc->cache = NULL;
+
+	return dc;
+}
+
 dec_ctx *fov_decoder_init(enc_ctx *ec)
 {
 	AVCodecContext *avctx;
 	AVCodec *codec;
-	dec_ctx *dc;
-	int ret;
 
 	codec = avcodec_find_decoder(ec->avctx->codec->id);
 
@@ -462,18 +660,31 @@ dec_ctx *fov_decoder_init(enc_ctx *ec)
 	if (!avctx)
 		pexit("avcodec_alloc_context3 failed");
 
-	ret = avcodec_open2(avctx, codec, NULL);
-	if (ret < 0)
-		pexit("avcodec_open2 failed");
+	return fov_decoder_open(avctx, ec->packets);
+}
 
-	dc = malloc(sizeof(dec_ctx));
-	if (!dc)
-		pexit("malloc failed");
+dec_ctx *remote_decoder_init(rdr_ctx *rc, AVRational frame_rate)
+{
+	AVStream *stream = rc->fctx->streams[rc->stream_index];
+	AVCodecContext *avctx;
+	AVCodec *codec;
+	dec_ctx *dc;
 
-	dc->packets = ec->packets;
-	dc->frames = queue_init(1);
-	dc->avctx = avctx;
+	codec = avcodec_find_decoder(stream->codecpar->codec_id);
+	if (!codec)
+		pexit("avcodec_find_decoder failed");
+
+	avctx = avcodec_alloc_context3(codec);
+	if (!avctx)
+		pexit("avcodec_alloc_context3 failed");
+
+	// e.g. parameter sets signalled out of band in the session description
+	if (avcodec_parameters_to_context(avctx, stream->codecpar) < 0)
+		pexit("avcodec_parameters_to_context failed");
+	avctx->time_base = stream->time_base;
 
+	dc = fov_decoder_open(avctx, rc->packets);
+	dc->frame_rate = frame_rate;
 	return dc;
 }
 
@@ -503,6 +714,34 @@ params *params_limit_init(enc_id id)
 		p->std_min = 0;
 		p->std_max = 2;
 		break;
+	case LIBX265:
+		/* HEVC shares the QP range of H.264 */
+		p->delta_min = 0;
+		p->delta_max = 51;
+		p->std_min = 0;
+		p->std_max = 2;
+		break;
+	case LIBVPX:
+		/* libvpx segment delta_q range */
+		p->delta_min = 0;
+		p->delta_max = 63;
+		p->std_min = 0;
+		p->std_max = 2;
+		break;
+	case LIBAOM:
+		/* libaom ROI delta_q range, libaom scales it to qindex */
+		p->delta_min = 0;
+		p->delta_max = 63;
+		p->std_min = 0;
+		p->std_max = 2;
+		break;
+	case MPEG4:
+		/* qscale range 1-31 */
+		p->delta_min = 0;
+		p->delta_max = 30;
+		p->std_min = 0;
+		p->std_max = 2;
+		break;
 	default:
 		pexit("requested params for unsupported codec");
 	}
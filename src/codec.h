@@ -20,6 +20,8 @@
 #include "common.h"
 #include "io.h"
 #include "et.h"
+#include "rate.h"
+#include "trace.h"
 #include <libavformat/avformat.h>
 #include <libavutil/frame.h>
 #include <libavutil/time.h>
@@ -35,6 +37,9 @@ typedef struct dec_ctx {
 	AVCodecContext *avctx; //to access internals (time_base etc.)
 	enc_id id;
 	AVRational frame_rate;
+	trace_stage stage; //traced for every output frame
+	struct pipeline *pl; //NULL if the thread exits after a single run
+	struct cache_ctx *cache; //set if frames come from a cache, see cache.h
 } dec_ctx;
 
 /**
@@ -44,13 +49,18 @@ typedef struct dec_ctx {
 typedef struct enc_ctx {
 	Queue *packets; //output
 	Queue *frames;  //input
-	Queue *timestamps; //timestamps to measure encoding-decoding-display lag
 	AVCodecContext *avctx;
 	AVDictionary *options; //encoder options
+	AVBufferPool *descr_pool; //foveation descriptor side data
 	enc_id id;
 	int run; // run of the same video, just for logging purposes
 	char *path;  // filename, just for logging purposes
 	FILE *log;
+	struct pipeline *pl; //NULL if the thread exits after a single run
+	int restart; //next frame starts a run
+	int64_t pts_offset; //maps the pts of the run to the encoder's timeline
+	int64_t next_pts; //lower bound of the next pts on the encoder's timeline
+	rate_ctl *rate; //NULL if foveation is open-loop, see rate_set_target
 } enc_ctx;
 
 /**
@@ -62,6 +72,7 @@ typedef struct rep_enc_ctx {
 	Queue *frames;  //input
 	AVCodecContext *avctx;
 	AVDictionary *options; //encoder options
+	AVBufferPool *descr_pool; //foveation descriptor side data
 	enc_id id;
 	char** xcoords;
 	char** ycoords;
@@ -72,9 +83,11 @@ typedef struct rep_enc_ctx {
 /**
  * Initialize a realtime (re)encoder
  *
- * Output queues have length 1 to enforce consumption of already processed
+ * The packet queue has length 1 to enforce consumption of already processed
  * frames before futher frames can be added, as additional buffering is unnecessary
- * in real time applications.
+ * in real time applications. Packets and frames are recycled through their
+ * queues and descriptors are taken from a pool, so the steady state does not
+ * allocate per frame.
  * @param id identifies the encoder to use.
  * @param dc context of the decoder which supplies the frames, to set e.g. the time base.
  * @param w_ctx window context, necessary for pseudo-gaze emulation through the mouse pointer.
@@ -82,6 +95,14 @@ typedef struct rep_enc_ctx {
 enc_ctx *encoder_init(enc_id id, dec_ctx *dc, char *path);
 
 
+/**
+ * Set the falloff of the QP offsets for encoders created afterwards.
+ * Calls pexit in case of an unknown model.
+ * @param model gaussian (default), linear_mar or geisler_perry, see
+ * AVFoveationModel
+ */
+void set_foveation_model(const char *model);
+
 /**
  * Initialize a replication encoder, which produces the same stream that was
  * created in a real-time experiment previously.
@@ -102,7 +123,11 @@ void encoder_free(enc_ctx **ec);
  * Encode AVFrames, put the resulting AVPacktes in a queue
  *
  * Call avcodec_receive_packet in a loop, enqueue encoded packets.
- * Adds NULL packet to queue in the end.
+ * Adds NULL packet to queue in the end, after draining the frames the
+ * encoder still holds. If the encoder belongs to a pipeline, wait for a
+ * restart, flush and encode the next run without reopening the encoder:
+ * the first frame of a run is a keyframe, and pts are shifted internally to
+ * keep increasing across runs.
  * @param ptr will be casted to (enc_ctx *)
  * @return int 0 on success
  */
@@ -126,20 +151,46 @@ dec_ctx *source_decoder_init(rdr_ctx *rc, int queue_capacity);
  * Decode AVPackets and put the uncompressed AVFrames in a queue.
  *
  * Call avcodec_receive_frame in a loop, enqueue decoded frames.
- * Adds NULL packet to queue in the end.
+ * Consumed packets are recycled, frames recycled by the consumer are reused.
+ * Adds NULL packet to queue in the end. If the decoder belongs to a pipeline,
+ * wait for a restart and flush the decoder for the next run.
  * @param *ptr will be cast to (decoder_context *)
  * @return int 0 on success.
  */
 int decoder_thread(void *ptr);
 
+/**
+ * Set the frame allocator of foveated decoders initialized afterwards.
+ *
+ * Lets the display hand out memory it renders from, see window_get_buffer.
+ * The allocator is called from the decoder thread and must be thread safe.
+ * @param get_buffer2 see AVCodecContext.get_buffer2, NULL for the default
+ * @param opaque stored in AVCodecContext.opaque
+ */
+void set_fov_get_buffer(int (*get_buffer2)(AVCodecContext *, AVFrame *, int),
+			void *opaque);
+
 /**
  * Initialize a foveated decoder.
  *
+ * The frame queue is latest-only: a frame the display did not pick up yet is
+ * replaced by the next one, see queue_dropped for the number of stale frames.
+ * Frames are allocated as set by set_fov_get_buffer.
  * @param ec used to copy e.g. the codec id from.
  * @return decoder_context* with members initialized and an opened decoder.
  */
 dec_ctx *fov_decoder_init(enc_ctx *ec);
 
+/**
+ * Initialize a foveated decoder for packets received from a server, see net.h.
+ *
+ * Behaves like fov_decoder_init, the codec is taken from the stream.
+ * @param rc receiver the packets are read by
+ * @param frame_rate frame rate announced by the server
+ * @return decoder_context* with members initialized and an opened decoder.
+ */
+dec_ctx *remote_decoder_init(rdr_ctx *rc, AVRational frame_rate);
+
 /**
  * Free the decoder_context and associated data, set d_ctx to NULL.
  *
@@ -22,6 +22,8 @@ typedef enum {
 	LIBX264,
 	LIBX265,
 	LIBVPX,
+	LIBAOM,
+	MPEG4,
 } enc_id;
 
 typedef struct params {
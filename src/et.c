@@ -18,16 +18,70 @@
 #include "et.h"
 #include "pexit.h"
 #include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include <libavutil/common.h>
+#include <libavutil/time.h>
 
 //#define ET
 static gaze *gs;
 static lab_setup *ls;
-static SDL_Window *win;
 static params *p;
 
 static SDL_mutex *qp_offset_mutex;
 static float qp_offset;
 
+// display frames are presented on, see set_display
+static lab_setup display = {
+	// HP Z31x of the lab
+	.screen_width = 698,
+	.screen_height = 368,
+	.screen_res_w = 4096,
+	.screen_res_h = 2160,
+};
+
+// viewing distance the fovea is sized for, see fovea_distance
+static double nominal_distance = VIEWING_DISTANCE;
+static struct {
+	double distance; // smoothed, 0 before the first frame
+	uint64_t frames;
+	uint64_t measured; // frames with a measured distance
+	double distance_sum;
+} fovea;
+
+// the eye-tracker, see gaze_tracker
+static gaze_source *tracker;
+
+// latest valid gaze, used by the encoder thread
+static gaze_sample last;
+static int last_valid;
+
+// gaze events and the policy applied to them, see gaze_classifier
+static gaze_classifier cls = {.frozen_since = -1};
+static gaze_policy policy = {gaze_freeze, gaze_suppress, gaze_suppress};
+static uint32_t next_seq; // of the next sample to classify
+
+// gaze prediction, see gaze_predictor
+static gaze_predictor pred;
+static int predict = 1;
+static int64_t latency_fixed = -1;
+
+// encoding time of the frames in flight, matched by pts, see gaze_presented
+static struct {
+	atomic_int_fast64_t pts;
+	atomic_int_fast64_t time;
+} encoded[PREDICT_RING];
+static atomic_int_fast64_t latency = -1; // smoothed, -1 before the first frame
+
+// age of gaze samples at encoding, see gaze_report
+static struct {
+	uint64_t frames;
+	uint64_t missing; // frames encoded before the first valid sample
+	double age_sum;
+	int64_t age_max;
+} age;
+
 void set_qp_offset(int q)
 {
 	SDL_LockMutex(qp_offset_mutex);
@@ -44,53 +98,539 @@ float get_qp_offset()
 	return q;
 }
 
-float *foveation_descriptor(int frame_width, int frame_height)
+gaze_source *gaze_tracker(void)
 {
-	float *fd;
-	float x, y;
-	int x_int, y_int;
-	int win_x, win_y;
-	int win_width, win_height;
+	return tracker;
+}
 
-	float frame_width_mm, frame_height_mm;
+void set_gaze_prediction(int enable)
+{
+	predict = enable;
+}
 
-	SDL_GetWindowSize(win, &win_width, &win_height);
-	SDL_GetWindowPosition(win, &win_x, &win_y);
+void set_gaze_latency(int64_t us)
+{
+	latency_fixed = us;
+}
 
-	fd = malloc(4*sizeof(float));
-	if (!fd)
-		pexit("malloc failed");
+void set_gaze_policy(const gaze_policy *gp)
+{
+	policy = *gp;
+}
 
-	#ifdef ET
-	SDL_LockMutex(gs->mutex);
-	//gaze coordinates have their origin at the upper left screen corner, shift to upper left window corner
-	x = (float) gs->gazeX_mean - win_x;
-	y = (float) gs->gazeY_mean - win_y;
-	SDL_UnlockMutex(gs->mutex);
-	#else
-	SDL_GetMouseState(&x_int, &y_int);
-	//mouse coordinates have origin already at upper left window corner
-	x = (float) x_int;
-	y = (float) y_int;
-	#endif
-	//shift by border margins to make origin upper left frame corner
-	x = x - ((win_width - frame_width) / 2);
-	y = y - ((win_height - frame_height) / 2);
-	//descriptor coordinates are relative in terms of frame width/height
-	fd[0] = x / frame_width;
-	fd[1] = y / frame_height;
+void set_display(const char *desc)
+{
+	double w, h;
+	int cols, rows;
+	char c;
+
+	if (!strcmp(desc, "hpz31x")) {
+		w = 698, h = 368, cols = 4096, rows = 2160;
+	} else if (!strcmp(desc, "t470s")) {
+		w = 310, h = 170, cols = 2560, rows = 1440;
+	} else if (sscanf(desc, "%lfx%lf@%dx%d%c", &w, &h, &cols, &rows, &c) != 4) {
+		fprintf(stderr, "display: %s\n", desc);
+		pexit("display is neither known nor <width>x<height>@<columns>x<rows>");
+	}
+	if (w <= 0 || h <= 0 || cols <= 0 || rows <= 0)
+		pexit("display size and resolution must be positive");
+
+	display.screen_width = w;
+	display.screen_height = h;
+	display.screen_res_w = cols;
+	display.screen_res_h = rows;
+}
+
+void set_viewing_distance(double mm)
+{
+	if (mm <= 0)
+		pexit("viewing distance must be positive");
+	nominal_distance = mm;
+}
+
+/**
+ * Remember when the frame with the given pts was encoded, see gaze_presented.
+ */
+static void gaze_encoded(int64_t pts, int64_t now)
+{
+	int i = (uint64_t) pts % PREDICT_RING;
+
+	// invalidate the entry first, readers compare the pts before and after
+	atomic_store(&encoded[i].pts, INT64_MIN);
+	atomic_store(&encoded[i].time, now);
+	atomic_store(&encoded[i].pts, pts);
+}
+
+void gaze_presented(int64_t pts)
+{
+	int i = (uint64_t) pts % PREDICT_RING;
+	int64_t t, l, old;
+
+	if (atomic_load(&encoded[i].pts) != pts)
+		return;
+	t = atomic_load(&encoded[i].time);
+	if (atomic_load(&encoded[i].pts) != pts)
+		return;
+
+	// only the display thread updates the latency
+	l = av_gettime_relative() - t;
+	old = atomic_load(&latency);
+	atomic_store(&latency, old < 0 ? l : old + llrint((l - old) * PREDICT_LATENCY_SMOOTHING));
+}
+
+/**
+ * Latency from encoding to presentation the gaze is predicted for.
+ */
+static int64_t pipeline_latency(void)
+{
+	if (latency_fixed >= 0)
+		return latency_fixed;
+	return FFMAX(atomic_load(&latency), 0);
+}
+
+/**
+ * Visual angle in degrees of a distance on the screen in mm.
+ */
+static double visual_angle(double mm, double distance)
+{
+	return atan2(mm, distance) * 180 / M_PI;
+}
+
+/**
+ * Eye to screen distance of a sample in mm.
+ */
+static double viewing_distance(const gaze_sample *s)
+{
+	return s->flags & GAZE_DISTANCE_VALID && s->distance > 0 ? s->distance : nominal_distance;
+}
+
+static void classify_event(gaze_classifier *c, gaze_event e, int64_t time)
+{
+	c->event = e;
+	c->since = time;
+	c->events[e]++;
+}
+
+/**
+ * Start a new fixation candidate at a sample.
+ */
+static void fixation_window(gaze_classifier *c, const gaze_sample *s)
+{
+	c->window = s->time;
+	c->min_x = c->max_x = c->sum_x = s->x;
+	c->min_y = c->max_y = c->sum_y = s->y;
+	c->count = 1;
+}
+
+/**
+ * Extrapolate the landing point and end of the current saccade.
+ * @param width frame width in mm
+ * @param height frame height in mm
+ * @param covered mm covered in the middle of the latest velocity window
+ */
+static void saccade_landing(gaze_classifier *c, const gaze_sample *s, double width,
+			    double height, double distance, double covered)
+{
+	double dx, dy, d, amplitude;
+
+	dx = (s->x - c->start_x) * width;
+	dy = (s->y - c->start_y) * height;
+	d = hypot(dx, dy);
+	if (c->velocity > c->peak) {
+		// accelerating, main sequence: peak = max * (1 - exp(-amplitude / scale))
+		c->peak = c->velocity;
+		c->peak_distance = covered;
+		amplitude = -CLASSIFY_VELOCITY_SCALE *
+			log(1 - FFMIN(c->velocity / CLASSIFY_VELOCITY_MAX, 0.99));
+		amplitude = distance * tan(amplitude * M_PI / 180);
+	} else {
+		amplitude = 2 * c->peak_distance;
+	}
+	// the eye does not land behind where it already is
+	amplitude = FFMAX(amplitude, d);
+	if (d > 0) {
+		c->land_x = av_clipd(c->start_x + dx / d * amplitude / width, 0, 1);
+		c->land_y = av_clipd(c->start_y + dy / d * amplitude / height, 0, 1);
+	} else {
+		c->land_x = s->x;
+		c->land_y = s->y;
+	}
+	c->end = c->since + CLASSIFY_DURATION_BASE +
+		 CLASSIFY_DURATION_SLOPE * visual_angle(amplitude, distance);
+}
+
+/**
+ * Classify a sample, samples seen before are skipped.
+ * @param width frame width in mm
+ * @param height frame height in mm
+ */
+static void classify(gaze_classifier *c, const gaze_sample *s, double width, double height)
+{
+	double distance, dispersion, dt;
+
+	if (!(s->flags & GAZE_VALID)) {
+		if (!c->valid)
+			return;
+		if (c->event == GAZE_BLINK && s->time - c->since > CLASSIFY_BLINK_MAX)
+			classify_event(c, GAZE_UNCLASSIFIED, s->time); // lost track
+		else if (c->event != GAZE_BLINK && s->time - c->last.time <= CLASSIFY_BLINK_MAX)
+			classify_event(c, GAZE_BLINK, s->time);
+		return;
+	}
+
+	if (c->valid && s->time <= c->last.time)
+		return;
+	if (!c->valid || c->event == GAZE_BLINK || s->time - c->last.time > CLASSIFY_BLINK_MAX) {
+		classify_event(c, GAZE_UNCLASSIFIED, s->time);
+		c->valid = 1;
+		c->last = *s;
+		c->ref = *s;
+		fixation_window(c, s);
+		return;
+	}
+	c->last = *s;
+	distance = viewing_distance(s);
+
+	// dispersion-threshold identification of fixations
+	c->min_x = FFMIN(c->min_x, s->x);
+	c->max_x = FFMAX(c->max_x, s->x);
+	c->min_y = FFMIN(c->min_y, s->y);
+	c->max_y = FFMAX(c->max_y, s->y);
+	c->sum_x += s->x;
+	c->sum_y += s->y;
+	c->count++;
+	dispersion = visual_angle((c->max_x - c->min_x) * width + (c->max_y - c->min_y) * height,
+				  distance);
+	if (dispersion > CLASSIFY_DISPERSION) {
+		if (c->event == GAZE_FIXATION)
+			classify_event(c, GAZE_UNCLASSIFIED, s->time);
+		fixation_window(c, s);
+	} else if (c->event == GAZE_UNCLASSIFIED && s->time - c->window >= CLASSIFY_FIXATION_MIN) {
+		classify_event(c, GAZE_FIXATION, c->window);
+		c->fix_x = c->sum_x / c->count;
+		c->fix_y = c->sum_y / c->count;
+	}
+
+	// velocity-threshold identification of saccades
+	// the velocity between single samples is dominated by tracker noise
+	if (s->time - c->ref.time < CLASSIFY_VELOCITY_WINDOW)
+		return;
+	dt = (s->time - c->ref.time) / 1e6;
+	c->velocity = visual_angle(hypot((s->x - c->ref.x) * width,
+					 (s->y - c->ref.y) * height), distance) / dt;
+
+	if (c->event != GAZE_SACCADE && c->velocity > CLASSIFY_SACCADE_ONSET) {
+		classify_event(c, GAZE_SACCADE, c->ref.time);
+		c->start_x = c->ref.x;
+		c->start_y = c->ref.y;
+		c->peak = 0;
+	} else if (c->event == GAZE_SACCADE && c->velocity < CLASSIFY_SACCADE_END) {
+		classify_event(c, GAZE_UNCLASSIFIED, s->time);
+		fixation_window(c, s);
+	}
+	if (c->event == GAZE_SACCADE) {
+		// the velocity holds for the middle of the window
+		saccade_landing(c, s, width, height, distance,
+				hypot(((s->x + c->ref.x) / 2 - c->start_x) * width,
+				      ((s->y + c->ref.y) / 2 - c->start_y) * height));
+	}
+	c->ref = *s;
+}
+
+int gaze_freeze(float *fd, const gaze_classifier *c, int64_t display)
+{
+	(void) display;
+	if (c->event != GAZE_FIXATION)
+		return 0;
+	if (c->frozen_since == c->since) {
+		memcpy(fd, c->frozen_fd, sizeof(c->frozen_fd));
+		return 1;
+	}
+	fd[0] = c->fix_x;
+	fd[1] = c->fix_y;
+	return 1;
+}
+
+int gaze_suppress(float *fd, const gaze_classifier *c, int64_t display)
+{
+	if (c->event == GAZE_SACCADE && display >= c->end)
+		return 0;
+	if (c->event == GAZE_BLINK && display >= c->since + CLASSIFY_BLINK_MIN)
+		return 0;
+	if (c->event != GAZE_SACCADE && c->event != GAZE_BLINK)
+		return 0;
+	// a degenerate gaussian leaves the whole frame at the peripheral offset
+	fd[2] = 0;
+	fd[3] = FFMAX(fd[3], p->delta_max);
+	return 1;
+}
+
+/**
+ * Apply the policy for the event of the latest sample.
+ * @param display expected presentation time of the frame
+ */
+static void apply_policy(float *fd, int64_t display)
+{
+	int (*hook)(float *fd, const gaze_classifier *c, int64_t display) = NULL;
+
+	cls.frames[cls.event]++;
+	if (cls.event == GAZE_FIXATION)
+		hook = policy.fixation;
+	else if (cls.event == GAZE_SACCADE)
+		hook = policy.saccade;
+	else if (cls.event == GAZE_BLINK)
+		hook = policy.blink;
+
+	if (hook && hook(fd, &cls, display)) {
+		if (cls.event == GAZE_FIXATION) {
+			cls.frozen++;
+			cls.frozen_since = cls.since;
+			memcpy(cls.frozen_fd, fd, sizeof(cls.frozen_fd));
+		} else {
+			cls.suppressed++;
+		}
+	} else {
+		cls.frozen_since = -1;
+	}
+}
+
+static void kalman_reset(kalman_axis *k, double p)
+{
+	k->p = p;
+	k->v = 0;
+	k->P[0][0] = PREDICT_NOISE * PREDICT_NOISE;
+	k->P[0][1] = k->P[1][0] = 0;
+	// the velocity is unknown, up to about a frame per second
+	k->P[1][1] = 1;
+}
+
+/**
+ * Advance a filter by dt seconds and update it with a measured position.
+ */
+static void kalman_step(kalman_axis *k, double z, double dt)
+{
+	double q = PREDICT_ACCEL;
+	double P00, P01, P11, S, K0, K1, y;
+
+	// predict, white noise acceleration
+	k->p += k->v * dt;
+	P00 = k->P[0][0] + dt * (2 * k->P[0][1] + dt * k->P[1][1]) + q * dt * dt * dt / 3;
+	P01 = k->P[0][1] + dt * k->P[1][1] + q * dt * dt / 2;
+	P11 = k->P[1][1] + q * dt;
+
+	// correct
+	S = P00 + PREDICT_NOISE * PREDICT_NOISE;
+	K0 = P00 / S;
+	K1 = P01 / S;
+	y = z - k->p;
+	k->p += K0 * y;
+	k->v += K1 * y;
+	k->P[0][0] = (1 - K0) * P00;
+	k->P[0][1] = k->P[1][0] = (1 - K0) * P01;
+	k->P[1][1] = P11 - K1 * P01;
+}
+
+/**
+ * Feed a valid sample to the predictor, samples seen before are skipped.
+ * @param landed 1 if the sample ended a saccade
+ */
+static void predict_feed(gaze_predictor *pr, const gaze_sample *s, int landed)
+{
+	double dt;
+
+	if (pr->valid && s->time <= pr->last.time)
+		return;
+	if (!pr->valid || landed || s->time - pr->last.time > PREDICT_GAP) {
+		// restart without the velocity of a saccade
+		kalman_reset(&pr->x, s->x);
+		kalman_reset(&pr->y, s->y);
+		if (landed)
+			pr->settle = s->time + PREDICT_SETTLE;
+		pr->valid = 1;
+		pr->last = *s;
+		return;
+	}
+
+	dt = (s->time - pr->last.time) / 1e6;
+	kalman_step(&pr->x, s->x, dt);
+	kalman_step(&pr->y, s->y, dt);
+	pr->last = *s;
+}
+
+/**
+ * Classify the samples published since the previous frame and feed them to
+ * the predictor.
+ * @param latest latest sample of the source
+ * @param width frame width in mm
+ * @param height frame height in mm
+ */
+static void gaze_catch_up(const gaze_sample *latest, double width, double height)
+{
+	gaze_sample s;
+	gaze_event e;
+	uint32_t seq = next_seq;
+
+	// e.g. a new source, or more samples than kept since the previous frame
+	if ((int32_t) (latest->seq - seq) < 0 || latest->seq - seq >= GAZE_HISTORY)
+		seq = latest->seq;
+	for (; seq != latest->seq + 1; seq++) {
+		if (!gaze_history(seq, &s))
+			continue;
+		e = cls.event;
+		classify(&cls, &s, width, height);
+		if (predict && s.flags & GAZE_VALID)
+			predict_feed(&pred, &s, e == GAZE_SACCADE && cls.event != GAZE_SACCADE);
+	}
+	next_seq = seq;
+}
+
+/**
+ * Predict the gaze at presentation of a frame encoded now.
+ * @param fd descriptor to set x and y of
+ * @return factor to widen sigma by
+ */
+static double predict_gaze(gaze_predictor *pr, float *fd, int64_t now)
+{
+	int64_t horizon;
+
+	horizon = av_clip64(now - pr->last.time + pipeline_latency(), 0, PREDICT_HORIZON_MAX);
+	pr->frames++;
+	pr->horizon_sum += horizon;
+
+	if (cls.event == GAZE_SACCADE) {
+		fd[0] = cls.land_x;
+		fd[1] = cls.land_y;
+	} else {
+		// kept on the frame, like the landing point of a saccade
+		fd[0] = av_clipd(pr->x.p + pr->x.v * horizon / 1e6, 0, 1);
+		fd[1] = av_clipd(pr->y.p + pr->y.v * horizon / 1e6, 0, 1);
+	}
+	return cls.event == GAZE_SACCADE || now < pr->settle ? PREDICT_SACCADE_WIDEN : 1;
+}
+
+/**
+ * Latest valid gaze of the source in use, relative to the frame size.
+ * @param width frame width in mm, for the classifier
+ * @param height frame height in mm
+ * @return 1 on success, 0 if no valid sample has been published yet
+ */
+static int latest_gaze(float *fd, double width, double height, int64_t now)
+{
+	gaze_sample s;
+	int64_t a;
+
+	if (gaze_latest(&s)) {
+		gaze_catch_up(&s, width, height);
+		if (s.flags & GAZE_VALID) {
+			last = s;
+			last_valid = 1;
+		}
+	}
+	if (!last_valid) {
+		age.missing++;
+		return 0;
+	}
+
+	// blinks and tracking losses keep the last valid position
+	a = now - last.time;
+	age.frames++;
+	age.age_sum += a;
+	age.age_max = FFMAX(age.age_max, a);
+
+	fd[0] = last.x;
+	fd[1] = last.y;
+	return 1;
+}
+
+/**
+ * Viewing distance to size the fovea of a frame for, in mm.
+ */
+static double fovea_distance(void)
+{
+	double d = nominal_distance;
+
+	if (last_valid && last.flags & GAZE_DISTANCE_VALID && last.distance > 0) {
+		d = last.distance;
+		fovea.measured++;
+	}
+	// tracker noise must not change the descriptor of every frame
+	d = av_clipd(d, FOVEA_DISTANCE_MIN, FOVEA_DISTANCE_MAX);
+	fovea.distance = fovea.distance > 0 ?
+		fovea.distance + FOVEA_DISTANCE_SMOOTHING * (d - fovea.distance) : d;
+	fovea.frames++;
+	fovea.distance_sum += fovea.distance;
+	return fovea.distance;
+}
+
+void gaze_report(const char *what)
+{
+	if (fovea.measured)
+		fprintf(stderr, "%s: viewing distance mean %.0f mm, measured in %"PRIu64" of "
+			"%"PRIu64" frames\n", what, fovea.distance_sum / fovea.frames,
+			fovea.measured, fovea.frames);
+	fovea.frames = 0;
+	fovea.measured = 0;
+	fovea.distance_sum = 0;
+
+	if (pred.frames)
+		fprintf(stderr, "%s: gaze predicted %.2f ms ahead, pipeline latency %.2f ms\n",
+			what, pred.horizon_sum / pred.frames / 1000, pipeline_latency() / 1000.0);
+	pred.frames = 0;
+	pred.horizon_sum = 0;
+
+	if (cls.valid)
+		fprintf(stderr, "%s: %"PRIu64" fixations, %"PRIu64" saccades, %"PRIu64" blinks, "
+			"frames encoded in them %"PRIu64", %"PRIu64", %"PRIu64", "
+			"%"PRIu64" frozen, %"PRIu64" suppressed\n", what,
+			cls.events[GAZE_FIXATION], cls.events[GAZE_SACCADE], cls.events[GAZE_BLINK],
+			cls.frames[GAZE_FIXATION], cls.frames[GAZE_SACCADE], cls.frames[GAZE_BLINK],
+			cls.frozen, cls.suppressed);
+	memset(cls.events, 0, sizeof(cls.events));
+	memset(cls.frames, 0, sizeof(cls.frames));
+	cls.frozen = 0;
+	cls.suppressed = 0;
+
+	if (!age.frames && !age.missing)
+		return;
+	fprintf(stderr, "%s: gaze age at encoding mean %.2f ms, max %.2f ms, "
+		"%"PRIu64" frames without gaze\n", what,
+		age.frames ? age.age_sum / age.frames / 1000 : 0.0,
+		age.age_max / 1000.0, age.missing);
+	memset(&age, 0, sizeof(age));
+}
+
+void foveation_descriptor(float *fd, int frame_width, int frame_height, int64_t pts,
+			  rate_ctl *rate)
+{
+	float frame_width_mm, frame_height_mm;
+	int64_t now = av_gettime_relative();
+	int valid;
 
 	frame_width_mm = ls->screen_width * (float) frame_width / ls->screen_res_w;
 	frame_height_mm = ls->screen_height * (float) frame_height / ls->screen_res_h;
+	valid = latest_gaze(fd, frame_width_mm, frame_height_mm, now);
 
 	/*
-	 * we assume a distance of 650mm to the screen,
-	 * then 2 * tan(2.5°) * 650 = 56.7mm is a reasonable choice for foveation diameter
+	 * the foveal region spans FOVEA_ANGLE, e.g. 2 * tan(2.5°) * 650mm = 56.7mm
+	 * at a distance of 650mm to the screen
 	 */
-	fd[2] = 56.7 / sqrt(pow(frame_width_mm, 2) + pow(frame_height_mm, 2));
+	fd[2] = 2 * fovea_distance() * tan(FOVEA_ANGLE / 2 * M_PI / 180) /
+		hypot(frame_width_mm, frame_height_mm);
 	fd[3] = get_qp_offset();
 
-	return fd;
+	if (!valid) {
+		fd[0] = 0.5;
+		fd[1] = 0.5;
+		if (rate)
+			rate_apply(rate, fd);
+	} else {
+		if (predict)
+			fd[2] *= predict_gaze(&pred, fd, now);
+		if (rate)
+			rate_apply(rate, fd);
+		apply_policy(fd, now + pipeline_latency());
+	}
+	gaze_encoded(pts, now);
 }
 
 #ifdef ET
@@ -98,9 +638,9 @@ int __stdcall update_gaze(struct SampleStruct sampleData)
 {
 	double x, y, z; //mean eye coordinates for distance
 	//double theta;
+	gaze_sample s = {0};
 
-
-	SDL_LockMutex(gs->mutex);
+	// gs is only used by the callback thread, samples are published through tracker
 	gs->left.x = sampleData.leftEye.eyePositionX;
 	gs->left.y = sampleData.leftEye.eyePositionY;
 	gs->left.z = sampleData.leftEye.eyePositionZ;
@@ -123,20 +663,27 @@ int __stdcall update_gaze(struct SampleStruct sampleData)
 	gs->gazeX_mean = (gs->left.gazeX + gs->right.gazeX) / 2;
 	gs->gazeY_mean = (gs->left.gazeY + gs->right.gazeY) / 2;
 
-	// distance towards eyetracker, not screen!!!
-	gs->distance = sqrt(x*x + y*y + z*z);
-
-	SDL_UnlockMutex(gs->mutex);
+	/*
+	 * eye positions are relative to the camera, which is inclined upwards and
+	 * stands camera_z in front of the screen, the distance is to the screen
+	 */
+	gs->distance = z * cos(ls->camera_inclination * M_PI / 180) -
+		       y * sin(ls->camera_inclination * M_PI / 180) + ls->camera_z;
+	(void) x;
+
+	s.time = av_gettime_relative();
+	s.distance = gs->distance;
+	s.flags = GAZE_DISTANCE_VALID;
+	// no pupil in either eye during blinks and tracking losses
+	if ((gs->left.diam > 0 || gs->right.diam > 0) &&
+	    gaze_screen_to_frame(gs->gazeX_mean, gs->gazeY_mean, &s.x, &s.y))
+		s.flags |= GAZE_VALID;
+	gaze_publish(tracker, &s);
 
 	return 0;
 }
 #endif
 
-void set_ivx_window(SDL_Window *w)
-{
-	win = w;
-}
-
 void setup_ivx(enc_id id)
 {
 
@@ -149,29 +696,18 @@ void setup_ivx(enc_id id)
 	if (!ls)
 		pexit("malloc failed");
 
-	// Hardcoded HP Z31x screen
-	ls->screen_width = 698;
-	ls->screen_height = 368;
-	ls->screen_diam = sqrt(pow(ls->screen_width, 2) + pow(ls->screen_height, 2));
-	ls->screen_res_w = 4096;
-	ls->screen_res_h = 2160;
-
-	//Hardcoded: T470s screen
-	/*
-	ls->screen_width = 310;
-	ls->screen_height = 170;
-	ls->screen_diam = sqrt(pow(ls->screen_width, 2) + pow(ls->screen_height, 2));
-	ls->screen_res_w = 2560;
-	ls->screen_res_h = 1440;
-	*/
+	// see set_display
+	*ls = display;
+	ls->screen_diam = hypot(ls->screen_width, ls->screen_height);
 
 	ls->camera_x = 0;
-	ls->camera_z = 0;
+	ls->camera_z = 80; // the SMI bracket, redStimDistDepth
 	ls->camera_inclination = 20; //degrees upward for the SMI bracket
-	gs->mutex = SDL_CreateMutex();
 	p = params_limit_init(id);
 
 	qp_offset_mutex = SDL_CreateMutex();
+	for (int i = 0; i < PREDICT_RING; i++)
+		atomic_init(&encoded[i].pts, INT64_MIN);
 
 	#ifdef ET
 
@@ -208,7 +744,7 @@ void setup_ivx(enc_id id)
 	geometry.stimY = ls->screen_height;
 	geometry.redInclAngle = 20;  //degrees
 	geometry.redStimDistHeight = 25; //mm
-	geometry.redStimDistDepth =  80; //mm
+	geometry.redStimDistDepth = ls->camera_z; //mm
 	strncpy(geometry.setupName, "HPZ31x", 256);
 
 	iV_SetREDGeometry(&geometry);
@@ -233,6 +769,7 @@ void setup_ivx(enc_id id)
 	// start calibration
 	ret_calibrate = iV_Calibrate();
 
+	tracker = gaze_source_alloc("tracker", NULL, NULL, NULL);
 	iV_SetSampleCallback(update_gaze);
 	#endif
 }
@@ -18,10 +18,15 @@
 #pragma once
 
 #include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <SDL2/SDL.h>
+#include <libavutil/foveation.h>
 #include "common.h"
 #include "codec.h"
+#include "gaze.h"
 #include "io.h"
+#include "rate.h"
 #ifdef ET
 #include <iViewXAPI.h>
 #endif
@@ -34,7 +39,7 @@ typedef struct lab_setup {
 	int screen_res_w;
 	int screen_res_h;
 	double camera_x;
-	double camera_z;
+	double camera_z; // in front of the screen, in mm
 	double camera_inclination;
 } lab_setup;
 
@@ -53,9 +58,136 @@ typedef struct gaze {
 	eye_data left;
 	eye_data right;
 	double distance; //mean eye-screen distance
-	SDL_mutex *mutex;
 } gaze;
 
+// nominal eye to screen distance in mm, used without a measured one
+#define VIEWING_DISTANCE 650
+
+// the fovea, see foveation_descriptor
+#define FOVEA_ANGLE AV_FOVEATION_SIGMA_DEGREES // deg, diameter of the foveal region
+#define FOVEA_DISTANCE_MIN 200         // mm, measured distances are clipped to
+#define FOVEA_DISTANCE_MAX 2000        // mm
+#define FOVEA_DISTANCE_SMOOTHING 0.1   // weight of the latest frame
+
+// gaze events, see gaze_classifier
+#define CLASSIFY_VELOCITY_WINDOW 8000  // us between samples the velocity is taken over
+#define CLASSIFY_SACCADE_ONSET 75      // deg/s
+#define CLASSIFY_SACCADE_END 30        // deg/s
+#define CLASSIFY_DISPERSION 1.0        // deg, extent of the samples of a fixation
+#define CLASSIFY_FIXATION_MIN 100000   // us
+#define CLASSIFY_BLINK_MIN 100000      // us a blink is assumed to last at least
+#define CLASSIFY_BLINK_MAX 500000      // us, longer losses are not blinks
+#define CLASSIFY_VELOCITY_MAX 700      // deg/s, asymptote of the main sequence
+#define CLASSIFY_VELOCITY_SCALE 10     // deg, amplitude constant of the main sequence
+#define CLASSIFY_DURATION_BASE 21000   // us, saccade duration of the main sequence
+#define CLASSIFY_DURATION_SLOPE 2200   // us per deg of amplitude
+
+// gaze prediction, see gaze_predictor
+#define PREDICT_NOISE 0.003           // stddev of the tracker relative to the frame
+#define PREDICT_ACCEL 1.0             // process noise of the velocity, frame^2/s^3
+#define PREDICT_GAP 100000            // us without valid samples that reset the filter
+#define PREDICT_HORIZON_MAX 200000    // us predicted ahead at most
+#define PREDICT_SACCADE_WIDEN 2.0     // sigma factor during saccades
+#define PREDICT_SETTLE 50000          // us sigma stays widened after a saccade
+#define PREDICT_LATENCY_SMOOTHING 0.1 // weight of the latest presented frame
+#define PREDICT_RING 64               // frames encoded and not yet presented, power of 2
+
+typedef enum gaze_event {
+	GAZE_UNCLASSIFIED, // e.g. pursuit, or right after a saccade
+	GAZE_FIXATION,
+	GAZE_SACCADE,
+	GAZE_BLINK,
+	GAZE_NB_EVENTS,
+} gaze_event;
+
+/**
+ * Online classifier of the gaze into fixations, saccades and blinks.
+ *
+ * Angular velocities are taken over CLASSIFY_VELOCITY_WINDOW on the screen
+ * geometry of lab_setup, at the measured viewing distance of the sample or
+ * the nominal one, see set_viewing_distance. Velocities above
+ * CLASSIFY_SACCADE_ONSET start a saccade until they fall below
+ * CLASSIFY_SACCADE_END (I-VT). Samples that stay
+ * within CLASSIFY_DISPERSION for CLASSIFY_FIXATION_MIN form a fixation at
+ * their centroid, which lasts until a sample leaves the dispersion (I-DT).
+ * Invalid samples are a blink for up to CLASSIFY_BLINK_MAX.
+ *
+ * The landing point of a saccade is extrapolated: until the velocity peaks
+ * from the velocity through the main sequence, afterwards as twice the
+ * distance covered at the peak, as saccades are about symmetric.
+ *
+ * Used by the encoder thread only.
+ */
+typedef struct gaze_classifier {
+	gaze_event event;
+	int64_t since;           // start of the event
+	gaze_sample last;        // latest valid sample
+	gaze_sample ref;         // start of the current velocity window
+	int valid;               // a valid sample has been classified
+	double velocity;         // of the latest window in deg/s
+	// saccade, positions relative to the frame
+	double start_x, start_y;
+	double peak;             // velocity in deg/s
+	double peak_distance;    // mm covered when the velocity peaked
+	double land_x, land_y;   // extrapolated landing point
+	int64_t end;             // extrapolated end through the main sequence
+	// fixation candidate, the samples since window
+	int64_t window;
+	double min_x, max_x, min_y, max_y; // relative to the frame
+	double sum_x, sum_y;
+	uint32_t count;
+	double fix_x, fix_y;     // centroid, fixed once the fixation starts
+	int64_t frozen_since;    // start of the fixation fd is held for, see gaze_freeze
+	float frozen_fd[4];      // descriptor of the first frozen frame of it
+	// of the run
+	uint64_t events[GAZE_NB_EVENTS];
+	uint64_t frames[GAZE_NB_EVENTS]; // encoded during each event
+	uint64_t frozen;         // frames the policy froze the descriptor in
+	uint64_t suppressed;     // frames the policy lowered the quality of
+} gaze_classifier;
+
+/**
+ * Policy applied to the foveation descriptor of a frame depending on the
+ * event of the latest gaze sample, see set_gaze_policy. Each hook may be NULL,
+ * returns 1 if it changed the descriptor and is called on the encoder thread.
+ * @param fd descriptor filled by foveation_descriptor
+ * @param c classifier, see gaze_classifier
+ * @param display expected presentation time of the frame, see gaze_presented
+ */
+typedef struct gaze_policy {
+	int (*fixation)(float *fd, const gaze_classifier *c, int64_t display);
+	int (*saccade)(float *fd, const gaze_classifier *c, int64_t display);
+	int (*blink)(float *fd, const gaze_classifier *c, int64_t display);
+} gaze_policy;
+
+/* One axis of a constant-velocity Kalman filter, in frame units and seconds */
+typedef struct kalman_axis {
+	double p;       // position
+	double v;       // velocity
+	double P[2][2]; // covariance of p and v
+} kalman_axis;
+
+/**
+ * Predicts where the gaze will be when a frame is presented.
+ *
+ * Every valid sample of the source, see gaze_history, updates a
+ * constant-velocity Kalman filter per axis. The gaze is extrapolated by the
+ * age of the latest sample plus the pipeline latency, from encoding to
+ * presentation. During a saccade, see gaze_classifier, the gaze is placed at
+ * the landing point and sigma is widened by PREDICT_SACCADE_WIDEN. After the
+ * saccade the filter restarts at the landing position.
+ *
+ * Used by the encoder thread only.
+ */
+typedef struct gaze_predictor {
+	kalman_axis x, y;
+	gaze_sample last;   // latest valid sample fed to the filter
+	int valid;          // the filter has been fed since the last reset
+	int64_t settle;     // time sigma is widened until
+	uint64_t frames;    // predicted in the run
+	double horizon_sum; // us
+} gaze_predictor;
+
 /**
  * Setup eye-tracking (or pseudo-foveation)
  *
@@ -64,16 +196,107 @@ typedef struct gaze {
  */
 void setup_ivx(enc_id id);
 
+/**
+ * Set the display frames are presented on, must be called before setup_ivx.
+ * Defaults to the HP Z31x of the lab.
+ * Calls pexit in case of a failure.
+ * @param desc a known display, hpz31x or t470s, or the size of the screen in
+ * mm and its resolution as <width>x<height>@<columns>x<rows>,
+ * e.g. 698x368@4096x2160
+ */
+void set_display(const char *desc);
+
+/**
+ * Set the viewing distance assumed for samples without a measured one, e.g.
+ * from the mouse. Must be called before the encoder starts.
+ * @param mm eye to screen distance, VIEWING_DISTANCE by default
+ */
+void set_viewing_distance(double mm);
+
 
-void set_ivx_window(SDL_Window *w);
+/**
+ * The eye-tracker as a gaze source, see gaze.h.
+ *
+ * The SMI callback publishes every sample, mapped to the frames presented in
+ * the window, see set_gaze_view. The source lives as long as the process and
+ * must not be closed.
+ * @return gaze_source* set up by setup_ivx, NULL without eye-tracker
+ */
+gaze_source *gaze_tracker(void);
+
+/**
+ * Print how old gaze samples were when frames were encoded, and reset the
+ * statistics. Remote samples are mapped to the local clock, see
+ * gaze_clock_map, their ages count from the arrival of the fastest packet.
+ * Must be called while no encoder runs, e.g. between runs.
+ * @param what name of the statistics, e.g. "run 3"
+ */
+void gaze_report(const char *what);
+
+/**
+ * Enable or disable gaze prediction, see gaze_predictor. Enabled by default.
+ * Must be called before the encoder starts.
+ * @param enable 1 to predict the gaze at presentation, 0 to use the latest sample
+ */
+void set_gaze_prediction(int enable);
+
+/**
+ * Set the latency from encoding to presentation the gaze is predicted for.
+ * Without it the latency is measured on presentation, see gaze_presented, or
+ * taken as 0 if frames are presented elsewhere, e.g. by a client.
+ * Must be called before the encoder starts.
+ * @param us latency in microseconds, -1 to measure it
+ */
+void set_gaze_latency(int64_t us);
+
+/**
+ * Set the policy applied to the descriptor depending on the gaze event.
+ * By default gaze_freeze is applied in fixations and gaze_suppress in
+ * saccades and blinks. Must be called before the encoder starts.
+ * @param policy hooks to apply, copied
+ */
+void set_gaze_policy(const gaze_policy *policy);
 
 /**
- * Allocate a foveation descriptor to pass to an encoder as AVSideData
+ * Policy hook that keeps the descriptor at the centroid of a fixation, so
+ * encoders reuse the map of the previous frame instead of computing one for
+ * the jitter of the eye, see av_foveation_map_get. The whole descriptor of
+ * the first frame frozen in a fixation is held until the fixation ends,
+ * including sigma and delta of the rate controller and the viewing distance.
+ */
+int gaze_freeze(float *fd, const gaze_classifier *c, int64_t display);
+
+/**
+ * Policy hook that lowers the quality of the whole frame to the peripheral
+ * offset at the limit of the codec if the frame is presented before the
+ * saccade or blink is expected to end, when the viewer is effectively blind.
+ */
+int gaze_suppress(float *fd, const gaze_classifier *c, int64_t display);
+
+/**
+ * Measure the pipeline latency of a presented frame, safe to call from any
+ * thread. Frames are matched by pts to those passed to foveation_descriptor.
+ * @param pts presentation timestamp of the frame
+ */
+void gaze_presented(int64_t pts);
+
+/**
+ * Fill a foveation descriptor to pass to an encoder as AVSideData
+ *
+ * The stddev spans FOVEA_ANGLE at the viewing distance, measured by the gaze
+ * source and smoothed over frames, so the fovea covers more of the frame as
+ * the viewer leans back.
+ *
+ * The rate controller sets sigma and delta before the policy of the gaze
+ * event is applied, so a frozen descriptor stays unchanged, see gaze_freeze.
  *
+ * @param fd float* 4-tuple to be filled: x and y coordinate, stddev and max quality offset
  * @param frame resolution in x and y direction
- * @return float* 4-tuple: x and y coordinate, stddev and max quality offset
+ * @param pts presentation timestamp of the frame, to measure its latency
+ * @param rate controller of the encoder, NULL if foveation is open-loop
  */
-float *foveation_descriptor(int frame_res_x, int frame_res_y);
+void foveation_descriptor(float *fd, int frame_res_x, int frame_res_y, int64_t pts,
+			  rate_ctl *rate);
 
 
 void set_qp_offset(int q);
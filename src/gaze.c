@@ -0,0 +1,391 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gaze.h"
+#include "io.h"
+#include "pexit.h"
+#include "rng.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+
+static gaze_source *active;
+
+// place of the frames in the window, see set_gaze_view
+static atomic_int view_x, view_y, view_width, view_height;
+static atomic_int frame_width, frame_height; // 0 before the first frame
+
+void gaze_slot_store(gaze_slot *slot, const gaze_sample *s)
+{
+	uint_least64_t words[sizeof(slot->words) / sizeof(slot->words[0])] = {0};
+	unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+	memcpy(words, s, sizeof(gaze_sample));
+	atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+		atomic_store_explicit(&slot->words[i], words[i], memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+int gaze_slot_load(gaze_slot *slot, gaze_sample *s)
+{
+	uint_least64_t words[sizeof(slot->words) / sizeof(slot->words[0])];
+	unsigned seq;
+
+	do {
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (!seq)
+			return 0;
+		for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+			words[i] = atomic_load_explicit(&slot->words[i], memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+	} while (seq & 1 || seq != atomic_load_explicit(&slot->seq, memory_order_relaxed));
+
+	memcpy(s, words, sizeof(gaze_sample));
+	return 1;
+}
+
+gaze_source *gaze_source_alloc(const char *name,
+			       void (*present)(gaze_source *, int64_t),
+			       void (*close)(gaze_source *), void *priv)
+{
+	gaze_source *src;
+
+	src = calloc(1, sizeof(gaze_source));
+	if (!src)
+		pexit("calloc failed");
+	src->name = name;
+	src->present = present;
+	src->close = close;
+	src->priv = priv;
+	return src;
+}
+
+void gaze_publish(gaze_source *src, gaze_sample *s)
+{
+	s->seq = src->seq++;
+	gaze_slot_store(&src->history[s->seq % GAZE_HISTORY], s);
+	gaze_slot_store(&src->slot, s);
+}
+
+void gaze_use(gaze_source *src)
+{
+	active = src;
+}
+
+int gaze_latest(gaze_sample *s)
+{
+	return active && gaze_slot_load(&active->slot, s);
+}
+
+int gaze_history(uint32_t seq, gaze_sample *s)
+{
+	return active && gaze_slot_load(&active->history[seq % GAZE_HISTORY], s) &&
+	       s->seq == seq;
+}
+
+void gaze_close(gaze_source **src)
+{
+	if ((*src)->close)
+		(*src)->close(*src);
+	free(*src);
+	*src = NULL;
+}
+
+void set_gaze_view(SDL_Window *w, int width, int height)
+{
+	int x, y;
+
+	SDL_GetWindowPosition(w, &x, &y);
+	atomic_store(&view_x, x);
+	atomic_store(&view_y, y);
+	SDL_GetWindowSize(w, &x, &y);
+	atomic_store(&view_width, x);
+	atomic_store(&view_height, y);
+	atomic_store(&frame_width, width);
+	atomic_store(&frame_height, height);
+}
+
+/**
+ * Map a position in the window to frame coordinates.
+ * @return 1 on success, 0 if no frame has been presented yet
+ */
+static int window_to_frame(float x, float y, float *fx, float *fy)
+{
+	int width = atomic_load(&frame_width);
+	int height = atomic_load(&frame_height);
+
+	if (width <= 0 || height <= 0)
+		return 0;
+	//shift by border margins to make origin upper left frame corner
+	x -= (atomic_load(&view_width) - width) / 2;
+	y -= (atomic_load(&view_height) - height) / 2;
+	//coordinates are relative in terms of frame width/height
+	*fx = x / width;
+	*fy = y / height;
+	return 1;
+}
+
+int gaze_screen_to_frame(float x, float y, float *fx, float *fy)
+{
+	//screen coordinates have their origin at the upper left screen corner
+	return window_to_frame(x - atomic_load(&view_x), y - atomic_load(&view_y), fx, fy);
+}
+
+void set_gaze_clock(int64_t us)
+{
+	gaze_source *src = active;
+
+	if (src && src->present)
+		src->present(src, us);
+}
+
+static void mouse_present(gaze_source *src, int64_t clock)
+{
+	gaze_sample s = {0};
+	int x, y;
+
+	(void) clock;
+	//mouse coordinates have origin already at upper left window corner
+	SDL_GetMouseState(&x, &y);
+	s.time = av_gettime_relative();
+	if (!window_to_frame(x, y, &s.x, &s.y))
+		return;
+	s.flags = GAZE_VALID;
+	gaze_publish(src, &s);
+}
+
+gaze_source *gaze_mouse_open(void)
+{
+	return gaze_source_alloc("mouse", mouse_present, NULL, NULL);
+}
+
+// recorded gaze, see gaze_trace_open
+typedef struct trace_sample {
+	int64_t time; // microseconds
+	float x;
+	float y;
+} trace_sample;
+
+typedef struct gaze_trace {
+	trace_sample *samples;
+	size_t len;
+} gaze_trace;
+
+static void trace_present(gaze_source *src, int64_t clock)
+{
+	gaze_trace *tr = src->priv;
+	trace_sample *smp = tr->samples;
+	gaze_sample s = {0};
+	size_t i;
+	float a;
+
+	for (i = 0; i < tr->len && smp[i].time <= clock; i++)
+		;
+	if (i == 0) {
+		s.x = smp[0].x;
+		s.y = smp[0].y;
+	} else if (i == tr->len) {
+		s.x = smp[i - 1].x;
+		s.y = smp[i - 1].y;
+	} else {
+		a = (float) (clock - smp[i - 1].time) / (smp[i].time - smp[i - 1].time);
+		s.x = smp[i - 1].x + a * (smp[i].x - smp[i - 1].x);
+		s.y = smp[i - 1].y + a * (smp[i].y - smp[i - 1].y);
+	}
+	s.time = av_gettime_relative();
+	s.flags = GAZE_VALID;
+	gaze_publish(src, &s);
+}
+
+static void trace_close(gaze_source *src)
+{
+	gaze_trace *tr = src->priv;
+
+	free(tr->samples);
+	free(tr);
+}
+
+gaze_source *gaze_trace_open(const char *path)
+{
+	gaze_source *src;
+	gaze_trace *tr;
+	char **lines, **l;
+	trace_sample *smp;
+	double ms;
+	size_t n;
+
+	tr = malloc(sizeof(gaze_trace));
+	if (!tr)
+		pexit("malloc failed");
+
+	lines = parse_lines(path);
+	for (n = 0; lines[n]; n++)
+		;
+	tr->samples = malloc((n + 1) * sizeof(trace_sample));
+	if (!tr->samples)
+		pexit("malloc failed");
+
+	tr->len = 0;
+	for (l = lines; *l; l++) {
+		if (**l == '\0' || **l == '#')
+			continue;
+		smp = &tr->samples[tr->len];
+		if (sscanf(*l, "%lf %f %f", &ms, &smp->x, &smp->y) != 3)
+			pexit("invalid line in gaze script");
+		smp->time = ms * 1000;
+		if (tr->len && smp->time <= tr->samples[tr->len - 1].time)
+			pexit("gaze script times must increase");
+		tr->len++;
+	}
+	free_lines(&lines);
+
+	if (!tr->len)
+		pexit("empty gaze script");
+
+	src = gaze_source_alloc("trace", trace_present, trace_close, tr);
+	// gaze is defined before the first frame is presented
+	trace_present(src, 0);
+	return src;
+}
+
+// synthetic scan path, see gaze_synthetic_open
+typedef struct gaze_synthetic {
+	uint64_t path_rng;  // drawn per fixation, the path only depends on time
+	uint64_t noise_rng; // drawn per sample
+	int64_t start;
+	// fixation at from until fix_end, saccade to to until sac_end
+	int64_t fix_end, sac_end;
+	float from_x, from_y, to_x, to_y;
+	int64_t blink_start, blink_end; // empty if there is no blink
+	atomic_int quit;
+	SDL_Thread *thread;
+} gaze_synthetic;
+
+/**
+ * Start the next fixation at the target of the previous saccade.
+ * @param t start of the fixation in microseconds since the source was opened
+ */
+static void synthetic_next(gaze_synthetic *sy, int64_t t)
+{
+	double amplitude;
+
+	sy->from_x = sy->to_x;
+	sy->from_y = sy->to_y;
+	sy->to_x = 0.1 + 0.8 * rng_uniform(&sy->path_rng);
+	sy->to_y = 0.1 + 0.8 * rng_uniform(&sy->path_rng);
+	sy->fix_end = t + 150000 + 250000 * rng_uniform(&sy->path_rng);
+
+	// main sequence, 21 ms + 2.2 ms per degree, for a 16:9 frame
+	amplitude = GAZE_SYNTHETIC_FIELD * hypot(sy->to_x - sy->from_x,
+						 (sy->to_y - sy->from_y) * 9 / 16);
+	sy->sac_end = sy->fix_end + (21 + 2.2 * amplitude) * 1000;
+
+	// one in ten fixations contains a blink
+	sy->blink_start = sy->blink_end = 0;
+	if (rng_uniform(&sy->path_rng) < 0.1) {
+		sy->blink_start = t + 50000;
+		sy->blink_end = FFMIN(sy->blink_start + 150000, sy->fix_end);
+	}
+}
+
+/**
+ * Sample the scan path.
+ * @param t microseconds since the source was opened
+ */
+static void synthetic_sample(gaze_synthetic *sy, int64_t t, gaze_sample *s)
+{
+	double a, u, v;
+
+	while (t >= sy->sac_end)
+		synthetic_next(sy, sy->sac_end);
+
+	if (t < sy->fix_end) {
+		// fixational jitter, normal with 0.1 % of the frame
+		u = rng_uniform(&sy->noise_rng);
+		v = rng_uniform(&sy->noise_rng);
+		a = 0.001 * sqrt(-2 * log(1 - u));
+		s->x = sy->from_x + a * cos(2 * M_PI * v);
+		s->y = sy->from_y + a * sin(2 * M_PI * v);
+	} else {
+		// minimum jerk profile
+		a = (double) (t - sy->fix_end) / (sy->sac_end - sy->fix_end);
+		a = a * a * a * (10 - 15 * a + 6 * a * a);
+		s->x = sy->from_x + a * (sy->to_x - sy->from_x);
+		s->y = sy->from_y + a * (sy->to_y - sy->from_y);
+	}
+	s->flags = t >= sy->blink_start && t < sy->blink_end ? 0 : GAZE_VALID;
+}
+
+static int synthetic_thread(void *ptr)
+{
+	gaze_source *src = ptr;
+	gaze_synthetic *sy = src->priv;
+	gaze_sample s = {0};
+	int64_t next = sy->start;
+	int64_t now;
+
+	while (!sy->quit) {
+		now = av_gettime_relative();
+		if (next > now)
+			av_usleep(next - now);
+		s.time = av_gettime_relative();
+		synthetic_sample(sy, s.time - sy->start, &s);
+		gaze_publish(src, &s);
+		next += GAZE_SYNTHETIC_INTERVAL;
+		// do not catch up after a stall, like a tracker dropping samples
+		if (next < s.time)
+			next = s.time + GAZE_SYNTHETIC_INTERVAL;
+	}
+	return 0;
+}
+
+static void synthetic_close(gaze_source *src)
+{
+	gaze_synthetic *sy = src->priv;
+
+	sy->quit = 1;
+	SDL_WaitThread(sy->thread, NULL);
+	free(sy);
+}
+
+gaze_source *gaze_synthetic_open(uint64_t seed)
+{
+	gaze_source *src;
+	gaze_synthetic *sy;
+
+	sy = malloc(sizeof(gaze_synthetic));
+	if (!sy)
+		pexit("malloc failed");
+
+	sy->path_rng = seed;
+	sy->noise_rng = ~seed;
+	sy->to_x = 0.5;
+	sy->to_y = 0.5;
+	synthetic_next(sy, 0);
+	sy->start = av_gettime_relative();
+	sy->quit = 0;
+
+	src = gaze_source_alloc("synthetic", NULL, synthetic_close, sy);
+	sy->thread = SDL_CreateThread(synthetic_thread, "gaze_synthetic", src);
+	if (!sy->thread)
+		pexit(SDL_GetError());
+	return src;
+}
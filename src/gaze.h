@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+#include <SDL2/SDL.h>
+
+// flags of a gaze_sample
+#define GAZE_VALID 1          // x and y hold a tracked gaze position
+#define GAZE_DISTANCE_VALID 2 // distance holds a measured viewing distance
+
+// samples kept by a source for readers that need all of them, power of 2
+#define GAZE_HISTORY 64
+
+// interval between samples of the synthetic source in microseconds, 500 Hz
+#define GAZE_SYNTHETIC_INTERVAL 2000
+
+// horizontal field of view of the frame assumed by the synthetic source, in degrees
+#define GAZE_SYNTHETIC_FIELD 40
+
+/* One gaze measurement, e.g. sent from a client to the encoder, see net.h */
+typedef struct gaze_sample {
+	uint32_t seq;   // incremented with every sample of a source
+	uint32_t flags;
+	int64_t time;   // capture time, av_gettime_relative() in microseconds, see gaze_clock_map
+	float x;        // relative to the frame width
+	float y;        // relative to the frame height
+	float distance; // eye to screen in mm
+} gaze_sample;
+
+/*
+ * Latest gaze sample of a single writer, read by other threads without locks
+ * (seqlock). The sample is kept in atomic words, so readers racing with the
+ * writer never see a torn sample.
+ */
+typedef struct gaze_slot {
+	atomic_uint seq; // odd while a sample is written, 0 before the first
+	atomic_uint_least64_t words[(sizeof(gaze_sample) + 7) / 8];
+} gaze_slot;
+
+/**
+ * A source of gaze samples: the mouse, a replayed trace, an eye-tracker,
+ * a client on the network or a synthetic scan path.
+ *
+ * Each source publishes its samples from a single thread of its own, see
+ * gaze_publish, and any thread reads the latest sample without blocking.
+ * Sources that are sampled on presentation, like the mouse, publish from
+ * the display thread, see set_gaze_clock. No other thread touches SDL.
+ */
+typedef struct gaze_source {
+	const char *name;
+	gaze_slot slot;
+	gaze_slot history[GAZE_HISTORY]; // by seq modulo GAZE_HISTORY
+	uint32_t seq; // of the next sample, publishing thread only
+	// publish a sample presented at a clock, on the display thread, may be NULL
+	void (*present)(struct gaze_source *src, int64_t clock);
+	// stop the threads of the source and free priv, may be NULL
+	void (*close)(struct gaze_source *src);
+	void *priv;
+} gaze_source;
+
+/**
+ * Store a sample in a slot, only one thread may store to a slot.
+ * @param slot slot initialized to zero
+ * @param s sample to store
+ */
+void gaze_slot_store(gaze_slot *slot, const gaze_sample *s);
+
+/**
+ * Read the latest sample of a slot, safe to call from any thread.
+ * @param slot slot to read
+ * @param s set to the latest sample
+ * @return 1 on success, 0 if no sample has been stored yet
+ */
+int gaze_slot_load(gaze_slot *slot, gaze_sample *s);
+
+/**
+ * Allocate a source with the given hooks.
+ * Calls pexit in case of a failure.
+ * @return gaze_source* to a heap-allocated instance, see gaze_close.
+ */
+gaze_source *gaze_source_alloc(const char *name,
+			       void (*present)(gaze_source *, int64_t),
+			       void (*close)(gaze_source *), void *priv);
+
+/**
+ * Publish a sample of a source, numbered in order.
+ * Must only be called from the publishing thread of the source.
+ * @param src source the sample belongs to
+ * @param s sample, its seq is set
+ */
+void gaze_publish(gaze_source *src, gaze_sample *s);
+
+/**
+ * Make a source the one the encoder and the gaze sender read, see gaze_latest.
+ * Must be called before they start.
+ * @param src source to use, NULL for none
+ */
+void gaze_use(gaze_source *src);
+
+/**
+ * Read the latest sample of the source in use, safe to call from any thread.
+ * @param s set to the latest sample
+ * @return 1 on success, 0 if there is no source or no sample yet
+ */
+int gaze_latest(gaze_sample *s);
+
+/**
+ * Read a recent sample of the source in use, e.g. to process every sample
+ * published since the last call. Safe to call from any thread.
+ * @param seq sequence number of the sample, see gaze_latest
+ * @param s set to the sample
+ * @return 1 on success, 0 if there is no such sample or it has been
+ * overwritten, as only the latest GAZE_HISTORY samples are kept
+ */
+int gaze_history(uint32_t seq, gaze_sample *s);
+
+/**
+ * Stop a source, free it and set src to NULL.
+ * @param src source to close
+ */
+void gaze_close(gaze_source **src);
+
+/**
+ * Update the place of frames in the window, to map screen and window
+ * coordinates to frame coordinates. Call on the display thread for every
+ * presented frame. Frames are centered in the window without scaling.
+ * @param w window frames are presented in
+ * @param frame_width frame width
+ * @param frame_height frame height
+ */
+void set_gaze_view(SDL_Window *w, int frame_width, int frame_height);
+
+/**
+ * Map a position on the screen to frame coordinates, see set_gaze_view.
+ * Safe to call from any thread.
+ * @param x horizontal screen position in pixels
+ * @param y vertical screen position in pixels
+ * @param fx set to x relative to the frame width
+ * @param fy set to y relative to the frame height
+ * @return 1 on success, 0 if no frame has been presented yet
+ */
+int gaze_screen_to_frame(float x, float y, float *fx, float *fy);
+
+/**
+ * Advance the presentation clock and let the source in use publish a sample
+ * if it is sampled on presentation. Call on the display thread.
+ * @param us presentation time in microseconds since the start of the run
+ */
+void set_gaze_clock(int64_t us);
+
+/**
+ * Open the mouse as a source, sampled on presentation.
+ * @return gaze_source* to pass to gaze_use and gaze_close.
+ */
+gaze_source *gaze_mouse_open(void);
+
+/**
+ * Open a gaze script as a source replaying a recorded trace.
+ *
+ * Each line of the script holds a time in milliseconds and x and y relative
+ * to the frame width and height, e.g. "500 0.25 0.5". Times must increase,
+ * empty lines and lines starting with # are skipped. The gaze is interpolated
+ * linearly at the presentation clock, see set_gaze_clock, and held beyond
+ * the last sample. Calls pexit in case of a failure.
+ * @param path script to load
+ * @return gaze_source* to pass to gaze_use and gaze_close.
+ */
+gaze_source *gaze_trace_open(const char *path);
+
+/**
+ * Open a synthetic scan path as a source, a stand-in for an eye-tracker.
+ *
+ * A thread publishes a sample every GAZE_SYNTHETIC_INTERVAL. Fixations of
+ * random duration and position alternate with saccades following the main
+ * sequence, with occasional blinks, which are invalid samples. The path is
+ * a function of the seed and the time since the source was opened.
+ * Calls pexit in case of a failure.
+ * @param seed seed of the random generator
+ * @return gaze_source* to pass to gaze_use and gaze_close.
+ */
+gaze_source *gaze_synthetic_open(uint64_t seed);
@@ -17,6 +17,8 @@
 
 #include "io.h"
 #include "pexit.h"
+#include "pipeline.h"
+#include "trace.h"
 #include <libavutil/time.h>
 #include <limits.h> /* PATH_MAX */
 
@@ -69,45 +71,120 @@ void free_lines(char ***lines)
 	*lines = NULL;
 }
 
+void unref_packet(void *item)
+{
+	av_packet_unref(item);
+}
+
+void free_packet(void *item)
+{
+	AVPacket *pkt = item;
+
+	av_packet_free(&pkt);
+}
+
+void pacer_init(src_pacer *p, int enabled, AVRational time_base)
+{
+	p->enabled = enabled;
+	p->time_base = time_base;
+	pacer_restart(p);
+}
+
+void pacer_restart(src_pacer *p)
+{
+	p->time_start = -1;
+}
+
+void pacer_wait(src_pacer *p, int64_t ts)
+{
+	int64_t due, now;
+
+	if (!p->enabled || ts == AV_NOPTS_VALUE)
+		return;
+
+	now = av_gettime_relative();
+	if (p->time_start == -1) {
+		p->time_start = now;
+		p->ts_start = ts;
+		return;
+	}
+	due = p->time_start + av_rescale_q(ts - p->ts_start, p->time_base, AV_TIME_BASE_Q);
+	if (due > now)
+		av_usleep(due - now);
+}
+
+/**
+ * Seek back to the first packet of the video stream.
+ * Calls pexit in case of a failure.
+ */
+static void rewind_reader(rdr_ctx *rc)
+{
+	AVStream *stream = rc->fctx->streams[rc->stream_index];
+	int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+	if (av_seek_frame(rc->fctx, rc->stream_index, start, AVSEEK_FLAG_BACKWARD) < 0)
+		pexit("av_seek_frame failed");
+}
+
 int reader_thread(void *ptr)
 {
 	rdr_ctx *rc = (rdr_ctx *) ptr;
 	int ret;
 
-	AVPacket *pkt;
+	AVPacket *pkt = NULL;
 
 	while (1) {
-		if (rc->abort) {
-			avformat_close_input(&rc->fctx);
-			queue_append(rc->packets, NULL);
-			return 0;
-		}
-
-		pkt = malloc(sizeof(AVPacket));
 		if (!pkt)
-			pexit("malloc failed");
+			pkt = queue_reuse(rc->packets);
+		if (!pkt)
+			pkt = av_packet_alloc();
+		if (!pkt)
+			pexit("av_packet_alloc failed");
 
-		ret = av_read_frame(rc->fctx, pkt);
-		if (ret == AVERROR_EOF)
-			break;
-		else if (ret < 0)
+		ret = rc->abort ? AVERROR_EOF : av_read_frame(rc->fctx, pkt);
+		if (ret == AVERROR_EOF || ret == AVERROR_EXIT) {
+			/* enqueue NULL to enter draining mode, then wait for the next run */
+			queue_append(rc->packets, NULL);
+			if (!rc->pl || pipeline_wait(rc->pl))
+				break;
+			rewind_reader(rc);
+			pacer_restart(&rc->pacer);
+			continue;
+		} else if (ret < 0) {
 			pexit("av_read_frame failed");
+		}
+		rc->last_read = av_gettime_relative();
 
-		/* discard invalid buffers and non-video packages */
+		/* discard invalid buffers and non-video packages, keep the packet */
 		if (pkt->buf == NULL || pkt->stream_index != rc->stream_index) {
-			av_packet_free(&pkt);
+			av_packet_unref(pkt);
 			continue;
 		}
+		// packets are due in decoding order
+		pacer_wait(&rc->pacer, pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts);
+		trace_record(TRACE_READ, pkt->pts);
 		queue_append(rc->packets, pkt);
+		pkt = NULL;
 	}
-	/* finally enqueue NULL to enter draining mode */
-	queue_append(rc->packets, NULL);
+	av_packet_free(&pkt);
 	avformat_close_input(&rc->fctx);
 	reader_free(&rc);
 	return 0;
 }
 
-rdr_ctx *reader_init(char *filename, int queue_capacity)
+/**
+ * Interrupt callback of the reader's demuxer, called by the reader thread.
+ * @return 1 to interrupt a blocking read on abort or timeout, 0 to continue
+ */
+static int interrupt_reader(void *opaque)
+{
+	rdr_ctx *rc = opaque;
+
+	return rc->abort || (rc->timeout && rc->last_read != -1 &&
+			     av_gettime_relative() - rc->last_read > rc->timeout);
+}
+
+rdr_ctx *reader_init(char *filename, int queue_capacity, AVDictionary **options)
 {
 	rdr_ctx *rc;
 	int ret;
@@ -116,12 +193,21 @@ rdr_ctx *reader_init(char *filename, int queue_capacity)
 	Queue *packets;
 	char *fn_cpy;
 
+	rc = malloc(sizeof(rdr_ctx));
+	if (!rc)
+		pexit("malloc failed");
+	rc->abort = 0;
+	rc->timeout = 0;
+	rc->last_read = -1;
+
 	// preparations: allocate, open and set required datastructures
 	fctx = avformat_alloc_context();
 	if (!fctx)
 		pexit("avformat_alloc_context failed");
+	fctx->interrupt_callback.callback = interrupt_reader;
+	fctx->interrupt_callback.opaque = rc;
 
-	ret = avformat_open_input(&fctx, filename, NULL, NULL);
+	ret = avformat_open_input(&fctx, filename, NULL, options);
 	if (ret < 0)
 		pexit("avformat_open_input failed");
 
@@ -131,12 +217,9 @@ rdr_ctx *reader_init(char *filename, int queue_capacity)
 
 	fctx->streams[stream_index]->discard = AVDISCARD_DEFAULT;
 	packets = queue_init(queue_capacity);
+	queue_set_recycling(packets, unref_packet, free_packet);
 
-	// allocate and set the context
-	rc = malloc(sizeof(rdr_ctx));
-	if (!rc)
-		pexit("malloc failed");
-
+	// set the context
 	fn_cpy = malloc(strlen(filename));
 	if (!fn_cpy)
 		pexit("malloc failed");
@@ -146,7 +229,8 @@ rdr_ctx *reader_init(char *filename, int queue_capacity)
 	rc->stream_index = stream_index;
 	rc->filename = fn_cpy;
 	rc->packets = packets;
-	rc->abort = 0;
+	rc->pl = NULL;
+	pacer_init(&rc->pacer, 0, fctx->streams[stream_index]->time_base);
 
 	return rc;
 }
@@ -162,7 +246,7 @@ void reader_free(rdr_ctx **rc)
 	*rc = NULL;
 }
 
-wtr_ctx *writer_init(char *path, Queue *packets, rdr_ctx *rc, AVCodecContext *enc_ctx)
+wtr_ctx *writer_init(char *path, Queue *packets, AVRational time_base, AVCodecContext *enc_ctx)
 {
 	wtr_ctx *w;
 	AVFormatContext *ctx;
@@ -179,7 +263,7 @@ wtr_ctx *writer_init(char *path, Queue *packets, rdr_ctx *rc, AVCodecContext *en
 	if (!stream)
 		pexit("output stream allocation failed");
 
-	stream->time_base = rc->fctx->streams[rc->stream_index]->time_base;
+	stream->time_base = time_base;
 
 	ret = avcodec_parameters_from_context(stream->codecpar, enc_ctx);
 	if (ret < 0)
@@ -221,6 +305,7 @@ int writer_thread(void *ptr)
 		ret = av_interleaved_write_frame(w->fctx, pkt);
 		if (ret < 0)
 			pexit("av_interleaved_write_frame failed");
+		queue_recycle(w->packets, pkt);
 
 	}
 	av_write_trailer(w->fctx);
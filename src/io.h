@@ -18,15 +18,32 @@
 #pragma once
 
 #include "queue.h"
+#include <stdatomic.h>
 #include <libavformat/avformat.h>
 
+/**
+ * Releases the frames of a file at their timestamps, as a live source would.
+ * A realtime display would otherwise receive frames faster than it presents
+ * them and skip all but the latest.
+ */
+typedef struct src_pacer {
+	int enabled;
+	AVRational time_base;
+	int64_t time_start; // wall clock of ts_start, -1 before the first frame of a run
+	int64_t ts_start;   // timestamp of the first frame of the run
+} src_pacer;
+
 // Passed to reader_thread through SDL_CreateThread
 typedef struct rdr_ctx {
 	char *filename;
 	int stream_index;
 	Queue *packets;
 	AVFormatContext *fctx;
-	int abort;
+	atomic_int abort; // set by other threads to stop reading
+	struct pipeline *pl; // NULL if the thread exits after a single run
+	int64_t timeout; // microseconds without packets that end the stream, 0 for none
+	int64_t last_read; // time of the last packet read, -1 before the first
+	src_pacer pacer; // disabled unless set by the owner before the thread starts
 } rdr_ctx;
 
 // Passed to writer_thread through SDL_CreateThread
@@ -56,13 +73,52 @@ char **parse_lines(const char *pathname);
 void free_lines(char ***lines);
 
 
+/**
+ * Initialize a pacer, the first run starts with the first frame.
+ * @param p pacer to initialize
+ * @param enabled 0 to release every frame right away
+ * @param time_base time base of the timestamps passed to pacer_wait
+ */
+void pacer_init(src_pacer *p, int enabled, AVRational time_base);
+
+/**
+ * Start a new run, its first frame is released right away.
+ * @param p pacer to restart
+ */
+void pacer_restart(src_pacer *p);
+
+/**
+ * Wait until a frame is due relative to the first frame of the run.
+ *
+ * Frames that are late are released right away, the source does not catch
+ * up by skipping them.
+ * @param p pacer of the source
+ * @param ts timestamp of the frame, AV_NOPTS_VALUE releases it right away
+ */
+void pacer_wait(src_pacer *p, int64_t ts);
+
+/**
+ * Reset a recycled AVPacket, see queue_set_recycling.
+ * @param item will be cast to (AVPacket *)
+ */
+void unref_packet(void *item);
+
+/**
+ * Free an AVPacket, see queue_set_recycling.
+ * @param item will be cast to (AVPacket *)
+ */
+void free_packet(void *item);
+
 /**
  * Read a video file and put the contained AVPackets in a queue.
  *
  * Call av_read_frame repeatedly. Filter the returned packets by their stream
  * index, discarding everything but video packets (e.g. audio or subtitles).
- * Enqueue video packets in reader_ctx->packets.
- * Upon EOF, enqueue a NULL pointer.
+ * Enqueue video packets in reader_ctx->packets, packets recycled by the
+ * consumer are reused, released at their timestamps if reader_ctx->pacer is
+ * enabled. Upon EOF, abort or timeout, enqueue a NULL pointer.
+ * Aborting also interrupts a blocking read, e.g. from the network. If the reader
+ * belongs to a pipeline, wait for a restart and read again from the beginning.
  *
  * This function is to be used through SDL_CreateThread.
  * The resulting thread will block if the packets queue runs full.
@@ -80,9 +136,11 @@ int reader_thread(void *ptr);
  *
  * Calls pexit in case of a failure.
  * @param filename the file the reader thread will try to open
+ * @param queue_capacity output buffer size.
+ * @param options passed to avformat_open_input, may be NULL
  * @return reader_context* to a heap-allocated instance.
  */
-rdr_ctx *reader_init(char *filename, int queue_capacity);
+rdr_ctx *reader_init(char *filename, int queue_capacity, AVDictionary **options);
 
 /**
  * Free the reader_context and all private resources.
@@ -95,8 +153,9 @@ void reader_free(rdr_ctx **rc);
 
 /**
  * Create and initialize a writer context
+ * @param time_base time base of the packets, usually that of the source
  */
-wtr_ctx *writer_init(char *filename, Queue *packets, rdr_ctx *rc, AVCodecContext *enc_ctx);
+wtr_ctx *writer_init(char *filename, Queue *packets, AVRational time_base, AVCodecContext *enc_ctx);
 
 /**
  * Accept packets from a queue and write them to multiplexed container
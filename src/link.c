@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "link.h"
+#include "io.h"
+#include "pexit.h"
+#include "pipeline.h"
+#include "rng.h"
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/common.h>
+#include <libavutil/dict.h>
+#include <libavutil/time.h>
+
+// a packet on the link, see link_ctx
+typedef struct link_item {
+	AVPacket *pkt;
+	int64_t sent;    // entered the link
+	int64_t arrival; // scheduled delivery
+} link_item;
+
+/**
+ * Read a number from a link description.
+ * @return 1 if the key is present, 0 otherwise
+ */
+static int link_value(AVDictionary *d, const char *key, double min, double max, double *value)
+{
+	AVDictionaryEntry *e;
+	char *end;
+
+	e = av_dict_get(d, key, NULL, 0);
+	if (!e)
+		return 0;
+	*value = strtod(e->value, &end);
+	if (end == e->value || *end || *value < min || *value > max) {
+		fprintf(stderr, "link: %s=%s\n", key, e->value);
+		pexit("link parameter out of range");
+	}
+	return 1;
+}
+
+void link_parse(link_params *lp, const char *desc)
+{
+	static const char *const keys[] = {"delay", "jitter", "dist", "rate", "burst",
+		"queue", "loss", "recover", "loss_good", "loss_bad", "seed", NULL};
+	AVDictionary *d = NULL;
+	AVDictionaryEntry *e = NULL;
+	double seed = 0;
+	int i;
+
+	if (av_dict_parse_string(&d, desc, "=", ",", 0) < 0)
+		pexit("link description is not a list of key=value pairs");
+	while ((e = av_dict_get(d, "", e, AV_DICT_IGNORE_SUFFIX))) {
+		for (i = 0; keys[i] && strcmp(keys[i], e->key); i++)
+			;
+		if (!keys[i]) {
+			fprintf(stderr, "link: %s\n", e->key);
+			pexit("unknown link parameter");
+		}
+	}
+
+	memset(lp, 0, sizeof(link_params));
+	lp->loss_bad = 100;
+	link_value(d, "delay", 0, 1e6, &lp->delay);
+	link_value(d, "jitter", 0, 1e6, &lp->jitter);
+	link_value(d, "rate", 0, 1e9, &lp->rate);
+	link_value(d, "burst", 0, 1e9, &lp->burst);
+	link_value(d, "queue", 0, 1e6, &lp->queue);
+	link_value(d, "loss", 0, 100, &lp->loss);
+	if (!link_value(d, "recover", 0, 100, &lp->recover))
+		lp->recover = 100 - lp->loss;
+	link_value(d, "loss_good", 0, 100, &lp->loss_good);
+	link_value(d, "loss_bad", 0, 100, &lp->loss_bad);
+	link_value(d, "seed", 0, UINT32_MAX, &seed);
+	lp->seed = seed;
+
+	e = av_dict_get(d, "dist", NULL, 0);
+	if (!e || !strcmp(e->value, "normal"))
+		lp->dist = LINK_JITTER_NORMAL;
+	else if (!strcmp(e->value, "uniform"))
+		lp->dist = LINK_JITTER_UNIFORM;
+	else
+		pexit("link dist must be normal or uniform");
+	av_dict_free(&d);
+}
+
+static void unref_item(void *item)
+{
+	av_packet_unref(((link_item *) item)->pkt);
+}
+
+static void free_item(void *item)
+{
+	link_item *li = item;
+
+	av_packet_free(&li->pkt);
+	free(li);
+}
+
+link_ctx *link_init(Queue *in, const link_params *lp)
+{
+	link_ctx *l;
+
+	l = malloc(sizeof(link_ctx));
+	if (!l)
+		pexit("malloc failed");
+
+	l->in = in;
+	l->line = queue_init(LINK_CAPACITY);
+	queue_set_recycling(l->line, unref_item, free_item);
+	// the consumer recycles packets like those of the input
+	l->out = queue_init(1);
+	queue_set_recycling(l->out, unref_packet, free_packet);
+	l->params = *lp;
+
+	l->rng = lp->seed;
+	l->bad = 0;
+	l->tokens = lp->burst;
+	l->bucket_time = -1;
+	l->last_arrival = INT64_MIN;
+	l->time_start = av_gettime_relative();
+	l->run = 0;
+	memset(&l->stats, 0, sizeof(l->stats));
+	l->pl = NULL;
+
+	l->log = NULL;
+	if (lp->log_path) {
+		l->log = fopen(lp->log_path, "w");
+		if (!l->log)
+			pexit("fopen failed");
+		fprintf(l->log, "run pts size sent_us arrival_us\n");
+	}
+	return l;
+}
+
+/**
+ * Step the Gilbert-Elliott model by one packet.
+ * @return 1 if the packet is lost, 0 otherwise
+ */
+static int link_lose(link_ctx *l)
+{
+	const link_params *lp = &l->params;
+	double u = rng_uniform(&l->rng);
+	double v = rng_uniform(&l->rng);
+
+	if (l->bad)
+		l->bad = u >= lp->recover / 100;
+	else
+		l->bad = u < lp->loss / 100;
+	return v < (l->bad ? lp->loss_bad : lp->loss_good) / 100;
+}
+
+/**
+ * Random deviation of the delay in microseconds.
+ */
+static int64_t link_jitter_us(link_ctx *l)
+{
+	const link_params *lp = &l->params;
+	double u = rng_uniform(&l->rng);
+	double v = rng_uniform(&l->rng);
+
+	if (lp->dist == LINK_JITTER_UNIFORM)
+		return lrint((2 * u - 1) * lp->jitter * 1000);
+	// Box-Muller, 1 - u is in (0, 1]
+	return lrint(sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v) * lp->jitter * 1000);
+}
+
+/**
+ * Time a packet has left the token bucket, or -1 if it waits longer than
+ * the queue limit and is dropped.
+ */
+static int64_t link_depart(link_ctx *l, int size, int64_t now)
+{
+	const link_params *lp = &l->params;
+	double rate = lp->rate * 1000 / 8 / 1e6; // bytes per microsecond
+	double tokens;
+	int64_t wait;
+
+	if (lp->rate <= 0)
+		return now;
+	if (l->bucket_time < 0)
+		l->bucket_time = now;
+
+	// tokens are negative while earlier packets are still waiting
+	tokens = FFMIN(lp->burst, l->tokens + (now - l->bucket_time) * rate);
+	wait = tokens >= size ? 0 : llrint((size - tokens) / rate);
+	if (lp->queue > 0 && wait > lp->queue * 1000)
+		return -1;
+	l->tokens = tokens - size;
+	l->bucket_time = now;
+	return now + wait;
+}
+
+int link_send_thread(void *ptr)
+{
+	link_ctx *l = (link_ctx *) ptr;
+	link_item *li;
+	AVPacket *pkt;
+	int64_t now, depart, arrival;
+	int64_t jitter;
+	int lost;
+
+	for (;;) {
+		pkt = queue_extract(l->in);
+		if (!pkt) {
+			queue_append(l->line, NULL);
+			if (!l->pl || pipeline_wait(l->pl))
+				break;
+			l->run++;
+			continue;
+		}
+
+		now = av_gettime_relative();
+		// always draw the same numbers, so the sequence does not depend on timing
+		lost = link_lose(l);
+		jitter = link_jitter_us(l);
+		depart = lost ? -1 : link_depart(l, pkt->size, now);
+		l->stats.packets++;
+		if (lost || depart < 0) {
+			if (lost)
+				l->stats.lost++;
+			else
+				l->stats.dropped++;
+			if (l->log)
+				fprintf(l->log, "%d %"PRId64" %d %"PRId64" %s\n", l->run, pkt->pts,
+					pkt->size, now - l->time_start, lost ? "lost" : "dropped");
+			queue_recycle(l->in, pkt);
+			continue;
+		}
+
+		arrival = FFMAX(depart + llrint(l->params.delay * 1000) + jitter, depart);
+		// no reordering, decoders expect packets in order
+		arrival = FFMAX(arrival, l->last_arrival);
+		l->last_arrival = arrival;
+		if (l->log)
+			fprintf(l->log, "%d %"PRId64" %d %"PRId64" %"PRId64"\n", l->run, pkt->pts,
+				pkt->size, now - l->time_start, arrival - l->time_start);
+
+		li = queue_reuse(l->line);
+		if (!li) {
+			li = malloc(sizeof(link_item));
+			if (!li)
+				pexit("malloc failed");
+			li->pkt = av_packet_alloc();
+			if (!li->pkt)
+				pexit("av_packet_alloc failed");
+		}
+		av_packet_move_ref(li->pkt, pkt);
+		li->sent = now;
+		li->arrival = arrival;
+		queue_recycle(l->in, pkt);
+		queue_append(l->line, li);
+	}
+
+	queue_free(&l->in);
+	return 0;
+}
+
+/**
+ * Print and reset the statistics of a run.
+ */
+static void link_report(link_ctx *l)
+{
+	link_stats *s = &l->stats;
+	uint64_t delivered = s->packets - s->lost - s->dropped;
+
+	fprintf(stderr, "link: %"PRIu64" packets, %"PRIu64" lost, %"PRIu64" dropped, "
+		"delay mean %.2f ms, max %.2f ms, delivered up to %.2f ms late, %.0f kbit\n",
+		s->packets, s->lost, s->dropped,
+		delivered ? s->delay_sum / delivered / 1000 : 0.0, s->delay_max / 1000.0,
+		s->late_max / 1000.0, s->bytes * 8 / 1000.0);
+	memset(s, 0, sizeof(link_stats));
+}
+
+int link_deliver_thread(void *ptr)
+{
+	link_ctx *l = (link_ctx *) ptr;
+	link_item *li;
+	AVPacket *pkt;
+	int64_t now;
+
+	for (;;) {
+		li = queue_extract(l->line);
+		if (!li) {
+			link_report(l);
+			queue_append(l->out, NULL);
+			if (!l->pl || pipeline_wait(l->pl))
+				break;
+			continue;
+		}
+
+		now = av_gettime_relative();
+		if (li->arrival > now)
+			av_usleep(li->arrival - now);
+		now = av_gettime_relative();
+
+		pkt = queue_reuse(l->out);
+		if (!pkt)
+			pkt = av_packet_alloc();
+		if (!pkt)
+			pexit("av_packet_alloc failed");
+		av_packet_move_ref(pkt, li->pkt);
+		l->stats.bytes += pkt->size;
+		l->stats.delay_sum += li->arrival - li->sent;
+		l->stats.delay_max = FFMAX(l->stats.delay_max, li->arrival - li->sent);
+		l->stats.late_max = FFMAX(l->stats.late_max, now - li->arrival);
+		queue_recycle(l->line, li);
+		queue_append(l->out, pkt);
+	}
+
+	queue_free(&l->line);
+	return 0;
+}
+
+void link_free(link_ctx **l)
+{
+	if ((*l)->log)
+		fclose((*l)->log);
+	free(*l);
+	*l = NULL;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "queue.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// packets in flight on an emulated link, the sender blocks beyond
+#define LINK_CAPACITY 1024
+
+typedef enum {
+	LINK_JITTER_NORMAL,  // jitter is the standard deviation
+	LINK_JITTER_UNIFORM, // jitter is the largest deviation
+} link_jitter;
+
+/**
+ * Properties of an emulated link, see link_parse.
+ */
+typedef struct link_params {
+	double delay;      // one-way delay in ms
+	double jitter;     // deviation of the delay in ms, see link_jitter
+	link_jitter dist;
+	double rate;       // bandwidth in kbit/s, 0 for no limit
+	double burst;      // token bucket depth in bytes, sent at once after an idle time
+	double queue;      // longest wait for the bandwidth in ms before a packet is dropped, 0 for no limit
+	double loss;       // Gilbert-Elliott: probability to enter the bad state in %
+	double recover;    // probability to leave the bad state in %
+	double loss_good;  // loss rate in the good state in %
+	double loss_bad;   // loss rate in the bad state in %
+	uint64_t seed;
+	const char *log_path; // file to log every packet to, may be NULL
+} link_params;
+
+typedef struct link_stats {
+	uint64_t packets;
+	uint64_t lost;    // by the loss model
+	uint64_t dropped; // by the bandwidth queue limit
+	uint64_t bytes;   // delivered
+	double delay_sum; // of delivered packets in microseconds
+	int64_t delay_max;
+	int64_t late_max; // delivered after the scheduled arrival, in microseconds
+} link_stats;
+
+/**
+ * Emulated network link on a packet queue.
+ *
+ * The send thread takes packets from the input, decides whether they are
+ * lost and schedules their arrival: a token bucket delays packets exceeding
+ * the bandwidth, then the one-way delay and a random jitter are added.
+ * Packets are kept in order, a packet never arrives before its predecessor.
+ * The deliver thread passes every packet on to the output once it arrives.
+ *
+ * Loss and jitter are drawn from a random generator seeded with seed, the
+ * same number of draws for every packet, so they are reproducible for a
+ * given sequence of packets. Bandwidth and queue limit depend on the time
+ * packets enter the link.
+ */
+typedef struct link_ctx {
+	Queue *in;   // freed by the send thread
+	Queue *line; // packets in flight, freed by the deliver thread
+	Queue *out;  // freed by the consumer
+	link_params params;
+
+	// send thread
+	uint64_t rng;
+	int bad;           // Gilbert-Elliott state
+	double tokens;     // bytes in the bucket at bucket_time, negative while packets wait
+	int64_t bucket_time;
+	int64_t last_arrival;
+	int64_t time_start;
+	int run;
+	FILE *log;
+
+	link_stats stats; // of the current run, passed on with the terminating NULL
+	struct pipeline *pl; // NULL if the threads exit after a single run
+} link_ctx;
+
+/**
+ * Parse the description of a link.
+ *
+ * The description is a comma separated list of key=value pairs, e.g.
+ * "delay=50,jitter=5,rate=4000,loss=1". Keys are the fields of link_params,
+ * dist is normal or uniform. Unset fields are zero, except for recover,
+ * which defaults to independent losses, and loss_bad, which defaults to 100.
+ * Calls pexit for invalid descriptions.
+ * @param lp parameters to set
+ * @param desc description to parse
+ */
+void link_parse(link_params *lp, const char *desc);
+
+/**
+ * Create a link emulating the network between a packet queue and its consumer.
+ *
+ * The consumer has to extract from the out queue of the link instead.
+ * Calls pexit in case of a failure.
+ * @param in queue of AVPackets, the send thread becomes its consumer
+ * @param lp properties of the link
+ * @return link_ctx* to a heap-allocated instance, see link_free.
+ */
+link_ctx *link_init(Queue *in, const link_params *lp);
+
+/**
+ * Take packets from the input and schedule them on the link.
+ *
+ * This function is to be used through SDL_CreateThread.
+ * @param ptr will be cast to (link_ctx *)
+ * @return int 0 on success.
+ */
+int link_send_thread(void *ptr);
+
+/**
+ * Pass packets on to the output when they arrive, print the statistics of
+ * every run.
+ *
+ * This function is to be used through SDL_CreateThread.
+ * @param ptr will be cast to (link_ctx *)
+ * @return int 0 on success.
+ */
+int link_deliver_thread(void *ptr);
+
+/**
+ * Free a link after both of its threads have exited and set l to NULL.
+ * @param l link to free
+ */
+void link_free(link_ctx **l);
@@ -18,6 +18,9 @@
 #include "io.h"
 #include "codec.h"
 #include "pexit.h"
+#include "pipeline.h"
+#include "sink.h"
+#include "trace.h"
 #include "window.h"
 
 #include <inttypes.h>
@@ -35,57 +38,129 @@
 #include "iViewXAPI.h"
 #endif
 
-rdr_ctx *rc;
-dec_ctx *src_dc, *fov_dc;
-enc_ctx *ec;
-win_ctx *wc;
+pipeline *pl;
+win_ctx *wc; // NULL in headless runs
+sink_ctx *sc; // NULL unless headless
 
 void display_usage(int argc, char *progname)
 {
-	if (argc != 2) {
-		printf("usage:\n$ %s videofile \n", progname);
+	if (argc != 2 && argc != 3) {
+		printf("usage:\n$ %s videofile|sdpfile [x264|x265|vp9|mpeg4]\n", progname);
 		exit(EXIT_FAILURE);
 	}
 }
 
+/**
+ * Map an encoder name given on the command line to its id.
+ * Calls pexit for unknown names.
+ */
+enc_id parse_encoder(const char *name)
+{
+	if (!strcmp(name, "x264"))
+		return LIBX264;
+	if (!strcmp(name, "x265"))
+		return LIBX265;
+	if (!strcmp(name, "vp9"))
+		return LIBVPX;
+	if (!strcmp(name, "mpeg4"))
+		return MPEG4;
+	pexit("unknown encoder, use x264, x265, vp9 or mpeg4");
+	return LIBX264;
+}
+
+/**
+ * Set up the headless sink if requested through FFOVEATED_HEADLESS.
+ * Calls pexit for unknown modes.
+ * @param policy what to do with late frames in realtime mode
+ * @return 1 if main runs headless, 0 otherwise
+ */
+int headless_init(late_policy policy)
+{
+	const char *mode = getenv("FFOVEATED_HEADLESS");
+
+	if (!mode)
+		return 0;
+	if (strcmp(mode, "realtime") && strcmp(mode, "fast"))
+		pexit("FFOVEATED_HEADLESS must be realtime or fast");
+	sc = sink_init(!strcmp(mode, "realtime"), policy, getenv("FFOVEATED_PRESENT"));
+	return 1;
+}
+
+/**
+ * Open the gaze source selected through FFOVEATED_GAZE_SOURCE. Without a
+ * selection the source follows from the other settings: gaze received with
+ * FFOVEATED_GAZE_LISTEN, the script FFOVEATED_GAZE, the eye-tracker or the
+ * mouse over the window, in this order. Calls pexit for unknown sources.
+ * @return gaze_source* to pass to gaze_use, NULL for none
+ */
+gaze_source *gaze_source_init(void)
+{
+	const char *name = getenv("FFOVEATED_GAZE_SOURCE");
+	const char *seed = getenv("FFOVEATED_GAZE_SEED");
+
+	if (!name) {
+		if (getenv("FFOVEATED_GAZE_LISTEN"))
+			name = "udp";
+		else if (getenv("FFOVEATED_GAZE"))
+			name = "trace";
+		else if (gaze_tracker())
+			name = "tracker";
+		else if (wc)
+			name = "mouse";
+		else
+			return NULL;
+	}
+
+	if (!strcmp(name, "none"))
+		return NULL;
+	if (!strcmp(name, "mouse"))
+		return gaze_mouse_open();
+	if (!strcmp(name, "synthetic"))
+		return gaze_synthetic_open(seed ? strtoull(seed, NULL, 0) : 1);
+	if (!strcmp(name, "trace")) {
+		if (!getenv("FFOVEATED_GAZE"))
+			pexit("the trace gaze source needs FFOVEATED_GAZE");
+		return gaze_trace_open(getenv("FFOVEATED_GAZE"));
+	}
+	if (!strcmp(name, "udp")) {
+		if (!getenv("FFOVEATED_GAZE_LISTEN"))
+			pexit("the udp gaze source needs FFOVEATED_GAZE_LISTEN");
+		return gaze_udp_open(getenv("FFOVEATED_GAZE_LISTEN"));
+	}
+	if (!strcmp(name, "tracker")) {
+		if (!gaze_tracker())
+			pexit("the tracker gaze source needs eye-tracking, build with ET");
+		return gaze_tracker();
+	}
+	pexit("unknown gaze source, use mouse, trace, synthetic, udp, tracker or none");
+	return NULL;
+}
+
 /**
  * Loop: Render frames and react to events.
  * Calls pexit in case of a failure.
  */
-void event_loop(int run)
+void event_loop(void)
 {
 	SDL_Event event;
-	int fn = 0; //frame number
-	int fps = src_dc->frame_rate.num / src_dc->frame_rate.den;
+	int fps = pl->frame_rate.num / pl->frame_rate.den;
 	char msgbuf[1024];
 
-	static float qp_offset = 0;
-	set_qp_offset(qp_offset);
-
-	int reduce[] =  {10,  5,  3,  2,  2, 1, 1, 1, 1, 1};
-	int lift[] =    {25, 20, 17, 15, 10, 8, 8, 5, 5, 5};
-	int delay[] =   { 1,  1,  1,  1,  1, 2, 2, 2, 2, 2};
-
-	fprintf(stderr, "fps: %d", fps);
+	fprintf(stderr, "fps: %d\n", fps);
 	if (fps > 60 || fps < 22) {
 		pexit("questionable frame rate");
 	}
 
-	if (wc->time_start != -1)
+	if (wc && wc->sched.time_start != -1)
 		pexit("Error: call set_timing first");
 
 	while (1) {
-		fn++;
 		// check for events to handle, meanwhile just render frames
-		if (frame_refresh(wc))
+		if (wc ? frame_refresh(wc) : sink_refresh(sc))
 			break;
 
-		if (fn % (fps * delay[run]) == 0) {
-			// reduce qp every second by reduce[run]
-			qp_offset = get_qp_offset() + reduce[run];
-			set_qp_offset(qp_offset);
-		}
-
+		if (!wc)
+			continue;
 		SDL_PumpEvents();
 		while (SDL_PeepEvents(&event, 1, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT)) {
 			switch (event.type) {
@@ -95,14 +170,11 @@ void event_loop(int run)
 					pexit("q pressed");
 					break;
 				case SDLK_SPACE:
-					rc->abort = 1;
+					pipeline_abort(pl);
 					wc->abort = 1;
-					//increase by upfkt[3un]
-					printf("run: %d, qp_offset: %f, lift[run]: %d\n", run, qp_offset, lift[run]);
-					qp_offset =  (qp_offset - lift[run]) > 0 ? (qp_offset - lift[run]) : 0;
-					sprintf(msgbuf, "space pressed, setting qp_offset to: %f", qp_offset);
+					sprintf(msgbuf, "space pressed, qp_offset: %f", get_qp_offset());
 					#ifdef ET
-					log_message(ec, msgbuf);
+					log_message(pl->ec, msgbuf);
 					#endif
 					break;
 			}
@@ -112,44 +184,128 @@ void event_loop(int run)
 	}
 }
 
+/**
+ * Report a finished run, see the FFOVEATED_* statistics.
+ * @param what name of the run
+ */
+static void end_run(const char *what)
+{
+	gaze_report(what);
+	// rewritten after every run, so a run that ends badly keeps the previous ones
+	trace_dump();
+}
+
 int main(int argc, char **argv)
 {
-	char **paths;
-	SDL_Thread *reader, *src_decoder, *encoder, *fov_decoder;
 	const int queue_capacity = 32;
+	enc_id id;
+	late_policy policy;
+	const char *url, *sdp_path;
+	gaze_tx *gtx = NULL;
+	gaze_source *gaze;
+	link_params link;
+	char what[32];
+	int runs;
 
 	display_usage(argc, argv[0]);
+	id = argc == 3 ? parse_encoder(argv[2]) : LIBX264;
 
 	signal(SIGTERM, exit);
 	signal(SIGINT, exit);
 
-	setup_ivx(LIBX264);
-	wc = window_init();
-	set_ivx_window(wc->window);
+	trace_init(getenv("FFOVEATED_TRACE"));
+	if (getenv("FFOVEATED_DISPLAY"))
+		set_display(getenv("FFOVEATED_DISPLAY"));
+	setup_ivx(id);
+	policy = parse_late_policy(getenv("FFOVEATED_LATE"));
+	url = getenv("FFOVEATED_SERVE");
+	sdp_path = getenv("FFOVEATED_SDP") ? getenv("FFOVEATED_SDP") : "stream.sdp";
+	if (getenv("FFOVEATED_LINK")) {
+		link_parse(&link, getenv("FFOVEATED_LINK"));
+		link.log_path = getenv("FFOVEATED_LINK_LOG");
+	}
+	// the gaze is predicted for the presentation of a frame unless disabled
+	if (getenv("FFOVEATED_PREDICT"))
+		set_gaze_prediction(atoi(getenv("FFOVEATED_PREDICT")));
+	if (getenv("FFOVEATED_DISTANCE"))
+		set_viewing_distance(atof(getenv("FFOVEATED_DISTANCE")));
+	if (getenv("FFOVEATED_GAZE_LATENCY"))
+		set_gaze_latency(llrint(atof(getenv("FFOVEATED_GAZE_LATENCY")) * 1000));
+	if (getenv("FFOVEATED_FREEZE") || getenv("FFOVEATED_SUPPRESS")) {
+		gaze_policy gp = {gaze_freeze, gaze_suppress, gaze_suppress};
 
-	for (int run = 0; run < 10; run++) {
-		rc = reader_init(argv[1], queue_capacity);
-		src_dc = source_decoder_init(rc, queue_capacity);
-		ec = encoder_init(LIBX264, src_dc, argv[1]);
-		fov_dc = fov_decoder_init(ec);
+		if (getenv("FFOVEATED_FREEZE") && !atoi(getenv("FFOVEATED_FREEZE")))
+			gp.fixation = NULL;
+		if (getenv("FFOVEATED_SUPPRESS") && !atoi(getenv("FFOVEATED_SUPPRESS")))
+			gp.saccade = gp.blink = NULL;
+		set_gaze_policy(&gp);
+	}
+	if (getenv("FFOVEATED_MODEL"))
+		set_foveation_model(getenv("FFOVEATED_MODEL"));
+	// peripheral offset, raised further by the rate controller if there is one
+	if (getenv("FFOVEATED_DELTA"))
+		set_qp_offset(atoi(getenv("FFOVEATED_DELTA")));
+	if (getenv("FFOVEATED_BITRATE"))
+		rate_set_target(atof(getenv("FFOVEATED_BITRATE")));
+	else if (getenv("FFOVEATED_LINK"))
+		rate_set_target(RATE_LINK_SHARE * link.rate);
+	// a server displays nothing, the client does
+	if (!url && !headless_init(policy)) {
+		wc = window_init(policy);
+		// the foveated decoder writes to textures of the window
+		set_fov_get_buffer(window_get_buffer, wc);
+	}
 
-		reader = SDL_CreateThread(reader_thread, "reader", rc);
-		src_decoder = SDL_CreateThread(decoder_thread, "src_decoder", src_dc);
-		encoder = SDL_CreateThread(encoder_thread, "encoder", ec);
-		fov_decoder = SDL_CreateThread(decoder_thread, "fov_decoder", fov_dc);
+	// read by the encoder and the gaze sender, which must not start before
+	gaze = gaze_source_init();
+	gaze_use(gaze);
 
-		SDL_DetachThread(reader);
-		SDL_DetachThread(src_decoder);
-		SDL_DetachThread(encoder);
-		SDL_DetachThread(fov_decoder);
+	// threads and codecs are kept across runs, see pipeline_restart
+	pl = pipeline_init(argv[1], id, queue_capacity, url, sdp_path,
+			   getenv("FFOVEATED_LINK") ? &link : NULL, wc || (sc && sc->realtime));
+	// a viewer sends its gaze to the encoder, see the udp gaze source
+	if (getenv("FFOVEATED_GAZE_SEND") && !pl->tx)
+		gtx = gaze_sender_start(getenv("FFOVEATED_GAZE_SEND"));
+	// a client receives all runs of the server as a single stream
+	runs = pl->ec ? 10 : 1;
+	for (int run = 0; run < runs; run++) {
+		if (run) {
+			trace_set_run(run);
+			pipeline_restart(pl);
+		}
+
+		snprintf(what, sizeof(what), "run %d", run);
+		if (pl->tx) {
+			pipeline_join(pl);
+			end_run(what);
+			continue;
+		}
+
+		if (sc) {
+			set_sink_source(sc, pl->frames, pl->time_base, run);
+			event_loop();
+			flush_sink_source(sc);
+			end_run(what);
+			continue;
+		}
 
 		SDL_SetWindowFullscreen(wc->window, SDL_WINDOW_FULLSCREEN_DESKTOP);
 		SDL_RaiseWindow(wc->window);
-		set_window_source(wc, fov_dc->frames, ec->timestamps, src_dc->avctx->time_base);
-		event_loop(0);
+		set_window_source(wc, pl->frames, pl->time_base);
+		event_loop();
 		pause(wc->window);
+		flush_window_source(wc);
+		end_run(what);
 	}
+	if (gtx)
+		gaze_sender_stop(&gtx);
+	pipeline_free(&pl);
+	gaze_use(NULL);
+	// the SMI callback keeps publishing to the tracker
+	if (gaze && gaze != gaze_tracker())
+		gaze_close(&gaze);
+	if (sc)
+		sink_free(&sc);
 
-	free_lines(&paths);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void display_usage(char *progname)
+{
+	printf("decode a video once into a cache file for main and replicate\n");
+	printf("usage:\n$ %s video cachefile\n", progname);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		display_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	cache_build(argv[1], argv[2]);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "net.h"
+#include "pexit.h"
+#include "pipeline.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <libavutil/intfloat.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/time.h>
+
+snd_ctx *sender_init(const char *url, const char *sdp_path, enc_ctx *ec,
+		     AVRational frame_rate)
+{
+	snd_ctx *s;
+	AVFormatContext *fctx = NULL;
+	AVDictionary *options = NULL;
+	AVStream *stream;
+	char sdp[4096];
+	FILE *f;
+
+	avformat_alloc_output_context2(&fctx, NULL, "rtp", url);
+	if (!fctx)
+		pexit("output context allocation failed");
+
+	stream = avformat_new_stream(fctx, NULL);
+	if (!stream)
+		pexit("output stream allocation failed");
+	stream->time_base = ec->avctx->time_base;
+	if (avcodec_parameters_from_context(stream->codecpar, ec->avctx) < 0)
+		pexit("avcodec_parameters_from_context failed");
+
+	av_dict_set_int(&options, "pkt_size", NET_PACKET_SIZE, 0);
+	av_dict_set_int(&options, "buffer_size", NET_BUFFER_SIZE, 0);
+	if (avio_open2(&fctx->pb, url, AVIO_FLAG_WRITE, NULL, &options) < 0)
+		pexit("avio_open2 failed");
+	av_dict_free(&options);
+
+	if (avformat_write_header(fctx, NULL) < 0)
+		pexit("avformat_write_header failed, is the codec supported by RTP?");
+
+	if (av_sdp_create(&fctx, 1, sdp, sizeof(sdp)) < 0)
+		pexit("av_sdp_create failed");
+	f = fopen(sdp_path, "w");
+	if (!f)
+		pexit("fopen failed");
+	// RFC 4566 attribute, the demuxer does not know the frame rate otherwise
+	fprintf(f, "%sa=framerate:%.4f\r\n", sdp, av_q2d(frame_rate));
+	if (fclose(f))
+		pexit("fclose failed");
+
+	s = malloc(sizeof(snd_ctx));
+	if (!s)
+		pexit("malloc failed");
+
+	s->packets = ec->packets;
+	s->fctx = fctx;
+	s->time_base = ec->avctx->time_base;
+	s->frame_duration = FFMAX(1, av_rescale_q(1, av_inv_q(frame_rate), s->time_base));
+	s->restart = 1;
+	s->offset = 0;
+	s->pl = NULL;
+	/*
+	 * The muxer timestamps its RTCP sender reports with the wall clock since
+	 * the header was written, so the stream starts at the header as well.
+	 */
+	s->time_start = av_gettime_relative();
+	s->next_ts = av_rescale_q(NET_START_DELAY, AV_TIME_BASE_Q, s->time_base);
+
+	return s;
+}
+
+/**
+ * Move a packet to the continuous timeline of the stream and wait until it is
+ * due. Runs start one frame after the last packet of the previous run.
+ */
+static void pace_packet(snd_ctx *s, AVPacket *pkt)
+{
+	int64_t ts, due, now;
+
+	ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+	if (s->restart) {
+		s->offset = s->next_ts - ts;
+		s->restart = 0;
+	}
+	ts += s->offset;
+	if (pkt->pts != AV_NOPTS_VALUE)
+		pkt->pts += s->offset;
+	if (pkt->dts != AV_NOPTS_VALUE)
+		pkt->dts += s->offset;
+	if (ts + s->frame_duration > s->next_ts)
+		s->next_ts = ts + s->frame_duration;
+
+	now = av_gettime_relative();
+	due = av_rescale_q(ts, s->time_base, AV_TIME_BASE_Q);
+	if (s->time_start + due > now)
+		av_usleep(s->time_start + due - now);
+}
+
+int sender_thread(void *ptr)
+{
+	snd_ctx *s = (snd_ctx *) ptr;
+	AVStream *stream = s->fctx->streams[0];
+	AVPacket *pkt;
+
+	for (;;) {
+		pkt = queue_extract(s->packets);
+		if (!pkt) {
+			// the client keeps decoding, the next run follows seamlessly
+			if (!s->pl || pipeline_wait(s->pl))
+				break;
+			s->restart = 1;
+			continue;
+		}
+
+		pace_packet(s, pkt);
+		pkt->stream_index = 0;
+		av_packet_rescale_ts(pkt, s->time_base, stream->time_base);
+		// a client that is not listening yet is not an error for UDP
+		if (av_write_frame(s->fctx, pkt) < 0)
+			fprintf(stderr, "sending a packet failed\n");
+		queue_recycle(s->packets, pkt);
+	}
+
+	av_write_trailer(s->fctx);
+	avio_closep(&s->fctx->pb);
+	avformat_free_context(s->fctx);
+	queue_free(&s->packets);
+	free(s);
+	return 0;
+}
+
+int sdp_probe(const char *path)
+{
+	char magic[4];
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return 0;
+	ret = fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, "v=0", 3) &&
+	      (magic[3] == '\n' || magic[3] == '\r');
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Read the frame rate from the framerate attribute of an SDP file.
+ * Calls pexit if there is none.
+ */
+static AVRational sdp_frame_rate(const char *path)
+{
+	char **lines;
+	double fps = 0;
+
+	lines = parse_lines(path);
+	for (int i = 0; lines[i]; i++)
+		sscanf(lines[i], "a=framerate:%lf", &fps);
+	free_lines(&lines);
+	if (fps <= 0)
+		pexit("no framerate in SDP, use one written by the server");
+	return av_d2q(fps, 100000);
+}
+
+rdr_ctx *receiver_init(char *sdp_path, int queue_capacity, AVRational *frame_rate)
+{
+	AVDictionary *options = NULL;
+	rdr_ctx *rc;
+
+	*frame_rate = sdp_frame_rate(sdp_path);
+
+	// the SDP demuxer opens the RTP ports described in the file
+	av_dict_set(&options, "protocol_whitelist", "file,udp,rtp", 0);
+	av_dict_set_int(&options, "buffer_size", NET_BUFFER_SIZE, 0);
+	rc = reader_init(sdp_path, queue_capacity, &options);
+	av_dict_free(&options);
+	rc->timeout = NET_TIMEOUT;
+
+	return rc;
+}
+
+void gaze_pack(uint8_t *buf, const gaze_sample *s)
+{
+	memcpy(buf, GAZE_MAGIC, 4);
+	AV_WB16(buf + 4, GAZE_VERSION);
+	AV_WB16(buf + 6, s->flags);
+	AV_WB32(buf + 8, s->seq);
+	AV_WB32(buf + 12, av_float2int(s->x));
+	AV_WB32(buf + 16, av_float2int(s->y));
+	AV_WB32(buf + 20, av_float2int(s->distance));
+	AV_WB64(buf + 24, s->time);
+}
+
+int gaze_unpack(gaze_sample *s, const uint8_t *buf, int size)
+{
+	if (size != GAZE_PACKET_SIZE || memcmp(buf, GAZE_MAGIC, 4) ||
+	    AV_RB16(buf + 4) != GAZE_VERSION)
+		return AVERROR_INVALIDDATA;
+	s->flags = AV_RB16(buf + 6);
+	s->seq = AV_RB32(buf + 8);
+	s->x = av_int2float(AV_RB32(buf + 12));
+	s->y = av_int2float(AV_RB32(buf + 16));
+	s->distance = av_int2float(AV_RB32(buf + 20));
+	s->time = AV_RB64(buf + 24);
+	return 0;
+}
+
+static int gaze_sender_thread(void *ptr)
+{
+	gaze_tx *tx = (gaze_tx *) ptr;
+	uint8_t buf[GAZE_PACKET_SIZE];
+	gaze_sample s;
+
+	while (!tx->quit) {
+		if (!gaze_latest(&s)) {
+			memset(&s, 0, sizeof(s));
+			s.time = av_gettime_relative();
+			s.x = 0.5;
+			s.y = 0.5;
+		}
+		s.seq = tx->seq++;
+		gaze_pack(buf, &s);
+		// every flush is a datagram, a lost one is replaced by the next
+		avio_write(tx->pb, buf, sizeof(buf));
+		avio_flush(tx->pb);
+		tx->pb->error = 0;
+		av_usleep(GAZE_INTERVAL);
+	}
+	return 0;
+}
+
+gaze_tx *gaze_sender_start(const char *url)
+{
+	gaze_tx *tx;
+
+	tx = malloc(sizeof(gaze_tx));
+	if (!tx)
+		pexit("malloc failed");
+
+	if (avio_open2(&tx->pb, url, AVIO_FLAG_WRITE, NULL, NULL) < 0)
+		pexit("avio_open2 failed");
+	tx->seq = 0;
+	tx->quit = 0;
+	tx->thread = SDL_CreateThread(gaze_sender_thread, "gaze_sender", tx);
+	if (!tx->thread)
+		pexit(SDL_GetError());
+	return tx;
+}
+
+void gaze_sender_stop(gaze_tx **tx)
+{
+	(*tx)->quit = 1;
+	SDL_WaitThread((*tx)->thread, NULL);
+	avio_closep(&(*tx)->pb);
+	free(*tx);
+	*tx = NULL;
+}
+
+/**
+ * Interrupt callback of the receiver socket.
+ * @return 1 once the receiver is stopped, 0 otherwise
+ */
+static int interrupt_receiver(void *opaque)
+{
+	gaze_rx *rx = opaque;
+
+	return rx->quit;
+}
+
+void gaze_clock_init(gaze_clock *c)
+{
+	c->offset = INT64_MAX;
+	c->window_min = INT64_MAX;
+	c->window_end = 0;
+}
+
+void gaze_clock_map(gaze_clock *c, gaze_sample *s, int64_t arrival)
+{
+	int64_t offset = arrival - s->time;
+
+	c->offset = FFMIN(c->offset, offset);
+	c->window_min = FFMIN(c->window_min, offset);
+	if (arrival >= c->window_end) {
+		// forget earlier windows, the clocks may have drifted since
+		c->offset = c->window_min;
+		c->window_min = INT64_MAX;
+		c->window_end = arrival + GAZE_CLOCK_WINDOW;
+	}
+	s->time += c->offset;
+}
+
+int gaze_receive(gaze_rx *rx, gaze_sample *s, const uint8_t *buf, int size, int64_t arrival)
+{
+	int32_t gap;
+
+	if (gaze_unpack(s, buf, size) < 0) {
+		rx->invalid++;
+		return 0;
+	}
+
+	// the sequence number wraps around, compare by difference
+	gap = rx->received ? (int32_t) (s->seq - rx->last_seq) : 1;
+	if (gap <= 0) {
+		rx->stale++;
+		return 0;
+	}
+	rx->lost += gap - 1;
+	rx->received++;
+	rx->last_seq = s->seq;
+	// the client's clock is unrelated to ours, ages and prediction need our clock
+	gaze_clock_map(&rx->clock, s, arrival);
+	return 1;
+}
+
+static int gaze_receiver_thread(void *ptr)
+{
+	gaze_rx *rx = (gaze_rx *) ptr;
+	uint8_t buf[GAZE_PACKET_SIZE + 1];
+	gaze_sample s;
+	int64_t arrival;
+	int ret;
+
+	for (;;) {
+		ret = avio_read_partial(rx->pb, buf, sizeof(buf));
+		arrival = av_gettime_relative();
+		if (ret == AVERROR_EXIT || rx->quit)
+			break;
+		// renumbered by the source, gaps are counted by gaze_receive
+		if (ret >= 0 && gaze_receive(rx, &s, buf, ret, arrival))
+			gaze_publish(rx->src, &s);
+	}
+	return 0;
+}
+
+static void gaze_udp_close(gaze_source *src)
+{
+	gaze_rx *rx = src->priv;
+
+	rx->quit = 1;
+	SDL_WaitThread(rx->thread, NULL);
+	fprintf(stderr, "gaze: received %"PRIu64" packets, %"PRIu64" lost, %"PRIu64" out of order, "
+		"%"PRIu64" invalid\n", rx->received, rx->lost, rx->stale, rx->invalid);
+	if (rx->received)
+		fprintf(stderr, "gaze: client clock behind by %.3f ms, including the shortest transit\n",
+			rx->clock.offset / 1000.0);
+	avio_closep(&rx->pb);
+	free(rx);
+}
+
+gaze_source *gaze_udp_open(const char *url)
+{
+	AVIOInterruptCB cb;
+	AVDictionary *options = NULL;
+	gaze_rx *rx;
+
+	rx = calloc(1, sizeof(gaze_rx));
+	if (!rx)
+		pexit("calloc failed");
+
+	cb.callback = interrupt_receiver;
+	cb.opaque = rx;
+	// read datagrams straight from the socket instead of through a fifo thread
+	av_dict_set(&options, "fifo_size", "0", 0);
+	if (avio_open2(&rx->pb, url, AVIO_FLAG_READ, &cb, &options) < 0)
+		pexit("avio_open2 failed");
+	av_dict_free(&options);
+
+	rx->quit = 0;
+	gaze_clock_init(&rx->clock);
+	rx->src = gaze_source_alloc("udp", NULL, gaze_udp_close, rx);
+	rx->thread = SDL_CreateThread(gaze_receiver_thread, "gaze_receiver", rx);
+	if (!rx->thread)
+		pexit(SDL_GetError());
+	return rx->src;
+}
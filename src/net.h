@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "codec.h"
+#include "gaze.h"
+#include "io.h"
+#include "queue.h"
+#include <stdatomic.h>
+#include <libavformat/avformat.h>
+#include <SDL2/SDL.h>
+
+// RTP packet size, stays below the MTU of an Ethernet link
+#define NET_PACKET_SIZE 1400
+
+// socket buffer size, holds the packets of a keyframe arriving in a burst
+#define NET_BUFFER_SIZE (4 << 20)
+
+// delay of the first packet, leaves time to start the client from the SDP
+#define NET_START_DELAY 2000000
+
+// the client ends the stream after this long without packets, in microseconds
+#define NET_TIMEOUT 2000000
+
+/*
+ * Gaze packets, sent by a client to the encoder over UDP. All fields are big
+ * endian, floats as IEEE 754 single precision:
+ *
+ *  0  magic     "FOVG"
+ *  4  version   uint16, GAZE_VERSION
+ *  6  flags     uint16, see gaze_sample
+ *  8  seq       uint32
+ * 12  x         float
+ * 16  y         float
+ * 20  distance  float
+ * 24  time      int64, capture time in microseconds
+ */
+#define GAZE_MAGIC "FOVG"
+#define GAZE_VERSION 1
+#define GAZE_PACKET_SIZE 32
+
+// interval between gaze packets sent by a client in microseconds, 500 Hz
+#define GAZE_INTERVAL 2000
+
+// packets older than this do not count for the clock offset, in microseconds
+#define GAZE_CLOCK_WINDOW 10000000
+
+/**
+ * Sends the packets of the foveated encoder to a client over RTP/UDP.
+ *
+ * Packets are sent when their dts is due, so the server paces the client.
+ * Runs are appended on one continuous timeline starting NET_START_DELAY after
+ * sender_init, the client sees a single stream.
+ * Passed to sender_thread through SDL_CreateThread.
+ */
+typedef struct snd_ctx {
+	Queue *packets;      // input, freed by the sender
+	AVFormatContext *fctx;
+	AVRational time_base; // of the incoming packets
+	int64_t frame_duration; // in time_base
+	int64_t time_start;  // wall clock at timestamp 0 in microseconds
+	int restart;         // next packet starts a run
+	int64_t offset;      // added to the timestamps of the current run
+	int64_t next_ts;     // first timestamp of the next run
+	struct pipeline *pl; // NULL if the thread exits after a single run
+} snd_ctx;
+
+/**
+ * Create a sender and write the session description for the client.
+ *
+ * The SDP is written to sdp_path, with an additional framerate attribute.
+ * Calls pexit in case of a failure.
+ * @param url destination, e.g. rtp://127.0.0.1:5004
+ * @param sdp_path file to write the session description to
+ * @param ec encoder whose packets are sent
+ * @param frame_rate frame rate of the video
+ * @return snd_ctx* to a heap-allocated instance, freed by sender_thread.
+ */
+snd_ctx *sender_init(const char *url, const char *sdp_path, enc_ctx *ec,
+		     AVRational frame_rate);
+
+/**
+ * Send packets from a queue over RTP.
+ *
+ * At the end of a run, wait for a restart if the sender belongs to a pipeline,
+ * otherwise stop. This function is to be used through SDL_CreateThread.
+ * @param ptr will be cast to (snd_ctx *)
+ * @return int 0 on success.
+ */
+int sender_thread(void *ptr);
+
+/**
+ * Check whether a file is a session description.
+ * @param path file to check
+ * @return 1 if path starts with an SDP version line, 0 otherwise
+ */
+int sdp_probe(const char *path);
+
+/**
+ * Create a reader receiving the stream described by an SDP file.
+ *
+ * The stream ends after NET_TIMEOUT without packets, once the first packet
+ * has arrived. Calls pexit in case of a failure.
+ * @param sdp_path session description written by sender_init
+ * @param queue_capacity output buffer size.
+ * @param frame_rate set to the frame rate announced in the SDP
+ * @return rdr_ctx* to pass to reader_thread and remote_decoder_init.
+ */
+rdr_ctx *receiver_init(char *sdp_path, int queue_capacity, AVRational *frame_rate);
+
+/**
+ * Serialize a gaze sample into a gaze packet.
+ * @param buf GAZE_PACKET_SIZE bytes to write to
+ * @param s sample to serialize
+ */
+void gaze_pack(uint8_t *buf, const gaze_sample *s);
+
+/**
+ * Deserialize a gaze packet.
+ * @param s sample to fill
+ * @param buf received packet
+ * @param size size of the received packet
+ * @return 0 on success, a negative value if the packet is not a gaze packet
+ * of this version
+ */
+int gaze_unpack(gaze_sample *s, const uint8_t *buf, int size);
+
+// Sends the local gaze every GAZE_INTERVAL, see gaze_sender_start
+typedef struct gaze_tx {
+	AVIOContext *pb;
+	uint32_t seq;
+	atomic_int quit;
+	SDL_Thread *thread;
+} gaze_tx;
+
+/*
+ * Offset of the local clock to the clock of a client, estimated from the gaze
+ * packet that arrived fastest after its capture. It includes the shortest
+ * transit time, which cannot be told apart from the offset without a reply.
+ */
+typedef struct gaze_clock {
+	int64_t offset;     // local minus client time, INT64_MAX before the first packet
+	int64_t window_min; // offset of the fastest packet of the current window
+	int64_t window_end; // local time the current window ends at
+} gaze_clock;
+
+/**
+ * Initialize a clock offset estimate.
+ * @param c estimate to initialize
+ */
+void gaze_clock_init(gaze_clock *c);
+
+/**
+ * Move the capture time of a received sample to the local clock.
+ *
+ * The offset follows the fastest packet within the last GAZE_CLOCK_WINDOW,
+ * so it tracks clocks drifting apart. Mapped samples age from the arrival of
+ * the fastest packet on, the shortest transit time is not included.
+ * @param c estimate, updated with the sample
+ * @param s received sample, its time is replaced
+ * @param arrival local time the sample arrived at, av_gettime_relative()
+ */
+void gaze_clock_map(gaze_clock *c, gaze_sample *s, int64_t arrival);
+
+// Receives gaze packets, private data of the source, see gaze_udp_open
+typedef struct gaze_rx {
+	AVIOContext *pb;
+	gaze_source *src;  // the received samples are published through
+	uint32_t last_seq; // of the latest published sample
+	uint64_t received;
+	uint64_t lost;     // gaps in the sequence numbers
+	uint64_t stale;    // reordered or duplicate packets, dropped
+	uint64_t invalid;  // packets that are no gaze packets of this version
+	gaze_clock clock;  // capture times of the client are mapped by
+	atomic_int quit;
+	SDL_Thread *thread;
+} gaze_rx;
+
+/**
+ * Take a received packet into account.
+ *
+ * Invalid, reordered and duplicate packets are counted and dropped. Gaps in
+ * the sequence numbers are counted as lost, the capture time is moved to the
+ * local clock, see gaze_clock_map.
+ * @param rx receiver, its counters are updated
+ * @param s sample to fill
+ * @param buf received packet
+ * @param size size of the received packet
+ * @param arrival local time the packet arrived at, av_gettime_relative()
+ * @return 1 if s is the newest sample and to be published, 0 otherwise
+ */
+int gaze_receive(gaze_rx *rx, gaze_sample *s, const uint8_t *buf, int size, int64_t arrival);
+
+/**
+ * Start sending the latest gaze of the source in use, see gaze_latest, in a
+ * thread. Until the source has a sample, invalid samples are sent.
+ * Calls pexit in case of a failure.
+ * @param url destination, e.g. udp://127.0.0.1:5006
+ * @return gaze_tx* to a heap-allocated instance, see gaze_sender_stop.
+ */
+gaze_tx *gaze_sender_start(const char *url);
+
+/**
+ * Stop sending gaze, free the sender and set tx to NULL.
+ * @param tx sender to stop
+ */
+void gaze_sender_stop(gaze_tx **tx);
+
+/**
+ * Open gaze packets received from a client as a source, e.g. to foveate for
+ * a remote eye-tracker. A thread receives the packets and publishes them.
+ * Out of order packets are dropped, so the source always holds the newest
+ * sample. Closing the source prints the packet statistics.
+ * Calls pexit in case of a failure.
+ * @param url local address to listen on, e.g. udp://127.0.0.1:5006
+ * @return gaze_source* to pass to gaze_use and gaze_close.
+ */
+gaze_source *gaze_udp_open(const char *url);
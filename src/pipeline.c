@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.h"
+#include "net.h"
+#include "pexit.h"
+#include "y4m.h"
+
+/**
+ * Pass the packets of the foveated decoder through an emulated link, if any.
+ */
+static void link_insert(pipeline *p, const link_params *link)
+{
+	p->link = NULL;
+	if (!link)
+		return;
+	p->link = link_init(p->fov_dc->packets, link);
+	p->link->pl = p;
+	p->fov_dc->packets = p->link->out;
+}
+
+/**
+ * Start the threads of the link and the foveated decoder.
+ */
+static void fov_decoder_start(pipeline *p)
+{
+	if (p->link) {
+		p->threads[p->nb_threads++] = SDL_CreateThread(link_send_thread, "link_send", p->link);
+		p->threads[p->nb_threads++] = SDL_CreateThread(link_deliver_thread, "link_deliver", p->link);
+	}
+	p->threads[p->nb_threads++] = SDL_CreateThread(decoder_thread, "fov_decoder", p->fov_dc);
+}
+
+/**
+ * Set up a client pipeline receiving the stream described by an SDP file.
+ */
+static void client_init(pipeline *p, char *sdp_path, int queue_capacity,
+			const link_params *link)
+{
+	AVRational frame_rate;
+
+	p->rc = receiver_init(sdp_path, queue_capacity, &frame_rate);
+	p->cache = NULL;
+	p->src_dc = NULL;
+	p->ec = NULL;
+	p->tx = NULL;
+	p->fov_dc = remote_decoder_init(p->rc, frame_rate);
+
+	p->rc->pl = p;
+	p->fov_dc->pl = p;
+	link_insert(p, link);
+
+	p->frames = p->fov_dc->frames;
+	p->time_base = p->fov_dc->avctx->time_base;
+	p->frame_rate = frame_rate;
+
+	p->threads[p->nb_threads++] = SDL_CreateThread(reader_thread, "receiver", p->rc);
+	fov_decoder_start(p);
+}
+
+/**
+ * Set up a pipeline encoding a video, which decodes the encoded packets or
+ * serves them to a client.
+ */
+static void video_init(pipeline *p, char *filename, enc_id id, int queue_capacity,
+		       const char *url, const char *sdp_path, const link_params *link,
+		       int paced)
+{
+	if (cache_probe(filename)) {
+		p->rc = NULL;
+		p->src_dc = cache_source_init(filename, queue_capacity);
+		p->cache = p->src_dc->cache;
+	} else if (y4m_probe(filename)) {
+		p->rc = NULL;
+		p->src_dc = y4m_source_init(filename, queue_capacity);
+		p->cache = p->src_dc->cache;
+	} else {
+		p->rc = reader_init(filename, queue_capacity, NULL);
+		p->src_dc = source_decoder_init(p->rc, queue_capacity);
+		p->cache = NULL;
+	}
+	if (p->rc)
+		p->rc->pacer.enabled = paced;
+	else
+		p->cache->pacer.enabled = paced;
+	p->ec = encoder_init(id, p->src_dc, filename);
+	if (url) {
+		p->tx = sender_init(url, sdp_path, p->ec, p->src_dc->frame_rate);
+		p->fov_dc = NULL;
+	} else {
+		p->tx = NULL;
+		p->fov_dc = fov_decoder_init(p->ec);
+	}
+
+	if (p->rc)
+		p->rc->pl = p;
+	p->src_dc->pl = p;
+	p->ec->pl = p;
+	if (p->tx) {
+		p->tx->pl = p;
+		// the real network follows the sender
+		if (link)
+			pexit("an emulated link belongs to a client or a local pipeline");
+		p->link = NULL;
+	} else {
+		p->fov_dc->pl = p;
+		link_insert(p, link);
+	}
+
+	// the threads free their contexts on exit, keep what the display needs
+	p->frames = p->fov_dc ? p->fov_dc->frames : NULL;
+	p->time_base = p->src_dc->avctx->time_base;
+	p->frame_rate = p->src_dc->frame_rate;
+
+	if (p->rc) {
+		p->threads[p->nb_threads++] = SDL_CreateThread(reader_thread, "reader", p->rc);
+		p->threads[p->nb_threads++] = SDL_CreateThread(decoder_thread, "src_decoder", p->src_dc);
+	} else {
+		p->threads[p->nb_threads++] = SDL_CreateThread(cache_thread, "cache", p->src_dc);
+	}
+	p->threads[p->nb_threads++] = SDL_CreateThread(encoder_thread, "encoder", p->ec);
+	if (p->tx)
+		p->threads[p->nb_threads++] = SDL_CreateThread(sender_thread, "sender", p->tx);
+	else
+		fov_decoder_start(p);
+}
+
+pipeline *pipeline_init(char *filename, enc_id id, int queue_capacity,
+			const char *url, const char *sdp_path, const link_params *link,
+			int paced)
+{
+	pipeline *p;
+
+	p = malloc(sizeof(pipeline));
+	if (!p)
+		pexit("malloc failed");
+
+	p->mutex = SDL_CreateMutex();
+	p->cond = SDL_CreateCond();
+	if (!p->mutex || !p->cond)
+		pexit(SDL_GetError());
+	p->generation = 0;
+	p->idle = 0;
+	p->quit = 0;
+
+	p->nb_threads = 0;
+	if (sdp_probe(filename))
+		client_init(p, filename, queue_capacity, link);
+	else
+		video_init(p, filename, id, queue_capacity, url, sdp_path, link, paced);
+	for (int i = 0; i < p->nb_threads; i++)
+		if (!p->threads[i])
+			pexit(SDL_GetError());
+
+	return p;
+}
+
+/**
+ * Wait until every thread has finished the current run.
+ * The mutex must be locked.
+ */
+static void wait_idle(pipeline *p)
+{
+	while (p->idle < p->nb_threads)
+		if (SDL_CondWait(p->cond, p->mutex))
+			pexit(SDL_GetError());
+}
+
+void pipeline_restart(pipeline *p)
+{
+	if (SDL_LockMutex(p->mutex))
+		pexit(SDL_GetError());
+
+	wait_idle(p);
+	// the source is waiting, no need to synchronize with it any further
+	if (p->rc)
+		p->rc->abort = 0;
+	else
+		p->cache->abort = 0;
+	p->idle = 0;
+	p->generation++;
+	SDL_CondBroadcast(p->cond);
+
+	if (SDL_UnlockMutex(p->mutex))
+		pexit(SDL_GetError());
+}
+
+void pipeline_join(pipeline *p)
+{
+	if (SDL_LockMutex(p->mutex))
+		pexit(SDL_GetError());
+	wait_idle(p);
+	if (SDL_UnlockMutex(p->mutex))
+		pexit(SDL_GetError());
+}
+
+void pipeline_abort(pipeline *p)
+{
+	if (p->rc)
+		p->rc->abort = 1;
+	else
+		p->cache->abort = 1;
+}
+
+int pipeline_wait(pipeline *p)
+{
+	int generation;
+	int quit;
+
+	if (SDL_LockMutex(p->mutex))
+		pexit(SDL_GetError());
+
+	generation = p->generation;
+	p->idle++;
+	SDL_CondBroadcast(p->cond);
+	while (p->generation == generation && !p->quit)
+		if (SDL_CondWait(p->cond, p->mutex))
+			pexit(SDL_GetError());
+	quit = p->quit;
+
+	if (SDL_UnlockMutex(p->mutex))
+		pexit(SDL_GetError());
+	return quit;
+}
+
+void pipeline_free(pipeline **p)
+{
+	pipeline *pl = *p;
+
+	if (SDL_LockMutex(pl->mutex))
+		pexit(SDL_GetError());
+	wait_idle(pl);
+	pl->quit = 1;
+	SDL_CondBroadcast(pl->cond);
+	if (SDL_UnlockMutex(pl->mutex))
+		pexit(SDL_GetError());
+
+	for (int i = 0; i < pl->nb_threads; i++)
+		SDL_WaitThread(pl->threads[i], NULL);
+
+	// every other queue is freed by its consumer thread
+	if (pl->frames)
+		queue_free(&pl->frames);
+	if (pl->link)
+		link_free(&pl->link);
+	SDL_DestroyCond(pl->cond);
+	SDL_DestroyMutex(pl->mutex);
+	free(pl);
+	*p = NULL;
+}
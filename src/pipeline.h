@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "cache.h"
+#include "codec.h"
+#include "io.h"
+#include "link.h"
+#include "net.h"
+#include <SDL2/SDL.h>
+
+#define PIPELINE_THREADS 6
+
+/**
+ * Reader, source decoder, foveated encoder and foveated decoder of a video,
+ * kept alive across several runs. A cache or Y4M file replaces reader and
+ * source decoder by a single cache source thread, see cache.h and y4m.h.
+ *
+ * Split over a network, a server pipeline sends the encoded packets to a
+ * client instead of decoding them, and a client pipeline only consists of a
+ * receiving reader and the foveated decoder, see net.h. An emulated link may
+ * delay and lose the packets on their way to the foveated decoder, see link.h.
+ *
+ * At the end of a run each thread passes the terminating NULL on and waits
+ * in pipeline_wait. pipeline_restart rewinds the reader and lets the threads
+ * continue, which flush their codecs instead of reopening them.
+ */
+typedef struct pipeline {
+	rdr_ctx *rc;      // NULL if the source is a mapped file
+	cache_ctx *cache; // NULL if the source is read by a reader
+	dec_ctx *src_dc;  // NULL on a client
+	enc_ctx *ec;      // NULL on a client
+	dec_ctx *fov_dc;  // NULL on a server
+	snd_ctx *tx;      // NULL unless on a server
+	link_ctx *link;   // NULL unless the network is emulated
+	SDL_Thread *threads[PIPELINE_THREADS];
+	int nb_threads;
+
+	Queue *frames; // output of the foveated decoder, to be displayed, NULL on a server
+	AVRational time_base;
+	AVRational frame_rate;
+
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	int generation; // incremented by every restart
+	int idle;       // threads waiting for the next run
+	int quit;
+} pipeline;
+
+/**
+ * Open a video and its codecs and start the pipeline threads.
+ *
+ * The first run starts right away. Given an SDP file, the pipeline is a
+ * client receiving a single run from a server. Given a url, it is a server.
+ * Calls pexit in case of a failure.
+ * @param filename video file, Y4M file, cache file written by cache_build or
+ * SDP file written by a server
+ * @param id encoder to use for foveated encoding
+ * @param queue_capacity size of the reader and source decoder output buffers
+ * @param url RTP destination to serve the encoded video to, NULL to decode it
+ * @param sdp_path file to write the session description for the client to
+ * @param link emulated link in front of the foveated decoder, NULL for none
+ * @param paced read the video at the pace of its timestamps for a display
+ * presenting in realtime, see src_pacer. Ignored by a client.
+ * @return pipeline* to a heap-allocated instance, see pipeline_free.
+ */
+pipeline *pipeline_init(char *filename, enc_id id, int queue_capacity,
+			const char *url, const char *sdp_path, const link_params *link,
+			int paced);
+
+/**
+ * Start another run from the beginning of the video.
+ *
+ * Waits until every thread has finished the current run, so the display
+ * must have extracted the terminating NULL from p->frames before.
+ * @param p pipeline to restart
+ */
+void pipeline_restart(pipeline *p);
+
+/**
+ * Wait until every thread has finished the current run.
+ *
+ * Lets a server, which has no display to extract the terminating NULL,
+ * wait for the end of a run.
+ * @param p pipeline to wait for
+ */
+void pipeline_join(pipeline *p);
+
+/**
+ * Stop reading, the current run ends as if the video was over.
+ * @param p pipeline to abort
+ */
+void pipeline_abort(pipeline *p);
+
+/**
+ * Wait for the next run, called by the pipeline threads after passing on
+ * the terminating NULL.
+ *
+ * @param p pipeline the calling thread belongs to
+ * @return 0 if the thread has to start the next run, 1 if it has to exit.
+ */
+int pipeline_wait(pipeline *p);
+
+/**
+ * Stop the threads once the current run has finished, free the pipeline and
+ * all associated data and set p to NULL.
+ *
+ * The display must have extracted the terminating NULL from p->frames before.
+ * @param p pipeline to free
+ */
+void pipeline_free(pipeline **p);
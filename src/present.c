@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "present.h"
+#include "pexit.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <libavutil/avutil.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/time.h>
+
+void sched_init(scheduler *s, int refresh_rate, int hw_vsync, late_policy policy,
+		int64_t start_delay)
+{
+	if (refresh_rate <= 0)
+		refresh_rate = PRESENT_DEFAULT_REFRESH;
+	s->period = 1000000 / refresh_rate;
+	s->vsync = -1;
+	s->hw_vsync = hw_vsync;
+	s->policy = policy;
+	s->start_delay = start_delay;
+	memset(&s->total, 0, sizeof(present_stats));
+	sched_start(s, av_make_q(1, 1));
+}
+
+void sched_start(scheduler *s, AVRational time_base)
+{
+	s->time_base = time_base;
+	s->time_start = -1;
+	s->last_present = -1;
+	s->next_report = av_gettime_relative() + PRESENT_REPORT_INTERVAL;
+	memset(&s->run, 0, sizeof(present_stats));
+}
+
+/**
+ * First vsync at or after t, assuming a vsync at s->vsync.
+ */
+static int64_t vsync_after(scheduler *s, int64_t t)
+{
+	int64_t n;
+
+	if (s->vsync < 0 || t <= s->vsync)
+		return t;
+	n = (t - s->vsync + s->period - 1) / s->period;
+	return s->vsync + n * s->period;
+}
+
+int64_t sched_target(scheduler *s, int64_t pts, int newer)
+{
+	int64_t upts = av_rescale_q(pts, s->time_base, AV_TIME_BASE_Q);
+	int64_t now = av_gettime_relative();
+	int64_t due, target, earliest;
+
+	if (s->time_start == -1)
+		s->time_start = now + s->start_delay - upts;
+
+	// the vsync closest to the due time, the next one we can make if later
+	due = s->time_start + upts;
+	target = vsync_after(s, due - s->period / 2);
+	earliest = vsync_after(s, now + PRESENT_MARGIN);
+	if (target >= earliest)
+		return target;
+
+	if (s->policy == PRESENT_DROP && newer && earliest - due >= s->period) {
+		s->run.dropped++;
+		s->total.dropped++;
+		return -1;
+	}
+	s->run.late++;
+	s->total.late++;
+	return earliest;
+}
+
+void sched_wait(scheduler *s, int64_t target)
+{
+	// presenting blocks for the remainder with a vsync
+	int64_t remaining = target - (s->hw_vsync ? PRESENT_MARGIN : 0) - av_gettime_relative();
+
+	if (remaining > 0)
+		av_usleep(remaining);
+}
+
+/**
+ * Add a presentation error to running statistics (Welford's algorithm).
+ */
+static void add_error(present_stats *st, int64_t error)
+{
+	double delta;
+
+	st->presented++;
+	delta = error - st->error_mean;
+	st->error_mean += delta / st->presented;
+	st->error_m2 += delta * (error - st->error_mean);
+	st->error_max = FFMAX(st->error_max, FFABS(error));
+}
+
+void sched_presented(scheduler *s, int64_t pts, int64_t target, int64_t now)
+{
+	int64_t due = s->time_start + av_rescale_q(pts, s->time_base, AV_TIME_BASE_Q);
+	int64_t ideal = vsync_after(s, due - s->period / 2);
+	int64_t shown, expected;
+
+	add_error(&s->run, now - due);
+	add_error(&s->total, now - due);
+
+	// vsyncs the previous frame was shown for, beyond those up to our due vsync
+	if (s->last_present != -1 && ideal > s->last_ideal) {
+		shown = (now - s->last_present + s->period / 2) / s->period;
+		expected = (ideal - s->last_ideal + s->period / 2) / s->period;
+		if (shown > expected) {
+			s->run.repeated += shown - expected;
+			s->total.repeated += shown - expected;
+		}
+	}
+	s->last_present = now;
+	s->last_ideal = ideal;
+	s->vsync = s->hw_vsync ? now : target;
+
+	if (now >= s->next_report) {
+		sched_report("current run", &s->run);
+		s->next_report = now + PRESENT_REPORT_INTERVAL;
+	}
+}
+
+void sched_report(const char *what, const present_stats *st)
+{
+	double stddev = st->presented > 1 ? sqrt(st->error_m2 / (st->presented - 1)) : 0;
+
+	fprintf(stderr, "%s: presented %"PRIu64", late %"PRIu64", dropped %"PRIu64
+		", repeated %"PRIu64", error mean %.2f ms, stddev %.2f ms, max %.2f ms\n",
+		what, st->presented, st->late, st->dropped, st->repeated,
+		st->error_mean / 1000, stddev / 1000, st->error_max / 1000.0);
+}
+
+late_policy parse_late_policy(const char *name)
+{
+	if (!name || !strcmp(name, "drop"))
+		return PRESENT_DROP;
+	if (!strcmp(name, "late"))
+		return PRESENT_LATE;
+	pexit("unknown late frame policy, use drop or late");
+	return PRESENT_DROP;
+}
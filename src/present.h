@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <libavutil/rational.h>
+
+// refresh rate assumed if the display does not report one
+#define PRESENT_DEFAULT_REFRESH 60
+
+/*
+ * delay of the first frame of a run on a display, it can't be presented at
+ * once. Every later frame is held as long after its arrival from a paced
+ * source, so it must stay well below a frame period, or the next frame
+ * replaces the one waiting in the latest-only queue of the display.
+ */
+#define PRESENT_START_DELAY (1000000 / PRESENT_DEFAULT_REFRESH)
+
+// time needed to render a frame before the vsync it is presented at
+#define PRESENT_MARGIN 2000
+
+// interval of the statistics printed while a run is presented, in microseconds
+#define PRESENT_REPORT_INTERVAL 5000000
+
+// what to do with a frame that can no longer make the vsync it is due at
+typedef enum {
+	PRESENT_LATE, // present it at the next vsync
+	PRESENT_DROP, // drop it if a newer frame is waiting, present it late otherwise
+} late_policy;
+
+typedef struct present_stats {
+	uint64_t presented;
+	uint64_t late;     // presented after the vsync they were due at
+	uint64_t dropped;  // dropped as late, see PRESENT_DROP
+	uint64_t repeated; // vsyncs a frame stayed on screen beyond its cadence
+	double error_mean; // presentation minus due time in microseconds
+	double error_m2;   // sum of squared deviations from error_mean
+	int64_t error_max; // largest absolute presentation error
+} present_stats;
+
+/**
+ * Presentation scheduler of a display with a fixed refresh period.
+ *
+ * Frames are due at their pts relative to the first frame of a run. Each is
+ * assigned the vsync closest to that time, or the next reachable vsync if it
+ * is late. All times are av_gettime_relative() microseconds.
+ */
+typedef struct scheduler {
+	int64_t period;     // refresh period
+	int64_t vsync;      // time of the last vsync, -1 if none yet
+	int hw_vsync;       // presenting blocks until the vsync
+	int64_t start_delay; // delay of the first frame of a run
+	late_policy policy;
+	AVRational time_base;
+	int64_t time_start; // due time of pts 0, -1 before the first frame of a run
+	int64_t last_present; // previous presentation of the run, -1 if none yet
+	int64_t last_ideal; // vsync the previous presentation was due at
+	int64_t next_report;
+	present_stats run;
+	present_stats total;
+} scheduler;
+
+/**
+ * Initialize a scheduler.
+ *
+ * With hw_vsync the vsync phase is taken from the time presenting returns,
+ * otherwise vsyncs are virtual and frames are presented at the target time.
+ * @param s scheduler to initialize
+ * @param refresh_rate of the display in Hz, PRESENT_DEFAULT_REFRESH if not positive
+ * @param hw_vsync 1 if presenting blocks until the vsync, 0 otherwise
+ * @param policy what to do with late frames
+ * @param start_delay delay of the first frame of a run, e.g. PRESENT_START_DELAY
+ */
+void sched_init(scheduler *s, int refresh_rate, int hw_vsync, late_policy policy,
+		int64_t start_delay);
+
+/**
+ * Sleep until a frame has to be submitted to be presented at target.
+ * @param s scheduler
+ * @param target as returned by sched_target
+ */
+void sched_wait(scheduler *s, int64_t target);
+
+/**
+ * Start a run, frames are scheduled relative to its first frame.
+ * @param s scheduler to reset
+ * @param time_base time base of the pts of the run
+ */
+void sched_start(scheduler *s, AVRational time_base);
+
+/**
+ * Choose the vsync to present a frame at.
+ *
+ * @param s scheduler
+ * @param pts presentation timestamp of the frame
+ * @param newer 1 if a newer frame is already waiting, which allows dropping
+ * @return time of the vsync to present the frame at, -1 to drop the frame.
+ */
+int64_t sched_target(scheduler *s, int64_t pts, int newer);
+
+/**
+ * Account a presentation and print the statistics of the run every
+ * PRESENT_REPORT_INTERVAL.
+ * @param s scheduler
+ * @param pts presentation timestamp of the frame
+ * @param target as returned by sched_target
+ * @param now time presenting the frame returned
+ */
+void sched_presented(scheduler *s, int64_t pts, int64_t target, int64_t now);
+
+/**
+ * Print presentation statistics to stderr.
+ * @param what name of the statistics, e.g. "run 3"
+ * @param st statistics to print
+ */
+void sched_report(const char *what, const present_stats *st);
+
+/**
+ * Parse a late frame policy as given on the command line or the environment.
+ * Calls pexit for unknown names.
+ * @param name "late", "drop" or NULL for the default
+ * @return the policy
+ */
+late_policy parse_late_policy(const char *name);
@@ -16,128 +16,342 @@
  */
 
 #include "queue.h"
+#include "pexit.h"
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+static void futex_wait(atomic_uint *addr, unsigned int val)
+{
+	if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0) &&
+	    errno != EAGAIN && errno != EINTR)
+		pexit("futex wait failed");
+}
+
+static void futex_wake(atomic_uint *addr)
+{
+	if (syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0) < 0)
+		pexit("futex wake failed");
+}
+#else
+// without futexes, sleeping degrades to yielding until seq changes
+static void futex_wait(atomic_uint *addr, unsigned int val)
+{
+	if (atomic_load(addr) == val)
+		sched_yield();
+}
+
+static void futex_wake(atomic_uint *addr)
+{
+	(void) addr;
+}
+#endif
 
 /**
- * Print formatted error message referencing the affeted source file,
- * line and the errno status through perror (3), then exit with EXIT_FAILURE.
- * Likely used through the pexit macro for comfort.
+ * Sleep until *counter no longer equals seen.
  *
- * @param msg error message
- * @param file usually the __FILE__ macro
- * @param line usually the __LINE__ macro
+ * The store to s->waiting and the load of *counter pair up with the store
+ * to the counter and the load of s->waiting in signal_wake, at least one of
+ * both sides observes the other, so no wakeup is lost.
  */
-static void pexit_(const char *msg, const char *file, const int line)
+static void signal_wait(QueueSignal *s, atomic_size_t *counter, size_t seen)
 {
-	char buf[1024];
+	unsigned int seq;
+
+	for (;;) {
+		atomic_store(&s->waiting, 1);
+		seq = atomic_load(&s->seq);
+		if (atomic_load(counter) != seen)
+			break;
+		futex_wait(&s->seq, seq);
+	}
+	atomic_store_explicit(&s->waiting, 0, memory_order_relaxed);
+}
 
-	snprintf(buf, sizeof(buf), "%s:%d: %s", file, line, msg);
-	perror(buf);
-	exit(EXIT_FAILURE);
+/**
+ * Wake the other side if it sleeps in signal_wait.
+ * Must be called after the counter it waits on has been updated.
+ */
+static void signal_wake(QueueSignal *s)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&s->waiting, memory_order_relaxed)) {
+		atomic_fetch_add(&s->seq, 1);
+		futex_wake(&s->seq);
+	}
 }
 
-// Convenience macro to report runtime errors with debug information.
-#define pexit(s) pexit_(s, __FILE__, __LINE__)
+// marks an empty slot of a latest-only queue, NULL is a valid element
+static char empty_slot;
+#define EMPTY ((void *) &empty_slot)
 
 Queue *queue_init(size_t capacity)
 {
 	Queue *q;
+	size_t size;
 
-	q = (Queue *) malloc(sizeof(Queue));
+	if (!capacity)
+		pexit("queue capacity must be at least 1");
+
+	q = aligned_alloc(QUEUE_CACHELINE, sizeof(Queue));
 	if (!q)
-		pexit("malloc failed");
+		pexit("aligned_alloc failed");
 
-	// allocate one additional element for signalling
-	q->data = malloc((capacity+1) * sizeof(void *));
+	// power of two storage turns the modulo into a mask
+	for (size = 1; size < capacity; size <<= 1)
+		;
+	q->data = malloc(size * sizeof(void *));
 	if (!q->data)
 		pexit("malloc failed");
 
-	q->front = 0;
-	q->rear  = 0;
 	q->capacity = capacity;
+	q->mask = size - 1;
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->head, 0);
+	q->head_cache = 0;
+	q->tail_cache = 0;
+	atomic_init(&q->not_empty.seq, 0);
+	atomic_init(&q->not_empty.waiting, 0);
+	atomic_init(&q->not_full.seq, 0);
+	atomic_init(&q->not_full.waiting, 0);
+	q->latest = 0;
+	q->free_item = NULL;
+	atomic_init(&q->slot, EMPTY);
+	atomic_init(&q->dropped, 0);
+	q->returned = NULL;
+	q->unref_item = NULL;
+	q->spare = NULL;
+	return q;
+}
 
-	q->mutex = SDL_CreateMutex();
-	q->full  = SDL_CreateCond();
-	q->empty = SDL_CreateCond();
-	if (!(q->mutex && q->full && q->empty))
-		pexit("SDL_CreateMutex or SDL_CreateCond failed");
+Queue *queue_init_latest(void (*free_item)(void *item))
+{
+	Queue *q;
+
+	q = queue_init(1);
+	q->latest = 1;
+	q->free_item = free_item;
 	return q;
 }
 
-/*
-static void queue_flush(Queue *q, void (*free_fkt)(void *))
+void queue_set_recycling(Queue *q, void (*unref_item)(void *item), void (*free_item)(void *item))
+{
+	/*
+	 * new elements are only allocated while none are waiting for reuse, so
+	 * at most capacity + 2 exist: the stored ones plus one held by each side
+	 */
+	q->returned = queue_init(q->capacity + 2);
+	q->unref_item = unref_item;
+	q->free_item = free_item;
+}
+
+void queue_recycle(Queue *q, void *item)
 {
+	if (!item)
+		return;
 
+	if (!q->returned) {
+		if (q->free_item)
+			q->free_item(item);
+		return;
+	}
+	q->unref_item(item);
+	queue_append(q->returned, item);
+}
+
+void *queue_reuse(Queue *q)
+{
+	void *item;
+
+	if (q->spare) {
+		item = q->spare;
+		q->spare = NULL;
+		return item;
+	}
+	if (q->returned && queue_poll(q->returned, &item))
+		return item;
+	return NULL;
 }
-*/
 
 void queue_free(Queue **q)
 {
 	Queue *qd = *q;
+	void *item;
+
+	if (qd->returned) {
+		while (queue_poll(qd->returned, &item))
+			qd->free_item(item);
+		queue_free(&qd->returned);
+	}
+	if (qd->spare)
+		qd->free_item(qd->spare);
 
-	SDL_DestroyMutex(qd->mutex);
-	SDL_DestroyCond(qd->full);
-	SDL_DestroyCond(qd->empty);
 	free(qd->data);
-	free(*q);
+	free(qd);
+	*q = NULL;
+}
+
+static void latest_append(Queue *q, void *data)
+{
+	size_t seen;
+	void *old;
+
+	// the end of stream must not replace the final element, wait for its extraction
+	while (!data) {
+		seen = atomic_load_explicit(&q->head, memory_order_acquire);
+		if (atomic_load(&q->slot) == EMPTY)
+			break;
+		signal_wait(&q->not_full, &q->head, seen);
+	}
+
+	old = atomic_exchange(&q->slot, data);
+	if (old != EMPTY) {
+		atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+		// keep the replaced element for the next queue_reuse
+		if (q->returned && old && !q->spare) {
+			q->unref_item(old);
+			q->spare = old;
+		} else if (q->free_item && old) {
+			q->free_item(old);
+		}
+	}
+
+	// tail only counts appends here, the consumer sleeps on it
+	atomic_fetch_add_explicit(&q->tail, 1, memory_order_release);
+	signal_wake(&q->not_empty);
+}
+
+static void *latest_extract(Queue *q)
+{
+	size_t seen;
+	void *data;
+
+	for (;;) {
+		seen = atomic_load_explicit(&q->tail, memory_order_acquire);
+		data = atomic_exchange(&q->slot, EMPTY);
+		if (data != EMPTY) {
+			// head only counts extractions here, the producer sleeps on it before NULL
+			atomic_fetch_add_explicit(&q->head, 1, memory_order_release);
+			signal_wake(&q->not_full);
+			return data;
+		}
+		signal_wait(&q->not_empty, &q->tail, seen);
+	}
 }
 
 void queue_append(Queue *q, void *data)
 {
-	unsigned int new_rear;
+	size_t tail;
+
+	if (q->latest) {
+		latest_append(q, data);
+		return;
+	}
+
+	tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	//check if full, reload the consumer position only if it seems so
+	if (tail - q->head_cache == q->capacity) {
+		q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+		if (tail - q->head_cache == q->capacity) {
+			signal_wait(&q->not_full, &q->head, q->head_cache);
+			q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+		}
+	}
+
+	q->data[tail & q->mask] = data;
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	signal_wake(&q->not_empty);
+}
+
+size_t queue_extract_batch(Queue *q, void **items, size_t max)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t n, i;
+
+	if (!max)
+		return 0;
 
-	if (SDL_LockMutex(q->mutex))
-		pexit(SDL_GetError());
+	if (q->latest) {
+		items[0] = latest_extract(q);
+		return 1;
+	}
 
-	new_rear = (q->rear + 1) % (q->capacity + 1);
-	//check if full
-	if (new_rear == q->front) {
-		if (SDL_CondWait(q->full, q->mutex))
-			pexit(SDL_GetError());
+	//check if empty, reload the producer position only if it seems so
+	if (q->tail_cache == head) {
+		q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+		if (q->tail_cache == head) {
+			signal_wait(&q->not_empty, &q->tail, head);
+			q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+		}
 	}
-	q->data[q->rear] = data;
-	q->rear = new_rear;
-	/* at least one item is now queued*/
-	if (SDL_CondSignal(q->empty))
-		pexit(SDL_GetError());
 
-	if (SDL_UnlockMutex(q->mutex))
-		pexit(SDL_GetError());
+	n = q->tail_cache - head;
+	if (n > max)
+		n = max;
+	for (i = 0; i < n; i++)
+		items[i] = q->data[(head + i) & q->mask];
 
+	atomic_store_explicit(&q->head, head + n, memory_order_release);
+	signal_wake(&q->not_full);
+	return n;
 }
 
 void *queue_extract(Queue *q)
 {
 	void *data;
 
-	if (SDL_LockMutex(q->mutex))
-		pexit(SDL_GetError());
+	queue_extract_batch(q, &data, 1);
+	return data;
+}
+
+int queue_poll(Queue *q, void **data)
+{
+	size_t head;
+	void *item;
 
-	//check if empty
-	if (q->front == q->rear) {
-		if (SDL_CondWait(q->empty, q->mutex))
-			pexit(SDL_GetError());
+	if (q->latest) {
+		item = atomic_exchange(&q->slot, EMPTY);
+		if (item == EMPTY)
+			return 0;
+		atomic_fetch_add_explicit(&q->head, 1, memory_order_release);
+		signal_wake(&q->not_full);
+		*data = item;
+		return 1;
 	}
 
-	data = q->data[q->front];
-	q->front = (q->front + 1) % (q->capacity + 1);
-
-	if (SDL_CondSignal(q->full))
-		pexit(SDL_GetError());
-	if (SDL_UnlockMutex(q->mutex))
-		pexit(SDL_GetError());
+	head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	if (q->tail_cache == head) {
+		q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+		if (q->tail_cache == head)
+			return 0;
+	}
 
-	return data;
+	*data = q->data[head & q->mask];
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	signal_wake(&q->not_full);
+	return 1;
 }
 
-int queue_length(Queue *q) {
+uint64_t queue_dropped(Queue *q)
+{
+	return atomic_load_explicit(&q->dropped, memory_order_relaxed);
+}
 
-	size_t l;
-	SDL_LockMutex(q->mutex);
-	if (q->front >= q->rear)
-		l = q->front - q->rear;
-	else
-		l = q->capacity - (q->rear - q->front) -1;
+int queue_length(Queue *q)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
 
-	SDL_UnlockMutex(q->mutex);
-	return l;
+	if (q->latest)
+		return atomic_load(&q->slot) != EMPTY;
+	return tail - head;
 }
@@ -16,39 +16,137 @@
  */
 
 #pragma once
-#include <SDL2/SDL.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define QUEUE_CACHELINE 64
 
 /**
- * Container for a generic queue and associated metadata.
+ * Wakeup channel for one side of a queue.
  *
- * Signalling is implemented by having data[rear] always point to an
- * unused location, therefore capacity+1 elements have to be allocated.
+ * seq is the futex word, it is incremented on every wakeup. waiting is set
+ * while the owning side sleeps, so that appends and extracts only enter the
+ * kernel if there actually is a sleeper.
+ */
+typedef struct QueueSignal {
+	atomic_uint seq;
+	atomic_int waiting;
+} QueueSignal;
+
+/**
+ * Lock-free single-producer/single-consumer ring buffer.
+ *
+ * head and tail are free running counters, written only by the consumer and
+ * the producer respectively and kept on separate cache lines. Each side caches
+ * the last counter value seen from the other side and only reloads it when
+ * the ring appears to be empty or full. Threads only block in these cases.
+ *
+ * In latest-only mode (see queue_init_latest) the ring is replaced by a single
+ * slot, and an append replaces an element that has not been extracted yet.
+ *
+ * With recycling enabled (see queue_set_recycling) consumed elements travel
+ * back to the producer through a second ring, so a steady stream reuses the
+ * same elements instead of allocating new ones.
+ *
+ * Exactly one thread may append and one thread may extract at any time.
+ * Passing a side on to another thread requires the two threads to synchronize,
+ * e.g. through thread creation or a mutex.
  */
 typedef struct Queue {
 	void **data;
 	size_t capacity;
-	unsigned int front;
-	unsigned int rear;
-	SDL_mutex *mutex;
-	SDL_cond *full;
-	SDL_cond *empty;
+	size_t mask; // storage is rounded up to a power of two
+
+	// producer side
+	alignas(QUEUE_CACHELINE) atomic_size_t tail;
+	size_t head_cache;
+
+	// consumer side
+	alignas(QUEUE_CACHELINE) atomic_size_t head;
+	size_t tail_cache;
+
+	alignas(QUEUE_CACHELINE) QueueSignal not_empty; // the consumer sleeps here
+	alignas(QUEUE_CACHELINE) QueueSignal not_full;  // the producer sleeps here
+
+	// latest-only mode
+	int latest;
+	void (*free_item)(void *item);
+	alignas(QUEUE_CACHELINE) _Atomic(void *) slot;
+	atomic_uint_fast64_t dropped;
+
+	// recycling, elements flow back from the consumer to the producer
+	struct Queue *returned;
+	void (*unref_item)(void *item);
+	void *spare; // producer side, replaced element of a latest-only queue
 } Queue;
 
 /**
  * Create and initialize a queue structure.
  *
  * Allocates storage on the heap.
- * Use free_queue to dispose of pointers acquired through this function.
- * @param capacity number of elements the queue is able to store.
- * @return initialized queue. See enqueue, dequeue, free_queue.
+ * Use queue_free to dispose of pointers acquired through this function.
+ * @param capacity number of elements the queue is able to store, at least 1.
+ * @return initialized queue. See queue_append, queue_extract, queue_free.
  */
 Queue *queue_init(size_t capacity);
 
+/**
+ * Create a latest-only queue (mailbox).
+ *
+ * The queue holds at most one element. queue_append never blocks, instead it
+ * replaces an element the consumer has not extracted yet. The replaced element
+ * is passed to free_item and counted, see queue_dropped. A NULL element (end of
+ * stream) never replaces an element, appending it blocks until the pending one
+ * was extracted. It is never dropped either, it must be extracted before the
+ * next append.
+ * This bounds the latency of a realtime consumer, which always receives the
+ * most recent element.
+ * @param free_item called from the producer thread on dropped elements, may be NULL
+ * @return initialized queue. See queue_append, queue_extract, queue_free.
+ */
+Queue *queue_init_latest(void (*free_item)(void *item));
+
+/**
+ * Let consumed elements travel back to the producer for reuse.
+ *
+ * The consumer hands elements back through queue_recycle, the producer takes
+ * them through queue_reuse before allocating a new one. As long as each side
+ * holds at most one element at a time, queue_recycle never blocks.
+ * Replaced elements of a latest-only queue are kept for reuse as well.
+ * @param q queue to enable recycling for
+ * @param unref_item resets an element for reuse, e.g. av_frame_unref
+ * @param free_item disposes of elements, also set for latest-only queues
+ */
+void queue_set_recycling(Queue *q, void (*unref_item)(void *item), void (*free_item)(void *item));
+
+/**
+ * Hand a consumed element back to the producer.
+ *
+ * The element is passed to unref_item first. Without recycling it is passed
+ * to free_item instead, if there is one. NULL is ignored.
+ * Must only be called from the consumer thread.
+ * @param q queue the element was extracted from
+ * @param item element to recycle
+ */
+void queue_recycle(Queue *q, void *item);
+
+/**
+ * Take a recycled element.
+ *
+ * Must only be called from the producer thread.
+ * @param q queue to take a recycled element from
+ * @return a reset element, NULL if there is none and a new one is needed
+ */
+void *queue_reuse(Queue *q);
+
 /**
  * Free a Queue.
  *
- * The mutex and the full/empty condition variables are destroyed.
  * Calls free on both q->data and subsequently q itself, which is set to NULL.
+ * Recycled elements are passed to free_item. Must be called by the consumer
+ * after the producer is done, e.g. after extracting the terminating NULL.
  * This function does not take care of any remaining elements in the queue!
  * These have to be handled manually. Caution: This can lead to data leaks.
  */
@@ -57,7 +155,8 @@ void queue_free(Queue **q);
 /**
  * Add data to end of the queue.
  *
- * Blocks if there is no space left, waiting for a signal on the full condition variable.
+ * Blocks if there is no space left, until the consumer extracts an element.
+ * Must only be called from the producer thread.
  * @param q Queue acquired through queue_init.
  * @param data will be appended to q->data.
  */
@@ -66,19 +165,51 @@ void queue_append(Queue *q, void *data);
 /**
  * Extract the first element of a queue.
  *
- * Blocks if there is no element in q, waiting for a signal on the empty condition variable.
+ * Blocks if there is no element in q, until the producer appends one.
  * Pointers are not safely removed from the queue (not overwritten) and might still be
  * accessible at a later point in time.
+ * Must only be called from the consumer thread.
  * @param q pointer to a valid Queue acquired through queue_init.
  * @return void* the first element of q.
  */
 void *queue_extract(Queue *q);
 
+/**
+ * Extract up to max elements of a queue at once.
+ *
+ * Blocks until at least one element is available, then takes all available
+ * elements up to max with a single update of the shared state.
+ * Must only be called from the consumer thread.
+ * @param q pointer to a valid Queue acquired through queue_init.
+ * @param items array of at least max elements, receives the elements in order
+ * @param max maximum number of elements to extract
+ * @return number of extracted elements, 0 only if max is 0
+ */
+size_t queue_extract_batch(Queue *q, void **items, size_t max);
+
+/**
+ * Extract the first element of a queue without blocking.
+ *
+ * Must only be called from the consumer thread.
+ * @param q pointer to a valid Queue acquired through queue_init.
+ * @param data receives the first element if there is one
+ * @return 1 if an element was extracted, 0 if q is empty
+ */
+int queue_poll(Queue *q, void **data);
+
+/**
+ * Number of elements replaced before they were extracted.
+ *
+ * Always 0 for queues that are not latest-only.
+ * @param q queue to examine
+ * @return number of dropped elements
+ */
+uint64_t queue_dropped(Queue *q);
+
 /**
  * Length of the queue (elements contained).
  *
- * Locks q->mutex during length calculation, unlocks afterwards.
- * Result might be incorrect in multithreaded applications, be careful!
+ * Result might be outdated immediately in multithreaded applications, be careful!
  * @param q queue to examine
  * @return int length of q
  */
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rate.h"
+#include "codec.h"
+#include "pexit.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <libavutil/common.h>
+
+static double rate_target;
+
+void rate_set_target(double kbps)
+{
+	rate_target = kbps * 1000;
+}
+
+rate_ctl *rate_init(enc_id id, AVRational frame_rate)
+{
+	rate_ctl *r;
+	params *limits;
+
+	if (rate_target <= 0)
+		return NULL;
+	if (frame_rate.num <= 0 || frame_rate.den <= 0)
+		pexit("rate control needs the frame rate");
+
+	r = malloc(sizeof(rate_ctl));
+	if (!r)
+		pexit("malloc failed");
+
+	limits = params_limit_init(id);
+	r->delta_max = limits->delta_max;
+	free(limits);
+
+	r->target = rate_target;
+	r->frame_time = av_q2d(av_inv_q(frame_rate));
+	// a keyframe at the start must not saturate the output right away
+	r->rate = r->target;
+	r->backlog = 0;
+	r->u = 0;
+	memset(&r->run, 0, sizeof(r->run));
+	return r;
+}
+
+void rate_update(rate_ctl *r, int size)
+{
+	double bits = size * 8.0;
+	double error, u;
+
+	r->rate += RATE_SMOOTHING * (bits / r->frame_time - r->rate);
+	error = (r->rate - r->target) / r->target;
+
+	r->backlog += bits - r->target * r->frame_time;
+	u = RATE_KP * error + RATE_KI * r->backlog / r->target;
+	// anti-windup: a saturated output neither saves up credit nor debt
+	if (u > 1 || u < 0) {
+		u = av_clipd(u, 0, 1);
+		r->backlog = (u - RATE_KP * error) * r->target / RATE_KI;
+	}
+	r->u = av_clipd(u, 0, 1);
+
+	r->run.packets++;
+	r->run.bits += bits;
+}
+
+void rate_apply(rate_ctl *r, float *fd)
+{
+	double delta, scale;
+
+	// fd[3] holds the open-loop offset, see set_qp_offset
+	delta = FFMAX(fd[3], fd[3] + (r->delta_max - fd[3]) * FFMIN(1, 2 * r->u));
+	scale = 1 - (1 - RATE_SIGMA_MIN) * FFMAX(0, 2 * r->u - 1);
+	fd[2] *= scale;
+	fd[3] = delta;
+
+	r->run.frames++;
+	r->run.delta_sum += delta;
+	r->run.sigma_sum += scale;
+	r->run.u_max = FFMAX(r->run.u_max, r->u);
+}
+
+void rate_report(rate_ctl *r)
+{
+	rate_stats *s = &r->run;
+	double packets = s->packets ? s->packets : 1;
+	double frames = s->frames ? s->frames : 1;
+
+	fprintf(stderr, "rate: %.0f kbit/s for a target of %.0f kbit/s, delta mean %.2f, "
+		"sigma mean %.2f of the fovea, control up to %.2f\n",
+		s->bits / (packets * r->frame_time) / 1000, r->target / 1000,
+		s->delta_sum / frames, s->sigma_sum / frames, s->u_max);
+	memset(s, 0, sizeof(rate_stats));
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "common.h"
+#include <stdint.h>
+#include <libavutil/rational.h>
+
+// gains of the controller, on the bitrate error relative to the target
+#define RATE_KP 0.5 // per relative error
+#define RATE_KI 1.0 // per second of bits above the target
+
+// weight of the latest frame in the smoothed bitrate
+#define RATE_SMOOTHING 0.2
+
+// sigma shrinks down to this share of the geometric fovea
+#define RATE_SIGMA_MIN 0.5
+
+// share of the emulated link bandwidth targeted if no bitrate is set
+#define RATE_LINK_SHARE 0.9
+
+typedef struct rate_stats {
+	uint64_t packets;
+	double bits;
+	uint64_t frames;  // descriptors set
+	double delta_sum;
+	double sigma_sum; // relative to the geometric fovea
+	double u_max;
+} rate_stats;
+
+/**
+ * Closed-loop foveation controller holding the bitrate of the encoder.
+ *
+ * A PI controller acts on the smoothed bitrate of the encoded frames. Its
+ * integral is the backlog of bits above the target, as in a leaky bucket.
+ * The output u between 0 and 1 degrades the periphery first: up to one half
+ * it raises delta from the open-loop offset to the limit of the codec, beyond
+ * it narrows sigma down to RATE_SIGMA_MIN of the geometric fovea. The foveal
+ * QP, where the offset is 0, is never changed.
+ *
+ * Used by the encoder thread only.
+ */
+typedef struct rate_ctl {
+	double target;       // bit/s
+	double frame_time;   // seconds
+	double delta_max;    // of the codec
+	double rate;         // smoothed bitrate in bit/s
+	double backlog;      // bits above the target, negative below
+	double u;            // controller output
+	rate_stats run;
+} rate_ctl;
+
+/**
+ * Set the bitrate held by encoders created afterwards.
+ * @param kbps target in kbit/s, 0 to leave foveation open-loop
+ */
+void rate_set_target(double kbps);
+
+/**
+ * Create a controller for an encoder if a target is set.
+ * Calls pexit in case of a failure.
+ * @param id encoder, determines the range of delta
+ * @param frame_rate frame rate of the video
+ * @return rate_ctl* to a heap-allocated instance, NULL if no target is set.
+ */
+rate_ctl *rate_init(enc_id id, AVRational frame_rate);
+
+/**
+ * Account an encoded frame and update the controller.
+ * @param r controller
+ * @param size of the packet in bytes
+ */
+void rate_update(rate_ctl *r, int size);
+
+/**
+ * Set sigma and delta of a foveation descriptor filled by
+ * foveation_descriptor, see rate_ctl.
+ * @param r controller
+ * @param fd descriptor to adjust
+ */
+void rate_apply(rate_ctl *r, float *fd);
+
+/**
+ * Print and reset the statistics of a run.
+ * @param r controller
+ */
+void rate_report(rate_ctl *r);
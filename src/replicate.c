@@ -15,10 +15,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "cache.h"
 #include "io.h"
 #include "codec.h"
 #include "pexit.h"
 #include "window.h"
+#include "y4m.h"
 
 #include <inttypes.h>
 #include <limits.h>
@@ -44,6 +46,7 @@ void display_usage(char *progname)
 {
 	printf("replicate a foveated video trial");
 	printf("usage:\n$ %s source dest xcoords ycoords qp_offset sigma\n", progname);
+	printf("source may be a cache file written by mkcache or a Y4M file\n");
 }
 
 int main(int argc, char **argv)
@@ -59,6 +62,9 @@ int main(int argc, char **argv)
 
 	signal(SIGTERM, exit);
 	signal(SIGINT, exit);
+	// the model of the run to replicate
+	if (getenv("FFOVEATED_MODEL"))
+		set_foveation_model(getenv("FFOVEATED_MODEL"));
 
 	xcoords = parse_lines(argv[3]);
 	ycoords = parse_lines(argv[4]);
@@ -66,17 +72,31 @@ int main(int argc, char **argv)
 	sigmas = parse_lines(argv[6]);
 
 	printf(argv[1]);
-	rc = reader_init(argv[1], queue_capacity);
-	src_dc = source_decoder_init(rc, queue_capacity);
+	if (cache_probe(argv[1])) {
+		rc = NULL;
+		src_dc = cache_source_init(argv[1], queue_capacity);
+	} else if (y4m_probe(argv[1])) {
+		rc = NULL;
+		src_dc = y4m_source_init(argv[1], queue_capacity);
+	} else {
+		rc = reader_init(argv[1], queue_capacity, NULL);
+		src_dc = source_decoder_init(rc, queue_capacity);
+	}
 	ec = replicate_encoder_init(LIBX264, src_dc, xcoords, ycoords, qoffsets, sigmas);
-	wt = writer_init(argv[2], ec->packets, rc, src_dc->avctx);
+	wt = writer_init(argv[2], ec->packets, src_dc->avctx->time_base, src_dc->avctx);
 
-	reader = SDL_CreateThread(reader_thread, "reader", rc);
-	src_decoder = SDL_CreateThread(decoder_thread, "src_decoder", src_dc);
+	if (rc) {
+		reader = SDL_CreateThread(reader_thread, "reader", rc);
+		src_decoder = SDL_CreateThread(decoder_thread, "src_decoder", src_dc);
+	} else {
+		reader = NULL;
+		src_decoder = SDL_CreateThread(cache_thread, "cache", src_dc);
+	}
 	encoder = SDL_CreateThread(replicate_encoder_thread, "encoder", ec);
 	writer = SDL_CreateThread(writer_thread, "writer", wt);
 
-	SDL_WaitThread(reader, NULL);
+	if (reader)
+		SDL_WaitThread(reader, NULL);
 	SDL_WaitThread(src_decoder, NULL);
 	SDL_WaitThread(encoder, NULL);
 	SDL_WaitThread(writer, NULL);
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Next number of a seeded generator (splitmix64), uniform in [0, 1).
+ *
+ * Used where runs must be reproducible from a seed, e.g. the link emulator
+ * and the synthetic gaze source.
+ * @param state seed, advanced by every call
+ * @return double in [0, 1)
+ */
+static inline double rng_uniform(uint64_t *state)
+{
+	uint64_t z;
+
+	z = (*state += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	z ^= z >> 31;
+	return (z >> 11) * 0x1.0p-53;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sink.h"
+#include "et.h"
+#include "pexit.h"
+#include "trace.h"
+#include <inttypes.h>
+#include <libavutil/time.h>
+
+sink_ctx *sink_init(int realtime, late_policy policy, const char *log_path)
+{
+	sink_ctx *sc;
+
+	sc = malloc(sizeof(sink_ctx));
+	if (!sc)
+		pexit("malloc failed");
+
+	sc->log = NULL;
+	if (log_path) {
+		sc->log = fopen(log_path, "w");
+		if (!sc->log)
+			pexit("fopen failed");
+		fprintf(sc->log, "run pts present_us wall_us\n");
+	}
+	sc->realtime = realtime;
+	// frames arrive at the pace of the source, the start delay absorbs their jitter
+	sched_init(&sc->sched, PRESENT_DEFAULT_REFRESH, 0, policy, PRESENT_START_DELAY);
+	sc->frames = NULL;
+	sc->eos = 1;
+	return sc;
+}
+
+int sink_refresh(sink_ctx *sc)
+{
+	AVFrame *f;
+	int64_t target; // virtual vsync to present at in microseconds
+	int64_t now;
+
+	f = queue_extract(sc->frames);
+	if (!f) {
+		sc->eos = 1;
+		return 1;
+	}
+
+	if (sc->abort) {
+		queue_recycle(sc->frames, f);
+		// the remaining frames are left for flush_sink_source
+		return 1;
+	}
+
+	if (sc->clock == -1)
+		sc->wall_start = av_gettime_relative();
+
+	if (sc->realtime) {
+		target = sched_target(&sc->sched, f->pts, queue_length(sc->frames) > 0);
+		if (target < 0) {
+			queue_recycle(sc->frames, f);
+			return 0;
+		}
+		sched_wait(&sc->sched, target);
+		now = av_gettime_relative();
+		sched_presented(&sc->sched, f->pts, target, now);
+		sc->clock = now - sc->sched.time_start;
+	} else {
+		// the virtual clock never runs backwards
+		now = av_gettime_relative();
+		sc->clock = FFMAX(sc->clock, av_rescale_q(f->pts, sc->time_base, AV_TIME_BASE_Q));
+	}
+
+	trace_record(TRACE_PRESENT, f->pts);
+	gaze_presented(f->pts);
+	set_gaze_clock(sc->clock);
+	sc->presented++;
+	if (sc->log)
+		fprintf(sc->log, "%d %"PRId64" %"PRId64" %"PRId64"\n",
+			sc->run, f->pts, sc->clock, now - sc->wall_start);
+	queue_recycle(sc->frames, f);
+	return 0;
+}
+
+void set_sink_source(sink_ctx *sc, Queue *frames, AVRational time_base, int run)
+{
+	sc->frames = frames;
+	sc->dropped_start = queue_dropped(frames);
+	sc->eos = 0;
+	sc->time_base = time_base;
+	sched_start(&sc->sched, time_base);
+	sc->wall_start = av_gettime_relative();
+	sc->clock = -1;
+	sc->presented = 0;
+	sc->run = run;
+	sc->abort = 0;
+	set_gaze_clock(0);
+}
+
+void flush_sink_source(sink_ctx *sc)
+{
+	AVFrame *f;
+	int64_t elapsed;
+
+	if (!sc->eos) {
+		while ((f = queue_extract(sc->frames)))
+			queue_recycle(sc->frames, f);
+		sc->eos = 1;
+	}
+
+	elapsed = av_gettime_relative() - sc->wall_start;
+	printf("run %d: presented %"PRIu64" frames in %.3f s (%.1f fps), "
+	       "dropped %"PRIu64" stale frames\n",
+	       sc->run, sc->presented, elapsed / 1e6,
+	       elapsed > 0 ? sc->presented * 1e6 / elapsed : 0.0,
+	       queue_dropped(sc->frames) - sc->dropped_start);
+	// piped stdout is fully buffered, a run's result must not wait for exit
+	fflush(stdout);
+	if (sc->realtime)
+		sched_report("run", &sc->sched.run);
+}
+
+void sink_free(sink_ctx **sc)
+{
+	if ((*sc)->realtime)
+		sched_report("all runs", &(*sc)->sched.total);
+	if ((*sc)->log)
+		fclose((*sc)->log);
+	free(*sc);
+	*sc = NULL;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "present.h"
+#include "queue.h"
+#include <stdio.h>
+#include <libavutil/frame.h>
+#include <libavutil/rational.h>
+
+/**
+ * Headless replacement of the window: consumes frames like frame_refresh,
+ * but presents them to nobody.
+ *
+ * In realtime mode frames are scheduled on the vsyncs of a virtual display
+ * refreshing at PRESENT_DEFAULT_REFRESH, see scheduler.
+ * Otherwise frames are presented as fast as they arrive and a virtual clock
+ * jumps to the pts of every frame, so runs measure the throughput of the
+ * pipeline. Either way the clock drives scripted gaze, see set_gaze_clock.
+ */
+typedef struct sink_ctx {
+	Queue *frames;
+	uint64_t dropped_start; // stale frames dropped before the current run
+	int eos; // the terminating NULL has been extracted from frames
+	int realtime;
+	AVRational time_base;
+	scheduler sched;    // realtime only
+	int64_t wall_start; // wall clock at the first frame in microseconds
+	int64_t clock;      // presentation time of the last frame in microseconds, -1 before the first
+	uint64_t presented; // frames presented in the current run
+	int run;
+	FILE *log;          // presentation timestamps, may be NULL
+	int abort;
+} sink_ctx;
+
+/**
+ * Create and initialize a sink context.
+ *
+ * Calls pexit in case of a failure.
+ * @param realtime 1 to present frames when due, 0 to present them on arrival
+ * @param policy what to do with late frames in realtime mode
+ * @param log_path file to write a line "run pts present_us wall_us" to for
+ * every presented frame, no log is written if NULL.
+ * @return sink_ctx* to a heap-allocated instance, see sink_free.
+ */
+sink_ctx *sink_init(int realtime, late_policy policy, const char *log_path);
+
+/**
+ * Present the next frame in the queue, see frame_refresh.
+ *
+ * Presented frames are recycled through the queue.
+ * @param sc sink to present the frame with
+ * @return 0 on success, 1 if the queue is drained (returned NULL) or the sink
+ * has been aborted, see flush_sink_source.
+ */
+int sink_refresh(sink_ctx *sc);
+
+/**
+ * Update a sink in order to present a new run, see set_window_source.
+ *
+ * Call flush_sink_source before switching from a previous source.
+ * @param sc sink context to update
+ * @param frames new input queue for frames to be presented
+ * @param time_base time base of the pts of the frames
+ * @param run number of the run, for the log
+ */
+void set_sink_source(sink_ctx *sc, Queue *frames, AVRational time_base, int run);
+
+/**
+ * Discard the remaining frames of the current source up to the terminating
+ * NULL and print the statistics of the run.
+ *
+ * The queue itself belongs to the producer and is not freed.
+ * @param sc sink context to flush
+ */
+void flush_sink_source(sink_ctx *sc);
+
+/**
+ * Close the log, free the sink context and set sc to NULL.
+ * In realtime mode the statistics of all runs are printed.
+ * @param sc sink context to free
+ */
+void sink_free(sink_ctx **sc);
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Counts heap allocations while packets and frames travel through recycling
+ * queues the way they do between the pipeline threads. Once warmed up, the
+ * queues must not allocate per element. Buffers of the elements belong to the
+ * codecs and are not part of this test.
+ *
+ * The allocator of glibc is wrapped, av_malloc ends up in posix_memalign.
+ */
+
+#include "io.h"
+#include "queue.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+#include <libavutil/frame.h>
+
+#define WARMUP 64
+#define ELEMENTS 100000
+#define CAPACITY 8
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+static atomic_ulong allocations;
+
+void *malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	*ptr = __libc_memalign(alignment, size);
+	return *ptr ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_memalign(alignment, size);
+}
+
+// element types as recycled by the pipeline, see queue_set_recycling
+typedef struct element_type {
+	const char *name;
+	void *(*alloc)(void);
+	void (*unref)(void *item);
+	void (*free)(void *item);
+} element_type;
+
+static void *alloc_packet(void)
+{
+	return av_packet_alloc();
+}
+
+static void *alloc_frame(void)
+{
+	return av_frame_alloc();
+}
+
+static void unref_frame(void *item)
+{
+	av_frame_unref(item);
+}
+
+static void free_frame(void *item)
+{
+	AVFrame *frame = item;
+
+	av_frame_free(&frame);
+}
+
+static const element_type types[] = {
+	{"packets", alloc_packet, unref_packet, free_packet},
+	{"frames", alloc_frame, unref_frame, free_frame},
+};
+
+static void fail(const char *test, const element_type *t, unsigned long n)
+{
+	fprintf(stderr, "FAIL %s %s: %lu allocations\n", test, t->name, n);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Take an element as the producing threads do.
+ */
+static void *produce(Queue *q, const element_type *t)
+{
+	void *item = queue_reuse(q);
+
+	if (!item)
+		item = t->alloc();
+	if (!item) {
+		fprintf(stderr, "allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+	return item;
+}
+
+/**
+ * Drain the end of stream and free the queue with its recycled elements.
+ */
+static void finish(Queue *q)
+{
+	queue_append(q, NULL);
+	if (queue_extract(q))
+		exit(EXIT_FAILURE);
+	queue_free(&q);
+}
+
+/**
+ * Producer and consumer take turns, one element at a time.
+ */
+static void test_lockstep(const element_type *t, int latest)
+{
+	Queue *q = latest ? queue_init_latest(NULL) : queue_init(CAPACITY);
+	unsigned long n = 0;
+
+	queue_set_recycling(q, t->unref, t->free);
+	for (int i = 0; i < WARMUP + ELEMENTS; i++) {
+		if (i == WARMUP)
+			n = atomic_load(&allocations);
+		queue_append(q, produce(q, t));
+		queue_recycle(q, queue_extract(q));
+	}
+	n = atomic_load(&allocations) - n;
+	if (n)
+		fail(latest ? "latest lockstep" : "lockstep", t, n);
+	finish(q);
+}
+
+/**
+ * The display misses every other frame, the producer replaces it in the
+ * latest-only queue and reuses it.
+ */
+static void test_replace(const element_type *t)
+{
+	Queue *q = queue_init_latest(NULL);
+	unsigned long n = 0;
+
+	queue_set_recycling(q, t->unref, t->free);
+	for (int i = 0; i < WARMUP + ELEMENTS; i++) {
+		if (i == WARMUP)
+			n = atomic_load(&allocations);
+		queue_append(q, produce(q, t));
+		queue_append(q, produce(q, t));
+		queue_recycle(q, queue_extract(q));
+	}
+	n = atomic_load(&allocations) - n;
+	if (n)
+		fail("latest replace", t, n);
+	if (queue_dropped(q) != WARMUP + ELEMENTS)
+		exit(EXIT_FAILURE);
+	finish(q);
+}
+
+typedef struct producer {
+	Queue *q;
+	const element_type *t;
+	atomic_int start;
+} producer;
+
+static int producer_thread(void *ptr)
+{
+	producer *p = ptr;
+
+	while (!atomic_load(&p->start))
+		;
+	for (int i = 0; i < ELEMENTS; i++)
+		queue_append(p->q, produce(p->q, p->t));
+	queue_append(p->q, NULL);
+	return 0;
+}
+
+/**
+ * Producer and consumer run freely in two threads. Elements are only
+ * allocated while none wait for reuse, so at most every element that
+ * can exist at once is allocated, and nothing else.
+ */
+static void test_threads(const element_type *t)
+{
+	producer p;
+	SDL_Thread *thread;
+	unsigned long n;
+	void *item;
+
+	p.q = queue_init(CAPACITY);
+	p.t = t;
+	atomic_init(&p.start, 0);
+	queue_set_recycling(p.q, t->unref, t->free);
+	thread = SDL_CreateThread(producer_thread, "producer", &p);
+	if (!thread)
+		exit(EXIT_FAILURE);
+
+	n = atomic_load(&allocations);
+	atomic_store(&p.start, 1);
+	while ((item = queue_extract(p.q)))
+		queue_recycle(p.q, item);
+	n = atomic_load(&allocations) - n;
+	SDL_WaitThread(thread, NULL);
+	if (n > CAPACITY + 2)
+		fail("threads", t, n);
+	queue_free(&p.q);
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		test_lockstep(&types[i], 0);
+		test_lockstep(&types[i], 1);
+		test_replace(&types[i]);
+		test_threads(&types[i]);
+		printf("alloc: %s recycled without allocating\n", types[i].name);
+	}
+	return EXIT_SUCCESS;
+}
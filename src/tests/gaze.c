@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sends gaze samples through the packet format of the back-channel and the
+ * bookkeeping of the receiver, without sockets: round trips, reordered,
+ * duplicate and corrupted packets, loss counting across the wraparound of the
+ * sequence number and the mapping to the local clock.
+ */
+
+#include "net.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SKEW 5000000 // client clock behind ours in microseconds
+#define TRANSIT 2000 // shortest transit in microseconds
+
+static void check(int cond, const char *test, const char *what)
+{
+	if (cond)
+		return;
+	fprintf(stderr, "FAIL %s: %s\n", test, what);
+	exit(EXIT_FAILURE);
+}
+
+static void check_counters(const gaze_rx *rx, const char *test, uint64_t received,
+			   uint64_t lost, uint64_t stale, uint64_t invalid)
+{
+	if (rx->received == received && rx->lost == lost && rx->stale == stale &&
+	    rx->invalid == invalid)
+		return;
+	fprintf(stderr, "FAIL %s: received %"PRIu64" lost %"PRIu64" stale %"PRIu64
+		" invalid %"PRIu64", expected %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+		test, rx->received, rx->lost, rx->stale, rx->invalid,
+		received, lost, stale, invalid);
+	exit(EXIT_FAILURE);
+}
+
+static void rx_init(gaze_rx *rx)
+{
+	memset(rx, 0, sizeof(*rx));
+	gaze_clock_init(&rx->clock);
+}
+
+static gaze_sample sample(uint32_t seq)
+{
+	gaze_sample s = {
+		.seq = seq,
+		.flags = seq % 3,
+		.time = 1000 * (int64_t) seq,
+		.x = seq * 0.25f,
+		.y = -0.5f,
+		.distance = 600.0f,
+	};
+
+	return s;
+}
+
+/**
+ * Pack a sample and feed it to the receiver.
+ * @return see gaze_receive
+ */
+static int deliver(gaze_rx *rx, gaze_sample *out, uint32_t seq)
+{
+	uint8_t buf[GAZE_PACKET_SIZE];
+	gaze_sample s = sample(seq);
+
+	gaze_pack(buf, &s);
+	return gaze_receive(rx, out, buf, sizeof(buf), s.time + TRANSIT);
+}
+
+static void test_round_trip(void)
+{
+	uint8_t buf[GAZE_PACKET_SIZE];
+	gaze_sample in = sample(7), out;
+
+	in.x = 0.123456f;
+	in.time = -42;
+	// flags are 16 bits on the wire
+	in.flags = 0xbeef;
+	gaze_pack(buf, &in);
+	check(gaze_unpack(&out, buf, sizeof(buf)) == 0, "round trip", "unpack failed");
+	check(out.seq == in.seq && out.flags == in.flags && out.time == in.time &&
+	      out.x == in.x && out.y == in.y && out.distance == in.distance,
+	      "round trip", "sample changed");
+}
+
+static void test_corrupted(void)
+{
+	uint8_t buf[GAZE_PACKET_SIZE + 1], bad[GAZE_PACKET_SIZE + 1];
+	gaze_sample s = sample(1), out;
+	gaze_rx rx;
+
+	rx_init(&rx);
+	gaze_pack(buf, &s);
+	buf[GAZE_PACKET_SIZE] = 0;
+
+	check(!gaze_receive(&rx, &out, buf, GAZE_PACKET_SIZE - 1, 0), "corrupted", "truncated");
+	check(!gaze_receive(&rx, &out, buf, GAZE_PACKET_SIZE + 1, 0), "corrupted", "oversize");
+	check(!gaze_receive(&rx, &out, buf, 0, 0), "corrupted", "empty");
+	memcpy(bad, buf, sizeof(bad));
+	bad[0] ^= 1;
+	check(!gaze_receive(&rx, &out, bad, GAZE_PACKET_SIZE, 0), "corrupted", "magic");
+	memcpy(bad, buf, sizeof(bad));
+	bad[5]++;
+	check(!gaze_receive(&rx, &out, bad, GAZE_PACKET_SIZE, 0), "corrupted", "version");
+	check_counters(&rx, "corrupted", 0, 0, 0, 5);
+
+	// rejected packets leave the sequence alone
+	check(gaze_receive(&rx, &out, buf, GAZE_PACKET_SIZE, s.time), "corrupted", "valid");
+	check_counters(&rx, "corrupted", 1, 0, 0, 5);
+}
+
+static void test_order(void)
+{
+	gaze_sample out;
+	gaze_rx rx;
+
+	rx_init(&rx);
+	// the first packet starts the sequence wherever it is
+	check(deliver(&rx, &out, 100), "order", "first");
+	check(out.seq == 100, "order", "first seq");
+	check(deliver(&rx, &out, 101), "order", "next");
+	// 102 and 103 lost or late
+	check(deliver(&rx, &out, 104), "order", "after gap");
+	check_counters(&rx, "order", 3, 2, 0, 0);
+	// late and duplicate packets are older than the newest, dropped
+	check(!deliver(&rx, &out, 103), "order", "reordered");
+	check(!deliver(&rx, &out, 104), "order", "duplicate");
+	check(!deliver(&rx, &out, 50), "order", "old");
+	check_counters(&rx, "order", 3, 2, 3, 0);
+	check(rx.last_seq == 104, "order", "last seq");
+}
+
+static void test_wraparound(void)
+{
+	gaze_sample out;
+	gaze_rx rx;
+
+	rx_init(&rx);
+	check(deliver(&rx, &out, UINT32_MAX - 1), "wraparound", "before");
+	check(deliver(&rx, &out, UINT32_MAX), "wraparound", "last");
+	check(deliver(&rx, &out, 1), "wraparound", "after");
+	check_counters(&rx, "wraparound", 3, 1, 0, 0);
+	check(!deliver(&rx, &out, 0), "wraparound", "reordered");
+	check(!deliver(&rx, &out, UINT32_MAX), "wraparound", "old");
+	check_counters(&rx, "wraparound", 3, 1, 2, 0);
+}
+
+static void test_clock(void)
+{
+	uint8_t buf[GAZE_PACKET_SIZE];
+	int64_t capture, arrival;
+	gaze_sample s, out;
+	gaze_rx rx;
+
+	rx_init(&rx);
+	for (uint32_t seq = 0; seq < 100; seq++) {
+		// captured on our clock, stamped on the client's
+		capture = 1000000 + 4000 * (int64_t) seq;
+		s = sample(seq);
+		s.time = capture - SKEW;
+		// the transit varies, the shortest one is unknown to the receiver
+		arrival = capture + TRANSIT + (seq % 7) * 1000;
+		gaze_pack(buf, &s);
+		check(gaze_receive(&rx, &out, buf, sizeof(buf), arrival), "clock", "dropped");
+		check(out.time <= arrival, "clock", "sample from the future");
+		if (seq >= 7 && out.time != capture + TRANSIT) {
+			fprintf(stderr, "FAIL clock: seq %"PRIu32" mapped to %"PRId64
+				", expected %"PRId64"\n", seq, out.time, capture + TRANSIT);
+			exit(EXIT_FAILURE);
+		}
+	}
+	check(rx.clock.offset == SKEW + TRANSIT, "clock", "offset");
+}
+
+int main(void)
+{
+	test_round_trip();
+	test_corrupted();
+	test_order();
+	test_wraparound();
+	test_clock();
+	printf("gaze: packets survive the back-channel\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Copyright (C) 2020 Oliver Wiedemann
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Streams a generated video from a server to a headless client on 127.0.0.1,
+# with the gaze of the client sent back to the encoder. Both must exit
+# cleanly and the client must present every frame of all runs of the server.
+#
+# usage: tests/loopback.sh [main [encoder]], run from src/
+
+MAIN=${1:-./main}
+ENCODER=${2:-mpeg4}
+FRAMES=30
+RUNS=10 # of the server, see main
+WIDTH=176
+HEIGHT=144
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+# gray frames of changing brightness, 4:2:0
+{
+	printf 'YUV4MPEG2 W%d H%d F25:1 Ip A1:1 C420jpeg\n' $WIDTH $HEIGHT
+	i=0
+	while [ $i -lt $FRAMES ]; do
+		printf 'FRAME\n'
+		head -c $((WIDTH * HEIGHT * 3 / 2)) /dev/zero |
+			tr '\000' "\\$(printf '%o' $((64 + i * 4)))"
+		i=$((i + 1))
+	done
+} > "$dir/video.y4m"
+
+FFOVEATED_SDP="$dir/stream.sdp" FFOVEATED_SERVE=rtp://127.0.0.1:5004 \
+FFOVEATED_GAZE_LISTEN=udp://127.0.0.1:5006 \
+	"$MAIN" "$dir/video.y4m" "$ENCODER" > "$dir/server.log" 2>&1 &
+server=$!
+
+# the server starts sending two seconds after writing the SDP
+i=0
+while [ ! -s "$dir/stream.sdp" ]; do
+	if [ $i -ge 100 ] || ! kill -0 $server 2>/dev/null; then
+		echo "loopback: server wrote no SDP" >&2
+		cat "$dir/server.log" >&2
+		kill $server 2>/dev/null
+		exit 1
+	fi
+	sleep 0.1
+	i=$((i + 1))
+done
+
+FFOVEATED_HEADLESS=realtime FFOVEATED_GAZE_SOURCE=synthetic \
+FFOVEATED_GAZE_SEND=udp://127.0.0.1:5006 \
+	"$MAIN" "$dir/stream.sdp" > "$dir/client.log" 2>&1
+client_rc=$?
+wait $server
+server_rc=$?
+
+presented=$(sed -n 's/^run 0: presented \([0-9]*\) frames.*/\1/p' "$dir/client.log")
+if [ $server_rc -ne 0 ] || [ $client_rc -ne 0 ] ||
+   [ "$presented" != $((FRAMES * RUNS)) ]; then
+	echo "loopback: server exited with $server_rc, client with $client_rc," \
+	     "presented ${presented:-no} of $((FRAMES * RUNS)) frames" >&2
+	echo "--- server" >&2
+	cat "$dir/server.log" >&2
+	echo "--- client" >&2
+	cat "$dir/client.log" >&2
+	exit 1
+fi
+echo "loopback: presented $presented frames streamed over 127.0.0.1"
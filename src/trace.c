@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include "pexit.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_RING_SIZE ((uint64_t) 1 << TRACE_RING_BITS)
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+static TraceRecord *ring;
+static atomic_uint_fast64_t ring_pos;
+static atomic_uint trace_run;
+static char *trace_path;
+
+static const char *stage_names[TRACE_NB_STAGES] = {
+	"read",
+	"src-decode-out",
+	"encode-submit",
+	"packet-out",
+	"fov-decode-out",
+	"present",
+};
+
+void trace_init(const char *path)
+{
+	if (!path || ring)
+		return;
+
+	ring = malloc(TRACE_RING_SIZE * sizeof(TraceRecord));
+	if (!ring)
+		pexit("malloc failed");
+	// touch every page now instead of on the hot path
+	memset(ring, 0, TRACE_RING_SIZE * sizeof(TraceRecord));
+
+	trace_path = strdup(path);
+	if (!trace_path)
+		pexit("strdup failed");
+
+	atomic_init(&ring_pos, 0);
+	atomic_init(&trace_run, 0);
+
+	if (atexit(trace_dump))
+		pexit("atexit failed");
+}
+
+void trace_set_run(int run)
+{
+	atomic_store_explicit(&trace_run, run, memory_order_relaxed);
+}
+
+void trace_record(trace_stage stage, int64_t pts)
+{
+	struct timespec ts;
+	TraceRecord *r;
+	uint64_t pos;
+
+	if (!ring)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	// each thread owns the slot it reserved, no further synchronization
+	pos = atomic_fetch_add_explicit(&ring_pos, 1, memory_order_relaxed);
+	r = &ring[pos & TRACE_RING_MASK];
+	r->time = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	r->pts = (int32_t) pts;
+	r->run = atomic_load_explicit(&trace_run, memory_order_relaxed);
+	r->stage = stage;
+}
+
+void trace_dump(void)
+{
+	TraceHeader hdr;
+	FILE *f;
+	uint64_t end, start, first, n;
+	size_t written;
+
+	if (!ring)
+		return;
+
+	end = atomic_load(&ring_pos);
+	start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(TraceRecord);
+	hdr.lost = start;
+
+	f = fopen(trace_path, "wb");
+	if (!f) {
+		perror("trace: fopen failed");
+		return;
+	}
+
+	// the oldest record may sit anywhere in the ring, write it in two parts
+	first = start & TRACE_RING_MASK;
+	n = end - start;
+	written = fwrite(&hdr, sizeof(hdr), 1, f);
+	if (first + n > TRACE_RING_SIZE) {
+		written += fwrite(ring + first, sizeof(TraceRecord), TRACE_RING_SIZE - first, f);
+		written += fwrite(ring, sizeof(TraceRecord), first + n - TRACE_RING_SIZE, f);
+	} else {
+		written += fwrite(ring + first, sizeof(TraceRecord), n, f);
+	}
+	if (fclose(f) || written != n + 1) {
+		perror("trace: write failed");
+		return;
+	}
+	fprintf(stderr, "trace: wrote %llu records to %s\n",
+		(unsigned long long) n, trace_path);
+}
+
+const char *trace_stage_name(int stage)
+{
+	if (stage < 0 || stage >= TRACE_NB_STAGES)
+		return "unknown";
+	return stage_names[stage];
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <stdint.h>
+
+#define TRACE_MAGIC "FOVTRACE"
+#define TRACE_VERSION 1
+
+// log2 of the number of records kept, older records are overwritten
+#define TRACE_RING_BITS 20
+
+// pipeline stages a frame passes, in order
+typedef enum {
+	TRACE_READ,           // packet demuxed by the reader
+	TRACE_SRC_DECODED,    // frame emitted by the source decoder
+	TRACE_ENCODE_SUBMIT,  // frame passed to the foveated encoder
+	TRACE_PACKET_OUT,     // packet emitted by the foveated encoder
+	TRACE_FOV_DECODED,    // frame emitted by the foveated decoder
+	TRACE_PRESENT,        // frame presented by the display
+	TRACE_NB_STAGES,
+} trace_stage;
+
+/**
+ * One trace event, 16 bytes in memory and on disk.
+ *
+ * Frames are identified by run and pts, which are kept along the pipeline.
+ * The pts is truncated to 32 bits.
+ */
+typedef struct TraceRecord {
+	int64_t time;   // CLOCK_MONOTONIC in nanoseconds
+	int32_t pts;
+	uint16_t run;
+	uint16_t stage;
+} TraceRecord;
+
+/**
+ * Header of a trace file, followed by the records in order of recording.
+ */
+typedef struct TraceHeader {
+	char magic[8];        // TRACE_MAGIC without the terminating nullbyte
+	uint32_t version;     // TRACE_VERSION
+	uint32_t record_size; // sizeof(TraceRecord)
+	uint64_t lost;        // records overwritten before the dump
+} TraceHeader;
+
+/**
+ * Enable tracing.
+ *
+ * Allocates and prefaults the record ring, so recording never allocates or
+ * page faults. The ring is written to path when the process exits, also
+ * through pexit or a signal handler calling exit.
+ * Must be called before any thread records.
+ * @param path file to dump the records to, tracing stays disabled if NULL.
+ */
+void trace_init(const char *path);
+
+/**
+ * Set the run number stored with subsequent records.
+ *
+ * Must be called while no pipeline thread records, e.g. between runs.
+ * @param run number of the current run of the video
+ */
+void trace_set_run(int run);
+
+/**
+ * Record that the frame with the given pts passed a stage.
+ *
+ * Lock-free and safe to call from any thread, costs a clock read and an
+ * atomic increment. Does nothing if tracing is disabled.
+ * @param stage the stage that was just passed
+ * @param pts presentation timestamp of the frame or packet
+ */
+void trace_record(trace_stage stage, int64_t pts);
+
+/**
+ * Write all records in the ring to the path given to trace_init.
+ *
+ * Called after every run and at exit, the file is replaced each time.
+ * Records written concurrently may be incomplete.
+ */
+void trace_dump(void);
+
+/**
+ * Name of a stage for reports.
+ * @param stage stage to name
+ * @return static string, "unknown" for invalid stages
+ */
+const char *trace_stage_name(int stage);
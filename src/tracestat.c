@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include "pexit.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// latency between consecutive stages, plus one from read to present
+#define NB_SPANS TRACE_NB_STAGES
+
+typedef struct span {
+	int64_t *values;
+	size_t count;
+} span;
+
+void display_usage(char *progname)
+{
+	printf("report per stage latency percentiles of a trace file\n");
+	printf("usage:\n$ %s tracefile\n", progname);
+}
+
+static int cmp_record(const void *a, const void *b)
+{
+	const TraceRecord *ra = a, *rb = b;
+
+	if (ra->run != rb->run)
+		return ra->run < rb->run ? -1 : 1;
+	if (ra->pts != rb->pts)
+		return ra->pts < rb->pts ? -1 : 1;
+	if (ra->stage != rb->stage)
+		return ra->stage < rb->stage ? -1 : 1;
+	if (ra->time != rb->time)
+		return ra->time < rb->time ? -1 : 1;
+	return 0;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+	int64_t va = *(const int64_t *) a, vb = *(const int64_t *) b;
+
+	return (va > vb) - (va < vb);
+}
+
+/**
+ * Read a trace file written by trace_dump.
+ *
+ * Calls pexit in case of a failure.
+ * @param path trace file to read
+ * @param count receives the number of records
+ * @param lost receives the number of records lost to ring overflow
+ * @return heap-allocated array of count records
+ */
+static TraceRecord *read_trace(const char *path, size_t *count, uint64_t *lost)
+{
+	TraceHeader hdr;
+	TraceRecord *records;
+	FILE *f;
+	long size;
+
+	f = fopen(path, "rb");
+	if (!f)
+		pexit("fopen failed");
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+		pexit("trace header missing");
+	if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != TRACE_VERSION || hdr.record_size != sizeof(TraceRecord))
+		pexit("not a trace file of this version");
+
+	if (fseek(f, 0, SEEK_END))
+		pexit("unable to determine the trace size");
+	size = ftell(f);
+	if (size < 0)
+		pexit("unable to determine the trace size");
+	*count = (size - sizeof(hdr)) / sizeof(TraceRecord);
+	if (fseek(f, sizeof(hdr), SEEK_SET))
+		pexit("fseek failed");
+
+	records = malloc((*count ? *count : 1) * sizeof(TraceRecord));
+	if (!records)
+		pexit("malloc failed");
+	if (fread(records, sizeof(TraceRecord), *count, f) != *count)
+		pexit("fread failed");
+
+	fclose(f);
+	*lost = hdr.lost;
+	return records;
+}
+
+static void span_add(span *s, int64_t value)
+{
+	s->values[s->count++] = value;
+}
+
+/**
+ * Nearest-rank percentile of sorted values.
+ */
+static int64_t percentile(const span *s, double p)
+{
+	size_t rank = (size_t) (p / 100 * s->count + 0.5);
+
+	if (rank < 1)
+		rank = 1;
+	if (rank > s->count)
+		rank = s->count;
+	return s->values[rank - 1];
+}
+
+static void print_span(const char *name, span *s)
+{
+	const double ms = 1e6;
+
+	if (!s->count) {
+		printf("%-34s %8d\n", name, 0);
+		return;
+	}
+	qsort(s->values, s->count, sizeof(int64_t), cmp_int64);
+	printf("%-34s %8zu %8.3f %8.3f %8.3f %8.3f %8.3f\n", name, s->count,
+		percentile(s, 50) / ms, percentile(s, 90) / ms,
+		percentile(s, 99) / ms, percentile(s, 99.9) / ms,
+		s->values[s->count - 1] / ms);
+}
+
+int main(int argc, char **argv)
+{
+	TraceRecord *records;
+	span spans[NB_SPANS];
+	int64_t t[TRACE_NB_STAGES];
+	char name[64];
+	size_t count, frames, unpresented;
+	size_t i, j;
+	uint64_t lost;
+	int s;
+
+	if (argc != 2) {
+		display_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	records = read_trace(argv[1], &count, &lost);
+	qsort(records, count, sizeof(TraceRecord), cmp_record);
+
+	for (s = 0; s < NB_SPANS; s++) {
+		spans[s].values = malloc((count ? count : 1) * sizeof(int64_t));
+		if (!spans[s].values)
+			pexit("malloc failed");
+		spans[s].count = 0;
+	}
+
+	frames = 0;
+	unpresented = 0;
+	for (i = 0; i < count; i = j) {
+		// records of one frame are adjacent, keep the first time per stage
+		for (s = 0; s < TRACE_NB_STAGES; s++)
+			t[s] = -1;
+		for (j = i; j < count && records[j].run == records[i].run &&
+		     records[j].pts == records[i].pts; j++)
+			if (records[j].stage < TRACE_NB_STAGES && t[records[j].stage] < 0)
+				t[records[j].stage] = records[j].time;
+
+		frames++;
+		if (t[TRACE_FOV_DECODED] >= 0 && t[TRACE_PRESENT] < 0)
+			unpresented++;
+
+		for (s = 0; s + 1 < TRACE_NB_STAGES; s++)
+			if (t[s] >= 0 && t[s + 1] >= 0)
+				span_add(&spans[s], t[s + 1] - t[s]);
+		if (t[TRACE_READ] >= 0 && t[TRACE_PRESENT] >= 0)
+			span_add(&spans[NB_SPANS - 1], t[TRACE_PRESENT] - t[TRACE_READ]);
+	}
+
+	printf("%zu records, %zu frames, %zu decoded but not presented",
+		count, frames, unpresented);
+	if (lost)
+		printf(", %"PRIu64" records lost to ring overflow", lost);
+	printf("\n\n%-34s %8s %8s %8s %8s %8s %8s\n", "latency [ms]", "frames",
+		"p50", "p90", "p99", "p99.9", "max");
+
+	for (s = 0; s + 1 < TRACE_NB_STAGES; s++) {
+		snprintf(name, sizeof(name), "%s -> %s",
+			trace_stage_name(s), trace_stage_name(s + 1));
+		print_span(name, &spans[s]);
+	}
+	print_span("glass-to-glass (read -> present)", &spans[NB_SPANS - 1]);
+
+	for (s = 0; s < NB_SPANS; s++)
+		free(spans[s].values);
+	free(records);
+	return EXIT_SUCCESS;
+}
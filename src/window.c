@@ -16,15 +16,28 @@
  */
 
 #include "window.h"
+#include "et.h"
 #include "pexit.h"
+#include "trace.h"
 #include <inttypes.h>
+#include <libavutil/cpu.h>
+#include <string.h>
 
-win_ctx *window_init()
+static win_ctx *report_wc;
+
+// print the statistics of all runs, also on pexit
+static void report_total(void)
+{
+	sched_report("all runs", &report_wc->sched.total);
+}
+
+win_ctx *window_init(late_policy policy)
 {
 	win_ctx *wc;
 	SDL_Window *window;
 	Uint32 flags;
 	SDL_Renderer *renderer;
+	SDL_RendererInfo info;
 	SDL_DisplayMode dm;
 	int disp_index;
 
@@ -41,8 +54,11 @@ win_ctx *window_init()
 	disp_index = SDL_GetWindowDisplayIndex(window);
 	SDL_GetDesktopDisplayMode(disp_index, &dm);
 
-	renderer = SDL_CreateRenderer(window, -1, 0);
+	// presenting returns at the vsync, which tells the scheduler its phase
+	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
 	if (!renderer)
+		renderer = SDL_CreateRenderer(window, -1, 0);
+	if (!renderer || SDL_GetRendererInfo(renderer, &info))
 		pexit(SDL_GetError());
 
 	wc = malloc(sizeof(win_ctx));
@@ -50,9 +66,19 @@ win_ctx *window_init()
 		pexit("malloc failed");
 	wc->window = window;
 	wc->texture = NULL;
-	wc->queues_active= 0;
-	wc->queue_mutex = SDL_CreateMutex();
-	wc->queue_cond = SDL_CreateCond();
+	wc->frames = NULL;
+	wc->eos = 1;
+	for (int i = 0; i < WINDOW_TEXTURES; i++) {
+		wc->slots[i].texture = NULL;
+		atomic_init(&wc->slots[i].busy, 0);
+	}
+	atomic_init(&wc->slots_ready, 0);
+	wc->slots_failed = 0;
+	sched_init(&wc->sched, dm.refresh_rate, !!(info.flags & SDL_RENDERER_PRESENTVSYNC),
+		   policy, PRESENT_START_DELAY);
+
+	report_wc = wc;
+	atexit(report_total);
 	return wc;
 }
 
@@ -90,12 +116,168 @@ static void realloc_texture(win_ctx *wc, AVFrame *frame)
 
 	wc->texture = SDL_CreateTexture(SDL_GetRenderer(wc->window),
 										   SDL_PIXELFORMAT_YV12,
-										   SDL_TEXTUREACCESS_TARGET,
+										   SDL_TEXTUREACCESS_STREAMING,
 										   frame->width, frame->height);
 	if (!wc->texture)
 		pexit("SDL_CreateTexture failed");
 }
 
+/**
+ * Check whether the streaming textures of a renderer keep their memory.
+ *
+ * Reference frames stay in slots while they are displayed, so the texture
+ * memory must neither move nor lose its contents between locks. The OpenGL
+ * and software renderers of SDL lock a buffer allocated with the texture and
+ * upload it on unlock, others may hand out new memory on every lock.
+ * @return 1 if texture memory persists across locks, 0 otherwise
+ */
+static int persistent_textures(SDL_Renderer *ren)
+{
+	static const char *const names[] = {"opengl", "opengles2", "opengles", "software"};
+	SDL_RendererInfo info;
+
+	if (SDL_GetRendererInfo(ren, &info))
+		return 0;
+	for (size_t i = 0; i < FF_ARRAY_ELEMS(names); i++)
+		if (!strcmp(info.name, names[i]))
+			return 1;
+	return 0;
+}
+
+/**
+ * Create and lock the texture of a slot, check that the decoder can use it.
+ * @return NULL on success, otherwise the reason the slot is unusable
+ */
+static const char *lock_slot(win_ctx *wc, tex_slot *slot)
+{
+	size_t align = av_cpu_max_align();
+
+	slot->texture = SDL_CreateTexture(SDL_GetRenderer(wc->window),
+					  SDL_PIXELFORMAT_IYUV,
+					  SDL_TEXTUREACCESS_STREAMING,
+					  wc->tex_width, wc->tex_height);
+	if (!slot->texture)
+		return SDL_GetError();
+	if (SDL_LockTexture(slot->texture, NULL, (void **) &slot->pixels, &slot->pitch))
+		return SDL_GetError();
+	// chroma planes have half the pitch and follow the luma plane
+	if ((uintptr_t) slot->pixels % align || slot->pitch % (2 * align))
+		return "texture memory is not aligned";
+	return NULL;
+}
+
+/**
+ * Create the texture slots for frames the size of f, see window_get_buffer.
+ *
+ * Decoding into textures stays disabled if the renderer does not support it.
+ * @param wc window context to create the slots for
+ * @param f first frame to be displayed
+ */
+static void create_slots(win_ctx *wc, AVFrame *f)
+{
+	const char *err = "frames are not yuv420p";
+	int i;
+
+	wc->slots_failed = 1;
+	if (f->format != AV_PIX_FMT_YUV420P)
+		goto fail;
+	err = "the renderer may move texture memory between locks";
+	if (!persistent_textures(SDL_GetRenderer(wc->window)))
+		goto fail;
+
+	// room for the padding of avcodec_align_dimensions2
+	wc->tex_width = FFALIGN(f->width, 128);
+	wc->tex_height = FFALIGN(f->height, 64) + 2;
+	for (i = 0; i < WINDOW_TEXTURES; i++)
+		if ((err = lock_slot(wc, &wc->slots[i])))
+			goto fail;
+
+	wc->slot_width = f->width;
+	wc->slot_height = f->height;
+	wc->slots_failed = 0;
+	atomic_store(&wc->slots_ready, 1);
+	return;
+
+fail:
+	for (i = 0; i < WINDOW_TEXTURES; i++) {
+		if (wc->slots[i].texture)
+			SDL_DestroyTexture(wc->slots[i].texture);
+		wc->slots[i].texture = NULL;
+	}
+	fprintf(stderr, "decoding into textures disabled: %s\n", err);
+}
+
+static void release_slot(void *opaque, uint8_t *data)
+{
+	tex_slot *slot = opaque;
+
+	(void) data;
+	atomic_store(&slot->busy, 0);
+}
+
+int window_get_buffer(AVCodecContext *avctx, AVFrame *frame, int flags)
+{
+	win_ctx *wc = avctx->opaque;
+	int linesize_align[AV_NUM_DATA_POINTERS];
+	int w = frame->width;
+	int h = frame->height;
+	tex_slot *slot = NULL;
+	size_t luma;
+
+	if (!atomic_load(&wc->slots_ready) || frame->format != AV_PIX_FMT_YUV420P ||
+	    frame->width != wc->slot_width || frame->height != wc->slot_height)
+		return avcodec_default_get_buffer2(avctx, frame, flags);
+
+	avcodec_align_dimensions2(avctx, &w, &h, linesize_align);
+	if (w > wc->tex_width || h > wc->tex_height)
+		return avcodec_default_get_buffer2(avctx, frame, flags);
+
+	for (int i = 0; i < WINDOW_TEXTURES && !slot; i++)
+		if (!atomic_exchange(&wc->slots[i].busy, 1))
+			slot = &wc->slots[i];
+	if (!slot)
+		return avcodec_default_get_buffer2(avctx, frame, flags);
+	if (slot->pitch % linesize_align[0] || (slot->pitch / 2) % linesize_align[1] ||
+	    (slot->pitch / 2) % linesize_align[2]) {
+		atomic_store(&slot->busy, 0);
+		return avcodec_default_get_buffer2(avctx, frame, flags);
+	}
+
+	luma = (size_t) slot->pitch * wc->tex_height;
+	frame->buf[0] = av_buffer_create(slot->pixels, luma + luma / 2,
+					 release_slot, slot, 0);
+	if (!frame->buf[0]) {
+		atomic_store(&slot->busy, 0);
+		return AVERROR(ENOMEM);
+	}
+
+	// planes of an IYUV texture: Y, then U and V at half pitch and height
+	frame->data[0] = slot->pixels;
+	frame->data[1] = slot->pixels + luma;
+	frame->data[2] = frame->data[1] + luma / 4;
+	frame->linesize[0] = slot->pitch;
+	frame->linesize[1] = slot->pitch / 2;
+	frame->linesize[2] = slot->pitch / 2;
+	frame->extended_data = frame->data;
+	return 0;
+}
+
+/**
+ * Slot a frame was decoded into by window_get_buffer, NULL if none.
+ */
+static tex_slot *frame_slot(win_ctx *wc, AVFrame *f)
+{
+	void *opaque;
+
+	if (!f->buf[0] || f->buf[1])
+		return NULL;
+	opaque = av_buffer_get_opaque(f->buf[0]);
+	for (int i = 0; i < WINDOW_TEXTURES; i++)
+		if (opaque == &wc->slots[i] && wc->slots[i].texture)
+			return &wc->slots[i];
+	return NULL;
+}
+
 /**
  * Calculate a centered rectangle within a window with a suitable aspect ratio.
  *
@@ -136,48 +318,13 @@ static void center_rect(SDL_Rect *rect, win_ctx *wc, AVFrame *f)
 
 void flush_window_source(win_ctx *wc)
 {
-	void *p;
 	AVFrame *f;
 
-	while ((p = queue_extract(wc->timestamps)))
-		free(p);
-	queue_free(&wc->timestamps);
+	if (wc->eos)
+		return;
 	while ((f = queue_extract(wc->frames)))
-		av_frame_free(&f);
-	queue_free(&wc->frames);
-}
-
-static int queue_flusher(void *p)
-{
-
-	win_ctx *w = (win_ctx *) p;
-	Queue *frames;
-	Queue *timestamps;
-	AVFrame *f;
-	int64_t *t;
-
-	SDL_LockMutex(w->queue_mutex);
-	frames = w->frames;
-	timestamps = w->timestamps;
-
-	/* okay to overwrite, decoder has it's own copy for appending*/
-	w->frames = NULL;
-	w->timestamps = NULL;
-	w->queues_active = 0;
-
-	SDL_UnlockMutex(w->queue_mutex);
-	SDL_CondSignal(w->queue_cond);
-
-	while ((f = queue_extract(frames)))
-		av_frame_free(&f);
-
-	while ((t = queue_extract(timestamps)))
-		free(t);
-
-	queue_free(&frames);
-	queue_free(&timestamps);
-
-	return 0;
+		queue_recycle(wc->frames, f);
+	wc->eos = 1;
 }
 
 void pause(SDL_Window *w)
@@ -194,95 +341,95 @@ int frame_refresh(win_ctx *wc)
 {
 	AVFrame *f;
 	SDL_Renderer *ren;
-	SDL_Rect rect;
-	SDL_Thread *flusher;
-
-	int64_t upts; // presentation time in micro seconds
-	int64_t uremaining; //remaining time in micro seconds
-
-	int64_t *enc_time;//encoding time
-	int64_t now;
-	#ifdef DEBUG
-	int64_t delta;
-	#endif
+	SDL_Texture *texture;
+	SDL_Rect rect, src;
+	tex_slot *slot;
+	void *pixels;
+	int pitch;
+	int64_t target; // vsync to present at in microseconds
 
 	f = queue_extract(wc->frames);
 	if (!f) {
 		printf("frame refresh returns 1\n");
-		SDL_LockMutex(wc->queue_mutex);
-		queue_free(&wc->frames);
-		queue_free(&wc->timestamps);
-		wc->queues_active = 0;
-		SDL_UnlockMutex(wc->queue_mutex);
-		SDL_CondSignal(wc->queue_cond);
-
+		printf("dropped %"PRIu64" stale frames\n",
+			queue_dropped(wc->frames) - wc->dropped_start);
+		sched_report("run", &wc->sched.run);
+		wc->eos = 1;
 		return 1;
 	}
-	enc_time = queue_extract(wc->timestamps);
-
 
 	ren = SDL_GetRenderer(wc->window);
 	SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
-	SDL_RenderClear(ren);
 
 	if (wc->abort) {
+		SDL_RenderClear(ren);
 		SDL_RenderPresent(ren);
-		flusher = SDL_CreateThread(queue_flusher, "flusher", wc);
-		SDL_DetachThread(flusher);
+		queue_recycle(wc->frames, f);
+		// the remaining frames are left for flush_window_source
 		return 1;
 	}
 
-	realloc_texture(wc, f);
-	SDL_UpdateYUVTexture(wc->texture, NULL,
-						f->data[0], f->linesize[0],
-						f->data[1], f->linesize[1],
-						f->data[2], f->linesize[2]);
-	center_rect(&rect, wc, f);
-	SDL_RenderCopy(ren, wc->texture, NULL, &rect);
-	now = av_gettime_relative();
-
-	//add an initial delay bc we won't be able to display at 0
-	if (wc->time_start == -1)
-		wc->time_start = now + 100000;
+	target = sched_target(&wc->sched, f->pts, queue_length(wc->frames) > 0);
+	if (target < 0) {
+		// too late for its vsync and already superseded
+		queue_recycle(wc->frames, f);
+		return 0;
+	}
+	SDL_RenderClear(ren);
 
-	//XXX: is the factor 2 here necessary? Can't find this in the docs, but it works consistently...
-	upts = (2 * 1000000 * f->pts * wc->time_base.num) / wc->time_base.den; //pts relative to zero
-	uremaining = wc->time_start + upts - now;
+	if (!atomic_load(&wc->slots_ready) && !wc->slots_failed)
+		create_slots(wc, f);
+
+	slot = frame_slot(wc, f);
+	if (slot) {
+		// the frame was decoded into the texture, just upload it
+		SDL_UnlockTexture(slot->texture);
+		texture = slot->texture;
+	} else {
+		realloc_texture(wc, f);
+		SDL_UpdateYUVTexture(wc->texture, NULL,
+							f->data[0], f->linesize[0],
+							f->data[1], f->linesize[1],
+							f->data[2], f->linesize[2]);
+		texture = wc->texture;
+	}
+	src.x = 0;
+	src.y = 0;
+	src.w = f->width;
+	src.h = f->height;
+	center_rect(&rect, wc, f);
+	SDL_RenderCopy(ren, texture, &src, &rect);
 
 	#ifdef DEBUG
-	delta = now - *enc_time;
-	printf("rem: %"PRId64", upts: %"PRIdMAX ", now: %"PRId64", delta: %"PRId64 "\n", uremaining, upts, now, delta);
+	printf("pts: %"PRId64", target in: %"PRId64"\n", f->pts, target - av_gettime_relative());
 	#endif
 
-	if (uremaining > 0)
-		av_usleep(uremaining);
-	/*
-	else
-		pexit("presentation lag");
-	*/
-
+	sched_wait(&wc->sched, target);
 	SDL_RenderPresent(ren);
-	av_frame_free(&f);
-	free(enc_time);
+	sched_presented(&wc->sched, f->pts, target, av_gettime_relative());
+	trace_record(TRACE_PRESENT, f->pts);
+	gaze_presented(f->pts);
+	// mouse and eye-tracker are mapped to the presented frame
+	set_gaze_view(wc->window, f->width, f->height);
+	set_gaze_clock(target - wc->sched.time_start);
+	if (slot) {
+		if (SDL_LockTexture(slot->texture, NULL, &pixels, &pitch))
+			pexit(SDL_GetError());
+		// the decoder still references the memory, see persistent_textures
+		if (pixels != slot->pixels)
+			pexit("texture memory moved");
+	}
+	queue_recycle(wc->frames, f);
 	return 0;
 }
 
-void set_window_source(win_ctx *wc, Queue *frames, Queue *timestamps, AVRational time_base)
+void set_window_source(win_ctx *wc, Queue *frames, AVRational time_base)
 {
 
-	if(SDL_LockMutex(wc->queue_mutex))
-		pexit(SDL_GetError());
-
-	if (wc->queues_active)
-		SDL_CondWait(wc->queue_cond, wc->queue_mutex);
-
 	wc->frames = frames;
-	wc->timestamps = timestamps;
+	wc->dropped_start = queue_dropped(frames);
+	wc->eos = 0;
 	wc->time_base = time_base;
-	wc->time_start = -1;
+	sched_start(&wc->sched, time_base);
 	wc->abort = 0;
-	wc->queues_active = 1;
-
-	if(SDL_UnlockMutex(wc->queue_mutex))
-		pexit(SDL_GetError());
 }
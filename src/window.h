@@ -16,24 +16,47 @@
  */
 
 #pragma once
+#include "present.h"
 #include "queue.h"
+#include <stdatomic.h>
 #include <SDL2/SDL.h>
+#include <libavcodec/avcodec.h>
 #include <libavutil/frame.h>
 #include <libavutil/rational.h>
 #include <libavutil/time.h>
 
+// streaming textures the foveated decoder can decode into, see window_get_buffer
+#define WINDOW_TEXTURES 8
+
+/**
+ * Streaming texture kept locked while it is free or being decoded into,
+ * so the decoder writes straight to the memory the renderer uploads from.
+ */
+typedef struct tex_slot {
+	SDL_Texture *texture;
+	uint8_t *pixels; // planes of an IYUV texture, stable across locks
+	int pitch;
+	atomic_int busy; // referenced by a frame
+} tex_slot;
+
 // Passed to window_thread through SDL_CreateThread
 typedef struct win_ctx {
 	Queue *frames;
-	Queue *timestamps;
-	int queues_active;
-	SDL_mutex *queue_mutex;
-	SDL_cond *queue_cond;
+	uint64_t dropped_start; // stale frames dropped before the current video
+	int eos; // the terminating NULL has been extracted from frames
 	SDL_Window *window;
-	SDL_Texture *texture;
-	int64_t time_start;
+	SDL_Texture *texture; // for frames not decoded into a slot
+	scheduler sched;
 	AVRational time_base;
 	int abort;
+
+	tex_slot slots[WINDOW_TEXTURES];
+	int slot_width;  // frame size the slots were created for
+	int slot_height;
+	int tex_width;   // padded texture size
+	int tex_height;
+	atomic_int slots_ready; // set once the slots can be handed out
+	int slots_failed; // the renderer does not support decoding into textures
 } win_ctx;
 
 /**
@@ -43,37 +66,59 @@ typedef struct win_ctx {
  * The texture member is initialized to NULL and has to be handled with respect
  * to an AVFrame through the realloc_texture function!
  *
+ * Frames are presented on the vsyncs of the display, see scheduler. The
+ * statistics of all runs are printed when the process exits.
  * Calls pexit in case of a failure.
+ * @param policy what to do with frames that miss their vsync
  * @return window_context with initialized defaults
  */
-win_ctx *window_init();
+win_ctx *window_init(late_policy policy);
+
+/**
+ * get_buffer2 callback for the foveated decoder, see set_fov_get_buffer.
+ *
+ * Once the window has displayed a first yuv420p frame, it creates a set of
+ * streaming textures of that size. Subsequent frames are decoded straight into
+ * one of them, which frame_refresh then only unlocks and renders. Frames are
+ * allocated by avcodec_default_get_buffer2 while no texture is free, for other
+ * formats or sizes, or if the renderer may move texture memory between locks.
+ * @param avctx decoder, avctx->opaque must be the win_ctx
+ * @param frame see AVCodecContext.get_buffer2
+ * @param flags see AVCodecContext.get_buffer2
+ * @return 0 on success, a negative AVERROR on failure
+ */
+int window_get_buffer(AVCodecContext *avctx, AVFrame *frame, int flags);
 
 /**
  * Display the next frame in the queue to the window.
  *
  * Dequeue the next frame from w_ctx->frame_queue, render it to w_ctx->window
  * in a centered rectangle, adding black bars for undefined regions.
+ * Frames decoded into a texture are rendered without copying, others are
+ * uploaded. Displayed frames are recycled through the queue.
  *
  * @param w_ctx supplying the window and frame_queue
- * @return 0 on success, 1 if the frame_queue is drained (returned NULL).
+ * @return 0 on success, 1 if the frame_queue is drained (returned NULL) or
+ * the window has been aborted, see flush_window_source.
  */
 int frame_refresh(win_ctx *w_ctx);
 
 /**
- * Update a window in order to display a new input video.
+ * Update a window in order to display a new input video or run.
  *
- * Set frame and timestamp queues, set the time_base to match the new input videos
+ * Call flush_window_source before switching from a previous source.
+ * Set the frame queue, set the time_base to match the new input videos
  * time_base and set the start_time to -1.
  * @param wc window context to update
  * @param frames new input queue for frames to be displayed
- * @param timestamps new encoder timestamp queue
  * @param time_base new time base to display frames at correct pts
  */
-void set_window_source(win_ctx *wc, Queue *frames, Queue *timestamps, AVRational time_base);
+void set_window_source(win_ctx *wc, Queue *frames, AVRational time_base);
 
 /**
- * Empty and free all associated window input queues.
+ * Discard the remaining frames of the current source up to the terminating NULL.
  *
+ * The queue itself belongs to the producer and is not freed.
  * @param wc window context to flush
  */
 void flush_window_source(win_ctx *wc);
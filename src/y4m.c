@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "y4m.h"
+#include "pexit.h"
+#include <libavformat/avformat.h>
+#include <libavformat/yuv4mpeg.h>
+#include <libavutil/imgutils.h>
+#include <stdio.h>
+#include <string.h>
+
+// longest frame header accepted, as in yuv4mpegdec.c
+#define Y4M_FRAME_HEADER_MAX 80
+
+int y4m_probe(const char *path)
+{
+	char magic[sizeof(Y4M_MAGIC)];
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return 0;
+	ret = fread(magic, sizeof(magic), 1, f) == 1 &&
+	      !memcmp(magic, Y4M_MAGIC " ", sizeof(magic));
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Parse the stream header through the demuxer.
+ * Calls pexit in case of a failure.
+ * @return offset of the first frame header
+ */
+static int64_t read_stream_header(const char *path, cache_ctx *c,
+				  AVRational *time_base, AVRational *frame_rate)
+{
+	AVFormatContext *fctx = NULL;
+	AVInputFormat *fmt;
+	AVStream *st;
+	int64_t offset;
+
+	fmt = av_find_input_format("yuv4mpegpipe");
+	if (!fmt)
+		pexit("yuv4mpegpipe demuxer not available");
+	if (avformat_open_input(&fctx, path, fmt, NULL) < 0)
+		pexit("avformat_open_input failed");
+	if (fctx->nb_streams != 1)
+		pexit("unexpected number of streams in Y4M file");
+
+	st = fctx->streams[0];
+	c->width = st->codecpar->width;
+	c->height = st->codecpar->height;
+	c->pix_fmt = st->codecpar->format;
+	*time_base = st->time_base;
+	*frame_rate = st->avg_frame_rate;
+	// the demuxer stops right after the stream header
+	offset = avio_tell(fctx->pb);
+
+	avformat_close_input(&fctx);
+	return offset;
+}
+
+dec_ctx *y4m_source_init(const char *path, int queue_capacity)
+{
+	cache_ctx *c;
+	AVRational time_base, frame_rate;
+	const uint8_t *data, *end;
+	size_t size, capacity;
+	int frame_size;
+
+	c = malloc(sizeof(cache_ctx));
+	if (!c)
+		pexit("malloc failed");
+
+	size = read_stream_header(path, c, &time_base, &frame_rate);
+	frame_size = av_image_get_buffer_size(c->pix_fmt, c->width, c->height, 1);
+	if (frame_size < 0)
+		pexit("av_image_get_buffer_size failed");
+	c->align = 1;
+	c->frame_size = frame_size;
+
+	c->map = cache_map_file(path, &c->size);
+	if (size > c->size)
+		pexit("truncated Y4M file");
+
+	// frame headers may carry parameters, find every frame instead of assuming a fixed stride
+	c->nb_frames = 0;
+	c->offsets = NULL;
+	capacity = 0;
+	data = c->map->data + size;
+	end = c->map->data + c->size;
+	while (data < end) {
+		const uint8_t *eol;
+		size_t len = FFMIN(end - data, Y4M_FRAME_HEADER_MAX);
+
+		if (len < strlen(Y4M_FRAME_MAGIC) ||
+		    memcmp(data, Y4M_FRAME_MAGIC, strlen(Y4M_FRAME_MAGIC)))
+			pexit("invalid Y4M frame header");
+		eol = memchr(data, '\n', len);
+		if (!eol)
+			pexit("invalid Y4M frame header");
+		data = eol + 1;
+		if (end - data < frame_size)
+			break;
+
+		if (c->nb_frames == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			c->offsets = realloc(c->offsets, capacity * sizeof(uint64_t));
+			if (!c->offsets)
+				pexit("realloc failed");
+		}
+		c->offsets[c->nb_frames++] = data - c->map->data;
+		data += frame_size;
+	}
+	if (!c->nb_frames)
+		pexit("no frames in Y4M file");
+
+	// the demuxer numbers frames in its time base just the same
+	c->pts = malloc(c->nb_frames * sizeof(int64_t));
+	if (!c->pts)
+		pexit("malloc failed");
+	for (uint32_t i = 0; i < c->nb_frames; i++)
+		c->pts[i] = i;
+
+	return cache_source_wrap(c, time_base, frame_rate, queue_capacity);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2020 Oliver Wiedemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "cache.h"
+
+/**
+ * Check whether a file is an uncompressed YUV4MPEG2 video.
+ * @param path file to check
+ * @return 1 if path starts with a Y4M stream header, 0 otherwise
+ */
+int y4m_probe(const char *path);
+
+/**
+ * Initialize a source that emits the frames of a Y4M file without copying.
+ *
+ * The stream header is parsed by the yuv4mpegpipe demuxer, the file is
+ * mapped into memory and frames point into the mapping, to be run by
+ * cache_thread instead of reader and source decoder. An incomplete last
+ * frame is ignored. Calls pexit in case of a failure.
+ * @param path Y4M file to read
+ * @param queue_capacity output buffer size.
+ * @return dec_ctx to pass to cache_thread and encoder_init.
+ */
+dec_ctx *y4m_source_init(const char *path, int queue_capacity);